@@ -25,131 +25,128 @@
 #include <math.h>
 
 #include <algorithm>
-#include <functional>
-#include <queue>
-#include <random>
-#include <set>
+#include <utility>
+#include <vector>
 
-#include "../utils/graph.h"
 #include "parlay/parallel.h"
 #include "parlay/primitives.h"
 #include "parlay/random.h"
 
 namespace parlayANN {
-  
-std::pair<size_t, size_t>
-select_two_random(parlay::sequence<size_t> &active_indices,
-                  parlay::random &rnd) {
-  size_t first_index = rnd.ith_rand(0) % active_indices.size();
-  size_t second_index_unshifted = rnd.ith_rand(1) % (active_indices.size() - 1);
-  size_t second_index = (second_index_unshifted < first_index)
-                            ? second_index_unshifted
-                            : (second_index_unshifted + 1);
-
-  return {active_indices[first_index], active_indices[second_index]};
-}
-
-template <typename Point, typename PointRange, typename indexType>
-struct cluster {
-  using distanceType = typename Point::distanceType;
-  using edge = std::pair<indexType, indexType>;
-  using labelled_edge = std::pair<edge, distanceType>;
-  using GraphI = Graph<indexType>;
-  using PR = PointRange;
-
-  cluster() {}
-
-  int generate_index(int N, int i) {
-    return (N * (N - 1) - (N - i) * (N - i - 1)) / 2;
-  }
-
-  template <typename F>
-  void recurse(GraphI &G, PR &Points, parlay::sequence<size_t> &active_indices,
-               parlay::random &rnd, size_t cluster_size, F f, long MSTDeg,
-               indexType first, indexType second) {
-    // Split points based on which of the two points are closer.
-    auto closer_first =
-        parlay::filter(parlay::make_slice(active_indices), [&](size_t ind) {
-          distanceType dist_first = Points[ind].distance(Points[first]);
-          distanceType dist_second = Points[ind].distance(Points[second]);
-          return dist_first <= dist_second;
-        });
-
-    auto closer_second =
-        parlay::filter(parlay::make_slice(active_indices), [&](size_t ind) {
-          distanceType dist_first = Points[ind].distance(Points[first]);
-          distanceType dist_second = Points[ind].distance(Points[second]);
-          return dist_second < dist_first;
-        });
-
-    auto left_rnd = rnd.fork(0);
-    auto right_rnd = rnd.fork(1);
 
-    parlay::par_do(
-        [&]() {
-          random_clustering(G, Points, closer_first, left_rnd, cluster_size, f,
-                            MSTDeg);
-        },
-        [&]() {
-          random_clustering(G, Points, closer_second, right_rnd, cluster_size,
-                            f, MSTDeg);
-        });
+// Random cluster trees, shared by HCNNG and pyNNDescent.  Each tree
+// splits the points recursively by which of two random pivots they are
+// closer to, until there are at most cluster_size of them, and calls a
+// function on each leaf.
+//
+// Each point's distances to the two pivots are computed once per level,
+// in a single pass, and their difference is stored.  The ids are
+// partitioned blockwise between two buffers that alternate levels, so a
+// tree only needs three arrays of n elements however deep it is.  A
+// split that leaves less than a twentieth of the points on one side
+// (e.g. with duplicate points) is replaced by one at the median of the
+// stored differences.  Several trees are built at the same time, each
+// with its own buffers, and the seed of each tree depends only on the
+// seed and the tree's number, so builds are reproducible.
+template<typename PointRange>
+struct cluster_trees {
+  cluster_trees(const PointRange &Points, size_t cluster_size, uint64_t seed = 0)
+    : Points(Points), cluster_size(std::max<size_t>(cluster_size, 1)), seed(seed) {}
+
+  // Builds trees first, ..., first + count - 1 concurrently, and returns
+  // f(tree, ids) for each leaf of each tree (by tree, then leaf), where
+  // ids are the ids of the points in the leaf.
+  template<typename F>
+  auto leaves(long first, long count, F f) {
+    using R = decltype(f(0l, std::declval<parlay::sequence<size_t>&>()));
+    size_t n = Points.size();
+    while ((long) buffers.size() < count) buffers.push_back(tree_buffers(n));
+    parlay::sequence<std::vector<R>> results(count);
+    parlay::parallel_for(0, count, [&] (long t) {
+      auto &B = buffers[t];
+      parlay::parallel_for(0, n, [&] (size_t i) {B.ids[i] = i;});
+      parlay::random rnd = parlay::random(seed).fork(first + t);
+      results[t] = split(B, B.ids.begin(), B.tmp.begin(), 0, n, rnd,
+                         [&] (parlay::sequence<size_t> &ids) {return f(first + t, ids);});
+    }, 1);
+    return parlay::map(results, [] (auto &r) {return parlay::to_sequence(r);});
   }
 
-  template <typename F>
-  void random_clustering(GraphI &G, PR &Points,
-                         parlay::sequence<size_t> &active_indices,
-                         parlay::random &rnd, size_t cluster_size, F g,
-                         long MSTDeg) {
-    if (active_indices.size() <= cluster_size)
-      g(G, Points, active_indices, MSTDeg);
-    else {
-      auto [f, s] = select_two_random(active_indices, rnd);
-      if (Points[f] == Points[s]) {
-        parlay::sequence<size_t> closer_first;
-        parlay::sequence<size_t> closer_second;
-        for (int i = 0; i < active_indices.size(); i++) {
-          if (i < active_indices.size() / 2)
-            closer_first.push_back(active_indices[i]);
-          else
-            closer_second.push_back(active_indices[i]);
-        }
-        auto left_rnd = rnd.fork(0);
-        auto right_rnd = rnd.fork(1);
-        parlay::par_do(
-            [&]() {
-              random_clustering(G, Points, closer_first, left_rnd, cluster_size,
-                                g, MSTDeg);
-            },
-            [&]() {
-              random_clustering(G, Points, closer_second, right_rnd,
-                                cluster_size, g, MSTDeg);
-            });
-      } else {
-        recurse(G, Points, active_indices, rnd, cluster_size, g, MSTDeg, f, s);
-      }
+private:
+  using distanceType = typename PointRange::Point::distanceType;
+
+  struct tree_buffers {
+    tree_buffers(size_t n) : ids(n), tmp(n), diff(n) {}
+    parlay::sequence<size_t> ids;
+    parlay::sequence<size_t> tmp;
+    parlay::sequence<float> diff;
+  };
+
+  const PointRange &Points;
+  size_t cluster_size;
+  uint64_t seed;
+  std::vector<tree_buffers> buffers;
+
+  static constexpr size_t block_size = 2048;
+
+  // Splits the ids src[lo, hi) into dst[lo, hi), and recurses with the
+  // buffers swapped.
+  template<typename L>
+  auto split(tree_buffers &B, size_t* src, size_t* dst, size_t lo, size_t hi,
+             parlay::random rnd, const L &leaf) -> std::vector<decltype(leaf(B.ids))> {
+    using R = decltype(leaf(B.ids));
+    size_t n = hi - lo;
+    if (n <= cluster_size) {
+      auto ids = parlay::tabulate(n, [&] (size_t i) {return src[lo + i];});
+      std::vector<R> r;
+      r.push_back(leaf(ids));
+      return r;
     }
-  }
 
-  template <typename F>
-  void random_clustering_wrapper(GraphI &G, PR &Points, size_t cluster_size,
-                                 F f, long MSTDeg) {
-    std::random_device rd;
-    std::mt19937 rng(rd());
-    std::uniform_int_distribution<int> uni(0, Points.size());
-    parlay::random rnd(uni(rng));
-    auto active_indices =
-        parlay::tabulate(Points.size(), [&](size_t i) { return i; });
-    random_clustering(G, Points, active_indices, rnd, cluster_size, f, MSTDeg);
-  }
-
-  template <typename F>
-  void multiple_clustertrees(GraphI &G, PR &Points, long cluster_size,
-                             long num_clusters, F f, long MSTDeg) {
-    for (long i = 0; i < num_clusters; i++) {
-      random_clustering_wrapper(G, Points, cluster_size, f, MSTDeg);
-      std::cout << "Built cluster " << i << " of " << num_clusters << std::endl;
+    size_t first = rnd.ith_rand(0) % n;
+    size_t second = rnd.ith_rand(1) % (n - 1);
+    if (second >= first) second++;
+    auto f = Points[src[lo + first]];
+    auto s = Points[src[lo + second]];
+    float* diff = B.diff.begin();
+    parlay::parallel_for(lo, hi, [&] (size_t i) {
+      auto p = Points[src[i]];
+      diff[i] = (float) p.distance(f) - (float) p.distance(s);
+    });
+
+    // blockwise partition: the points closer to (or as close to) the
+    // first pivot go first
+    size_t num_blocks = (n - 1) / block_size + 1;
+    auto offsets = parlay::tabulate(num_blocks, [&] (size_t b) {
+      size_t end = std::min(hi, lo + (b + 1) * block_size);
+      size_t c = 0;
+      for (size_t i = lo + b * block_size; i < end; i++) c += (diff[i] <= 0);
+      return c;
+    });
+    size_t num_left = parlay::scan_inplace(offsets);
+    if (std::min(num_left, n - num_left) < n / 20) {
+      auto order = parlay::sort(parlay::tabulate(n, [&] (size_t i) {
+        return std::make_pair(diff[lo + i], src[lo + i]);}));
+      parlay::parallel_for(0, n, [&] (size_t i) {dst[lo + i] = order[i].second;});
+      num_left = n / 2;
+    } else {
+      parlay::parallel_for(0, num_blocks, [&] (size_t b) {
+        size_t end = std::min(hi, lo + (b + 1) * block_size);
+        size_t l = lo + offsets[b];
+        size_t r = lo + num_left + b * block_size - offsets[b];
+        for (size_t i = lo + b * block_size; i < end; i++) {
+          if (diff[i] <= 0) dst[l++] = src[i];
+          else dst[r++] = src[i];
+        }
+      });
     }
+
+    std::vector<R> left, right;
+    parlay::par_do(
+      [&] () {left = split(B, dst, src, lo, lo + num_left, rnd.fork(0), leaf);},
+      [&] () {right = split(B, dst, src, lo + num_left, hi, rnd.fork(1), leaf);});
+    for (auto &r : right) left.push_back(std::move(r));
+    return left;
   }
 };
 
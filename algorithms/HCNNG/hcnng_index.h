@@ -21,71 +21,62 @@
 // WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "../utils/graph.h"
+#include "../utils/prune.h"
+#include "../utils/telemetry.h"
 #include "clusterEdge.h"
 #include "parlay/parallel.h"
 #include "parlay/primitives.h"
 #include "parlay/random.h"
 #include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <math.h>
+#include <memory>
 #include <queue>
 #include <random>
 #include <set>
 
 namespace parlayANN {
   
+// Union-find that can be searched concurrently: find uses path
+// halving with atomic writes, so finds running in parallel (e.g. while
+// filtering edges in filter-Kruskal) only ever shorten paths.  Unions
+// are not concurrent with each other.
 struct DisjointSet {
-  parlay::sequence<int> parent;
+  std::unique_ptr<std::atomic<int>[]> parent;
   parlay::sequence<int> rank;
   size_t N;
+  size_t components;
 
-  DisjointSet(size_t size) {
-    N = size;
-    parent = parlay::sequence<int>(N);
-    rank = parlay::sequence<int>(N);
+  DisjointSet(size_t size)
+    : parent(new std::atomic<int>[size]), rank(size, 0), N(size), components(size) {
     parlay::parallel_for(0, N, [&](size_t i) {
-      parent[i] = i;
-      rank[i] = 0;
-    });
-  }
-
-  void _union(int x, int y) {
-    int xroot = parent[x];
-    int yroot = parent[y];
-    int xrank = rank[x];
-    int yrank = rank[y];
-    if (xroot == yroot)
-      return;
-    else if (xrank < yrank)
-      parent[xroot] = yroot;
-    else {
-      parent[yroot] = xroot;
-      if (xrank == yrank)
-        rank[xroot] = rank[xroot] + 1;
-    }
+      parent[i].store(i, std::memory_order_relaxed);});
   }
 
   int find(int x) {
-    if (parent[x] != x)
-      parent[x] = find(parent[x]);
-    return parent[x];
+    while (true) {
+      int p = parent[x].load(std::memory_order_relaxed);
+      if (p == x) return x;
+      int gp = parent[p].load(std::memory_order_relaxed);
+      if (gp != p) parent[x].compare_exchange_weak(p, gp, std::memory_order_relaxed);
+      x = gp;
+    }
   }
 
-  void flatten() {
-    for (int i = 0; i < N; i++)
-      find(i);
+  // unites the sets of x and y, returning false if they already were one
+  bool _union(int x, int y) {
+    int xroot = find(x);
+    int yroot = find(y);
+    if (xroot == yroot) return false;
+    if (rank[xroot] < rank[yroot]) std::swap(xroot, yroot);
+    parent[yroot].store(xroot, std::memory_order_relaxed);
+    if (rank[xroot] == rank[yroot]) rank[xroot]++;
+    components--;
+    return true;
   }
 
-  bool is_full() {
-    flatten();
-    parlay::sequence<bool> truthvals(N);
-    parlay::parallel_for(
-        0, N, [&](size_t i) { truthvals[i] = (parent[i] == parent[0]); });
-    auto ff = [&](bool a) { return not a; };
-    auto filtered = parlay::filter(truthvals, ff);
-    if (filtered.size() == 0)
-      return true;
-    return false;
-  }
+  bool is_full() const {return components == 1;}
 };
 
 template <typename Point, typename PointRange, typename indexType>
@@ -104,8 +95,7 @@ struct hcnng_index {
     for (indexType i = 0; i < G[p].size(); i++) {
       points.push_back(G[p][i]);
     }
-    auto np = parlay::remove_duplicates(points);
-    G[p].update_neighbors(points);
+    G[p].update_neighbors(parlay::remove_duplicates(points));
   }
 
   void remove_all_duplicates(GraphI &G) {
@@ -113,119 +103,154 @@ struct hcnng_index {
                          [&](size_t i) { remove_edge_duplicates(i, G); });
   }
 
-  // inserts each edge after checking for duplicates
-  static void process_edges(GraphI &G, parlay::sequence<edge> edges) {
-    long maxDeg = G.max_degree();
+  // what process_edges did, for the build telemetry
+  struct merge_counts {
+    long distance_comps = 0;
+    long prunes = 0;
+    long degree_change = 0;
+  };
+
+  // Adds the edges to G.  The edges are grouped by source and the groups
+  // are merged in parallel: each vertex's current neighbors and new ones
+  // are sorted and deduplicated, and if there are more than the max
+  // degree, the closest ones are kept.  Each vertex is written by one
+  // task, so leaves with disjoint points can add their edges at the same
+  // time.
+  static merge_counts process_edges(GraphI &G, PR &Points, parlay::sequence<edge> edges) {
+    size_t maxDeg = G.max_degree();
     auto grouped = parlay::group_by_key(edges);
-    for (auto pair : grouped) {
-      auto [index, candidates] = pair;
-      for (auto c : candidates) {
-        if (G[index].size() < maxDeg) {
-          G[index].append_neighbor(c);
-        } else {
-          remove_edge_duplicates(index, G);
-          G[index].append_neighbor(c);
-        }
+    auto counts = parlay::tabulate(grouped.size(), [&](size_t i) {
+      auto &[index, candidates] = grouped[i];
+      auto nbhs = G[index];
+      merge_counts mc;
+      mc.degree_change = -(long) nbhs.size();
+      for (size_t j = 0; j < nbhs.size(); j++) candidates.push_back(nbhs[j]);
+      std::sort(candidates.begin(), candidates.end());
+      candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+      if (candidates.size() > maxDeg) {
+        auto by_distance = parlay::map(candidates, [&](indexType c) {
+          return std::make_pair(Points[index].distance(Points[c]), c);});
+        std::nth_element(by_distance.begin(), by_distance.begin() + maxDeg, by_distance.end());
+        mc.distance_comps = candidates.size();
+        mc.prunes = 1;
+        candidates = parlay::tabulate(maxDeg, [&](size_t j) {return by_distance[j].second;});
+      }
+      G[index].update_neighbors(candidates);
+      mc.degree_change += candidates.size();
+      return mc;
+    }, 1);
+    merge_counts total;
+    total.distance_comps = parlay::reduce(parlay::map(counts, [] (auto &mc) {return mc.distance_comps;}));
+    total.prunes = parlay::reduce(parlay::map(counts, [] (auto &mc) {return mc.prunes;}));
+    total.degree_change = parlay::reduce(parlay::map(counts, [] (auto &mc) {return mc.degree_change;}));
+    return total;
+  }
+
+  // Distances from leaf point i to the others, computed on a tile of the
+  // gathered leaf points in blocks of four (vectorized for float points,
+  // see tile_distances), keeping the m closest as edges (i, j) with i < j.
+  static parlay::sequence<labelled_edge>
+  closest_in_leaf(const prune_tile &tile, const typename Point::parameters &params,
+                  long N, long i, long m) {
+    auto less = [&](labelled_edge a, labelled_edge b) {return a.second < b.second;};
+    std::vector<labelled_edge> best;
+    best.reserve(m + 1);
+    long idx[4];
+    distanceType dists[4];
+    for (long j = 0; j < N;) {
+      int cnt = 0;
+      for (; j < N && cnt < 4; j++)
+        if (j != i) idx[cnt++] = j;
+      if (cnt == 0) break;
+      tile_distances<Point>(tile, i, idx, cnt, params, dists);
+      for (int r = 0; r < cnt; r++) {
+        if ((long) best.size() == m && !(dists[r] < best.back().second)) continue;
+        indexType u = std::min(i, idx[r]), v = std::max(i, idx[r]);
+        labelled_edge e = std::make_pair(std::make_pair(u, v), dists[r]);
+        best.insert(std::upper_bound(best.begin(), best.end(), e, less), e);
+        if ((long) best.size() > m) best.pop_back();
       }
     }
+    return parlay::to_sequence(best);
   }
 
-  // parameters dim and K are just to interface with the cluster tree code
-  static void MSTk(GraphI &G, PR &Points,
-                   parlay::sequence<size_t> &active_indices, long MSTDeg) {
-    // preprocessing for Kruskal's
-    size_t N = active_indices.size();
-    long dim = Points.dimension();
-    DisjointSet *disjset = new DisjointSet(N);
-    size_t m = 10;
+  // Kruskal's algorithm with a degree bound, on the edges in increasing
+  // order of (distance, endpoints), stopping once the tree spans the leaf.
+  static void bounded_kruskal(parlay::sequence<labelled_edge> &edges, DisjointSet &disjset,
+                              parlay::sequence<long> &degrees, long MSTDeg,
+                              parlay::sequence<edge> &tree) {
     auto less = [&](labelled_edge a, labelled_edge b) {
-      return a.second < b.second;
-    };
-    parlay::sequence<parlay::sequence<labelled_edge>> pre_labelled(N);
-    parlay::parallel_for(0, N, [&](size_t i) {
-      std::priority_queue<labelled_edge, std::vector<labelled_edge>,
-                          decltype(less)>
-          Q(less);
-      for (indexType j = 0; j < N; j++) {
-        if (j != i) {
-          distanceType dist_ij =
-              Points[active_indices[i]].distance(Points[active_indices[j]]);
-          if (Q.size() >= m) {
-            distanceType topdist = Q.top().second;
-            if (dist_ij < topdist) {
-              labelled_edge e;
-              if (i < j)
-                e = std::make_pair(std::make_pair(i, j), dist_ij);
-              else
-                e = std::make_pair(std::make_pair(j, i), dist_ij);
-              Q.pop();
-              Q.push(e);
-            }
-          } else {
-            labelled_edge e;
-            if (i < j)
-              e = std::make_pair(std::make_pair(i, j), dist_ij);
-            else
-              e = std::make_pair(std::make_pair(j, i), dist_ij);
-            Q.push(e);
-          }
-        }
-      }
-      indexType limit = std::min(Q.size(), m);
-      parlay::sequence<labelled_edge> edges(limit);
-      for (indexType j = 0; j < limit; j++) {
-        edges[j] = Q.top();
-        Q.pop();
-      }
-      pre_labelled[i] = edges;
-    });
-    auto flat_edges = parlay::flatten(pre_labelled);
-    auto less_dup = [&](labelled_edge a, labelled_edge b) {
-      auto dist_a = a.second;
-      auto dist_b = b.second;
-      if (dist_a == dist_b) {
-        int i_a = a.first.first;
-        int j_a = a.first.second;
-        int i_b = b.first.first;
-        int j_b = b.first.second;
-        if ((i_a == i_b) && (j_a == j_b)) {
-          return true;
-        } else {
-          if (i_a != i_b)
-            return i_a < i_b;
-          else
-            return j_a < j_b;
-        }
-      } else
-        return (dist_a < dist_b);
+      if (a.second != b.second) return a.second < b.second;
+      return a.first < b.first;
     };
-    auto labelled_edges =
-        parlay::remove_duplicates_ordered(flat_edges, less_dup);
-    auto degrees =
-        parlay::tabulate(active_indices.size(), [&](size_t i) { return 0; });
-    parlay::sequence<edge> MST_edges = parlay::sequence<edge>();
-    // modified Kruskal's algorithm
-    for (indexType i = 0; i < labelled_edges.size(); i++) {
-      labelled_edge e_l = labelled_edges[i];
-      edge e = e_l.first;
-      if ((disjset->find(e.first) != disjset->find(e.second)) &&
-          (degrees[e.first] < MSTDeg) && (degrees[e.second] < MSTDeg)) {
-        MST_edges.push_back(
-            std::make_pair(active_indices[e.first], active_indices[e.second]));
-        MST_edges.push_back(
-            std::make_pair(active_indices[e.second], active_indices[e.first]));
-        degrees[e.first] += 1;
-        degrees[e.second] += 1;
-        disjset->_union(e.first, e.second);
-      }
-      if (i % N == 0) {
-        if (disjset->is_full()) {
-          break;
-        }
+    parlay::sort_inplace(edges, less);
+    for (auto [e, d] : edges) {
+      if (disjset.is_full()) return;
+      if (degrees[e.first] < MSTDeg && degrees[e.second] < MSTDeg &&
+          disjset._union(e.first, e.second)) {
+        tree.push_back(e);
+        degrees[e.first]++;
+        degrees[e.second]++;
       }
     }
-    delete disjset;
-    process_edges(G, std::move(MST_edges));
+  }
+
+  // Filter-Kruskal: the edges lighter than a sampled pivot are processed
+  // first, and then the heavier ones that can still be added (their ends
+  // are in different components and below the degree bound) are found by
+  // a parallel filter, which drops most of them without sorting them.
+  static void filter_kruskal(parlay::sequence<labelled_edge> edges, DisjointSet &disjset,
+                             parlay::sequence<long> &degrees, long MSTDeg,
+                             parlay::sequence<edge> &tree) {
+    constexpr size_t base_size = 2048;
+    if (edges.size() <= base_size) {
+      bounded_kruskal(edges, disjset, degrees, MSTDeg, tree);
+      return;
+    }
+    parlay::random rnd(edges.size());
+    auto sample = parlay::sort(parlay::tabulate(63, [&](size_t i) {
+      return edges[rnd.ith_rand(i) % edges.size()].second;}));
+    distanceType pivot = sample[31];
+    auto light = parlay::filter(edges, [&](labelled_edge e) {return e.second <= pivot;});
+    if (light.size() == edges.size()) {
+      bounded_kruskal(edges, disjset, degrees, MSTDeg, tree);
+      return;
+    }
+    auto heavy = parlay::filter(edges, [&](labelled_edge e) {return e.second > pivot;});
+    edges.clear();
+    filter_kruskal(std::move(light), disjset, degrees, MSTDeg, tree);
+    if (disjset.is_full()) return;
+    heavy = parlay::filter(heavy, [&](labelled_edge e) {
+      auto [u, v] = e.first;
+      return degrees[u] < MSTDeg && degrees[v] < MSTDeg && disjset.find(u) != disjset.find(v);
+    });
+    filter_kruskal(std::move(heavy), disjset, degrees, MSTDeg, tree);
+  }
+
+  // The edges (in both directions) of a degree bounded MST on the
+  // points of a leaf
+  static parlay::sequence<edge> MSTk(PR &Points, parlay::sequence<size_t> &active_indices,
+                                     long MSTDeg) {
+    // the 10 closest points to each point of the leaf are the candidate
+    // edges of a degree bounded MST
+    size_t N = active_indices.size();
+    long m = 10;
+    prune_tile tile;
+    int num_bytes = Points.params.num_bytes();
+    tile.reserve(N, num_bytes);
+    parlay::parallel_for(0, N, [&](size_t i) {
+      std::memcpy(tile.row(i), Points.location(active_indices[i]), num_bytes);});
+    auto labelled_edges = parlay::flatten(parlay::tabulate(N, [&](size_t i) {
+      return closest_in_leaf(tile, Points.params, N, i, m);}));
+
+    DisjointSet disjset(N);
+    auto degrees = parlay::sequence<long>(N, 0);
+    parlay::sequence<edge> tree;
+    filter_kruskal(std::move(labelled_edges), disjset, degrees, MSTDeg, tree);
+    return parlay::flatten(parlay::map(tree, [&](edge e) {
+      indexType u = active_indices[e.first], v = active_indices[e.second];
+      return parlay::sequence<edge>({std::make_pair(u, v), std::make_pair(v, u)});
+    }));
   }
 
   // robustPrune routine as found in DiskANN paper, with the exception that the
@@ -233,51 +258,49 @@ struct hcnng_index {
   // replacing the out_nbh of p
   void robustPrune(indexType p, PR &Points, GraphI &G, double alpha) {
     // add out neighbors of p to the candidate set.
-    parlay::sequence<pid> candidates;
+    std::vector<pid> candidates;
     for (size_t i = 0; i < G[p].size(); i++) {
       candidates.push_back(
           std::make_pair(G[p][i], Points[p].distance(Points[G[p][i]])));
     }
-
-    // Sort the candidate set in reverse order according to distance from p.
-    auto less = [&](pid a, pid b) { return a.second < b.second; };
-    parlay::sort_inplace(candidates, less);
-
-    parlay::sequence<int> new_nbhs = parlay::sequence<int>();
-
-    size_t candidate_idx = 0;
-    while (new_nbhs.size() < G.max_degree() &&
-           candidate_idx < candidates.size()) {
-      // Don't need to do modifications.
-      indexType p_star = candidates[candidate_idx].first;
-      candidate_idx++;
-      if (p_star == p)
-        continue;
-
-      new_nbhs.push_back(p_star);
-
-      for (size_t i = candidate_idx; i < candidates.size(); i++) {
-        indexType p_prime = candidates[i].first;
-        if (p_prime != -1) {
-          distanceType dist_starprime =
-              Points[p_star].distance(Points[p_prime]);
-          distanceType dist_pprime = candidates[i].second;
-          if (alpha * dist_starprime <= dist_pprime)
-            candidates[i].first = -1;
-        }
-      }
-    }
+    auto [new_nbhs, distance_comps] =
+        blocked_robust_prune(p, candidates, Points, alpha, G.max_degree());
     G[p].update_neighbors(new_nbhs);
   }
 
+  // Builds the cluster trees trees_at_once at a time, adding the MST
+  // edges of the leaves of each round of trees to G.  The edges of a
+  // round are kept until it ends, which bounds the extra memory to
+  // 2 * MSTDeg * trees_at_once edges per point.
   void build_index(GraphI &G, PR &Points, long cluster_rounds,
-                   long cluster_size, long MSTDeg) {
-    cluster<Point, PointRange, indexType> C;
-    C.multiple_clustertrees(G, Points, cluster_size, cluster_rounds, MSTk,
-                            MSTDeg);
-    remove_all_duplicates(G);
-    // parlay::parallel_for(0, v.size(), [&] (size_t i){robustPrune(v[i],
-    // v, 1.1, maxDeg);});
+                   long cluster_size, long MSTDeg, long trees_at_once = 4) {
+    cluster_trees<PR> C(Points, cluster_size);
+    build_telemetry &telemetry = build_telemetry::get();
+    // the sum of the degrees, kept up to date from the merges
+    long degree_sum = parlay::reduce(parlay::delayed_tabulate(G.size(), [&] (size_t j) {
+      return (long) G[j].size();}));
+    for (long first = 0; first < cluster_rounds; first += trees_at_once) {
+      long count = std::min(trees_at_once, cluster_rounds - first);
+      parlay::internal::timer t;
+      // each leaf point is compared with the others of its leaf
+      std::atomic<long> leaf_comps = 0;
+      auto edges = C.leaves(first, count, [&](long, parlay::sequence<size_t> &ids) {
+        leaf_comps += (long) ids.size() * (ids.size() - 1);
+        return MSTk(Points, ids, MSTDeg);});
+      merge_counts merged = process_edges(G, Points, parlay::flatten(parlay::flatten(edges)));
+      degree_sum += merged.degree_change;
+      std::cout << "Built clusters " << first << " to " << first + count - 1
+                << " of " << cluster_rounds << std::endl;
+      if (telemetry.enabled()) {
+        telemetry_record r("hcnng", "trees");
+        r.add("first_tree", first).add("trees", count).add("cluster_size", cluster_size)
+          .add("trees_s", t.total_time())
+          .add("distance_comps", leaf_comps.load() + merged.distance_comps)
+          .add("prunes", merged.prunes)
+          .add("avg_degree", degree_sum / (double) G.size());
+        telemetry.write(r, true);
+      }
+    }
   }
 };
 
@@ -48,7 +48,10 @@ void ANN(Graph<indexType> &G, long k, BuildParams &BP,
   double idx_time;
   if(!graph_built){
     findex I;
+    set_telemetry_recall(G, Points, Query_Points, GT, (indexType) 0);
     I.build_index(G, Points, BP.num_clusters, BP.cluster_size, BP.MST_deg);
+    clear_telemetry_recall();
+    G.compact();
     idx_time = t.next_time();
   } else{idx_time=0;}
   std::string name = "HCNNG";
@@ -57,7 +60,8 @@ void ANN(Graph<indexType> &G, long k, BuildParams &BP,
   Graph_ G_(name, params, G.size(), avg_deg, max_deg, idx_time);
   G_.print();
   if(Query_Points.size() != 0)
-    search_and_parse(G_, G, Points, Query_Points, GT, res_file, k, BP.verbose);
+    search_and_parse(G_, G, Points, Query_Points, GT, res_file, k, BP.verbose, 0, BP.exact_visited,
+                     BP.time_limit, BP.dist_budget);
 }
 
 } // end namespace
@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdarg>
+#include <cstring>
 #include <cassert>
 #include <cmath>
 #include <algorithm>
@@ -22,6 +23,10 @@
 #include <type_traits>
 #include <limits>
 #include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 // #include "parallelize.h"
 #include <parlay/parallel.h>
 #include <parlay/primitives.h>
@@ -29,6 +34,9 @@
 #include <parlay/random.h>
 #include "debug.hpp"
 #include "../utils/beamSearch.h"
+#include "../utils/graph.h"
+#include "../utils/mmap.h"
+#include "../utils/telemetry.h"
 #define DEBUG_OUTPUT 0
 #if DEBUG_OUTPUT
 #define debug_output(...) fprintf(stderr, __VA_ARGS__)
@@ -70,6 +78,8 @@ public:
 	/*
 		Construct from the saved model
 		getter(i) returns the actual data (convertible to type T) of the vector with id i
+		A model in the flat format (version 4, see save) is mapped read-only and searched
+		in place; one in the old format (version 3) is read into memory
 	*/
 	template<typename G>
 	HNSW(const std::string &filename_model, G getter);
@@ -78,7 +88,7 @@ public:
 		const T &q, uint32_t k, uint32_t ef, const search_control &ctrl={}
 	);
 	// parlay::sequence<std::tuple<uint32_t,uint32_t,float>> search_ex(const T &q, uint32_t k, uint32_t ef, uint64_t verbose=0);
-	// save the current model to a file
+	// save the current model to a file in the flat format
 	void save(const std::string &filename_model) const;
 public:
 	typedef uint32_t type_index;
@@ -86,6 +96,8 @@ public:
 	struct node{
 		// uint32_t id;
 		uint32_t level;
+		// the neighbors on levels 1..level (nullptr if level is 0);
+		// level 0 is kept in layer0
 		parlay::sequence<node_id> *neighbors;
 		T data;
 	};
@@ -138,24 +150,129 @@ public:
 	uint32_t n;
 	Allocator<node> allocator;
 	parlay::sequence<node> node_pool;
+	// The neighbors on level 0, which every node is in and where most of
+	// a search is spent, in one array with a fixed stride of
+	// get_threshold_m(0)+1 slots per node (see parlayANN::Graph), so that
+	// a hop reads one contiguous list and can prefetch it.
+	Graph<node_id> layer0;
+	// Once a model is built or loaded, its upper levels are kept in CSR
+	// form: the neighbors of pu on level l>0 are
+	// upper_edges[upper_offsets[i], upper_offsets[i+1]) for
+	// i = upper_begin[pu]+l-1.  A model mapped from a file in the flat
+	// format keeps them (and layer0) in the mapped file, and one built or
+	// loaded from version 3 in upper_csr (see compact_upper_levels).  The
+	// per node lists in node::neighbors are only used while inserting,
+	// so such a model is read-only.
+	struct upper_levels{
+		parlay::sequence<uint64_t> begin, offsets;
+		parlay::sequence<node_id> edges;
+	};
+	std::shared_ptr<char> mapping;
+	std::shared_ptr<const upper_levels> upper_csr;
+	const uint64_t *upper_begin = nullptr;
+	const uint64_t *upper_offsets = nullptr;
+	const node_id *upper_edges = nullptr;
+
+	void compact_upper_levels();
+
+	// The flat model format (version 4) is this header followed by the
+	// sections below, each starting at a multiple of 64 bytes:
+	//   ids            uint32[n]     the id of the vector of each node
+	//   levels         uint32[n]     the top level of each node
+	//   upper_begin    uint64[n+1]   the level offsets into upper_offsets
+	//   upper_offsets  uint64[num_upper+1]
+	//   upper_edges    uint32[num_upper_edges]
+	//   entrance       uint32[num_entrance]
+	//   layer0         uint32[n*(degree0+1)], as in parlayANN::Graph
+	struct flat_header{
+		char type[4]; // "HNSW"
+		uint32_t version;
+		uint64_t code_U; // typeid(U).hash_code()^sizeof(U), as in version 3
+		uint32_t size_elem; // sizeof(U::type_elem)
+		uint32_t size_point; // sizeof(T)
+		uint32_t dim;
+		float m_l;
+		uint32_t m;
+		uint32_t ef_construction;
+		float alpha;
+		uint32_t n;
+		uint32_t degree0;
+		uint32_t num_entrance;
+		uint64_t num_upper;
+		uint64_t num_upper_edges;
+	};
+
+	// the byte offsets of the sections of a flat model
+	struct flat_layout{
+		size_t ids, levels, upper_begin, upper_offsets, upper_edges, entrance, layer0, size;
+
+		flat_layout(const flat_header &h){
+			auto after = [](size_t begin, size_t bytes){return (begin+bytes+63)/64*64;};
+			ids = after(0, sizeof(flat_header));
+			levels = after(ids, sizeof(uint32_t)*h.n);
+			upper_begin = after(levels, sizeof(uint32_t)*h.n);
+			upper_offsets = after(upper_begin, sizeof(uint64_t)*(h.n+1));
+			upper_edges = after(upper_offsets, sizeof(uint64_t)*(h.num_upper+1));
+			entrance = after(upper_edges, sizeof(node_id)*h.num_upper_edges);
+			layer0 = after(entrance, sizeof(node_id)*h.num_entrance);
+			size = layer0 + sizeof(node_id)*size_t(h.n)*(h.degree0+1);
+		}
+	};
+
+	template<typename G>
+	void load_mapped(const std::string &filename_model, G getter);
 	mutable parlay::sequence<size_t> total_visited = parlay::sequence<size_t>(parlay::num_workers());
 	mutable parlay::sequence<size_t> total_eval = parlay::sequence<size_t>(parlay::num_workers());
 	mutable parlay::sequence<size_t> total_size_C = parlay::sequence<size_t>(parlay::num_workers());
 	mutable parlay::sequence<size_t> total_range_candidate = parlay::sequence<size_t>(parlay::num_workers());
 
-	static auto neighbourhood(node &u, uint32_t level)
-		-> parlay::sequence<node_id>&
+	using nbh_slice = parlay::slice<const node_id*, const node_id*>;
+
+	// the neighbors of pu on the given level (at most the level of pu)
+	nbh_slice neighbourhood(node_id pu, uint32_t level) const
+	{
+		if(level==0)
+		{
+			auto e = layer0[pu];
+			return parlay::make_slice((const node_id*)e.begin(), (const node_id*)e.begin()+e.size());
+		}
+		if(upper_offsets)
+		{
+			const auto i = upper_begin[pu]+level-1;
+			return parlay::make_slice(upper_edges+upper_offsets[i], upper_edges+upper_offsets[i+1]);
+		}
+		const auto &nbh = get_node(pu).neighbors[level-1];
+		return parlay::make_slice(nbh.begin(), nbh.end());
+	}
+
+	template<class Seq>
+	void set_neighbourhood(node_id pu, uint32_t level, const Seq &nbh)
+	{
+		if(level==0)
+			layer0[pu].update_neighbors(nbh);
+		else
+		{
+			auto &nbh_u = get_node(pu).neighbors[level-1];
+			nbh_u.clear();
+			nbh_u.insert(nbh_u.end(), nbh.begin(), nbh.end());
+		}
+	}
+
+	template<class Seq>
+	void add_neighbourhood(node_id pu, uint32_t level, const Seq &nbh)
 	{
-		// const constexpr auto level_none = std::numeric_limits<uint32_t>::max();
-		// return level==level_none? u.final_nbh: u.neighbors[level];
-		// return level==0? u.final_nbh: u.neighbors[level];
-		return u.neighbors[level];
+		if(level==0)
+			layer0[pu].append_neighbors(nbh);
+		else
+		{
+			auto &nbh_u = get_node(pu).neighbors[level-1];
+			nbh_u.insert(nbh_u.end(), nbh.begin(), nbh.end());
+		}
 	}
 
-	static auto neighbourhood(const node &u, uint32_t level)
-		-> const parlay::sequence<node_id>&
+	static parlay::sequence<node_id>* new_upper_levels(uint32_t level)
 	{
-		return neighbourhood(const_cast<node&>(u),level);
+		return level==0? nullptr: new parlay::sequence<node_id>[level];
 	}
 
 	node& get_node(node_id id)
@@ -198,23 +315,22 @@ public:
 	};
 
 	struct graph{
-		template<class Nbh>
 		struct edgeRange{
-			edgeRange(Nbh &nbh) : nbh(nbh){
+			edgeRange(nbh_slice nbh) : nbh(nbh){
 			}
-			decltype(auto) operator[](node_id pu) const{
-				return nbh.get()[pu];
+			node_id operator[](node_id pu) const{
+				return nbh[pu];
 			}
 			auto size() const{
-				return nbh.get().size();
+				return nbh.size();
 			}
 			void prefetch() const{
 				int l = (size() * sizeof(node_id))/64;
 				for (int i=0; i < l; i++)
-					__builtin_prefetch((char*) nbh.get().data() + i*64);
+					__builtin_prefetch((const char*) nbh.begin() + i*64);
 			}
 
-			std::reference_wrapper<Nbh> nbh;
+			nbh_slice nbh;
 		};
 
 		using nid_t = node_id;
@@ -229,20 +345,14 @@ public:
 		decltype(auto) get_node(node_id pu) const{
 			return hnsw.get().get_node(pu);
 		}
-		decltype(auto) get_edges(node_id pu){
-			return hnsw.get().neighbourhood(hnsw.get().get_node(pu),l);
-		}
-		decltype(auto) get_edges(node_id pu) const{
-			return hnsw.get().neighbourhood(hnsw.get().get_node(pu),l);
+		auto get_edges(node_id pu) const{
+			return hnsw.get().neighbourhood(pu,l);
 		}
 
 		uint32_t max_degree() const{
 			return hnsw.get().get_threshold_m(l);
 		}
 
-		auto operator[](node_id pu){
-			return edgeRange(get_edges(pu));
-		}
 		auto operator[](node_id pu) const{
 			return edgeRange(get_edges(pu));
 		}
@@ -251,9 +361,16 @@ public:
 		uint32_t l;
 	};
 
+	// what a batch of inserts did, for the build telemetry
+	struct insert_counts{
+		size_t distance_comps = 0;
+		size_t prunes = 0;
+		int64_t degree_change = 0; // of layer 0
+	};
+
 	// node* insert(const T &q, uint32_t id);
 	template<typename Iter>
-	void insert(Iter begin, Iter end, bool from_blank);
+	void insert(Iter begin, Iter end, bool from_blank, insert_counts *counts=nullptr);
 
 	template<typename Queue>
 	void select_neighbors_simple_impl(const T &u, Queue &C, uint32_t M)
@@ -338,7 +455,7 @@ public:
 			W_tmp.insert(e.u);
 			if(extendCandidate)
 			{
-				for(node_id e_adj : neighbourhood(get_node(e.u),level))
+				for(node_id e_adj : neighbourhood(e.u,level))
 				{
 					// if(e_adj==nullptr) continue; // TODO: check
 					if(W_tmp.find(e_adj)==W_tmp.end())
@@ -429,7 +546,7 @@ public:
 
 	template<class Seq_, class D, class G, class Seq=std::remove_cv_t<std::remove_reference_t<Seq_>>>
 	Seq prune_heuristic(
-		Seq_ &&cand, uint32_t size, D f_dist, G g) const
+		Seq_ &&cand, uint32_t size, D f_dist, G g, uint32_t *count_cmps=nullptr) const
 	{
 		using nid_t = node_id;
 		using conn = dist;
@@ -468,6 +585,7 @@ public:
 					g.get_node(c.u).data,
 					g.get_node(r.u).data
 				);
+				if(count_cmps) ++*count_cmps;
 				if(d_cr<d_cu)
 				{
 					is_pruned = true;
@@ -488,7 +606,8 @@ public:
 	auto select_neighbors(const T &u, 
 		/*const std::priority_queue<dist,parlay::sequence<dist>,farthest> &C,*/
 		const parlay::sequence<dist> &C, uint32_t M,
-		uint32_t level, bool extendCandidate=false, bool keepPrunedConnections=false)
+		uint32_t level, bool extendCandidate=false, bool keepPrunedConnections=false,
+		uint32_t *count_cmps=nullptr)
 	{
 		/*
 		(void)level, (void)extendCandidate, (void)keepPrunedConnections;
@@ -498,7 +617,7 @@ public:
 
 		dist_evaluator f_dist(u, dim);
 		graph g(*this, level);
-		auto res = prune_heuristic(C, M, f_dist, g);
+		auto res = prune_heuristic(C, M, f_dist, g, count_cmps);
 		return parlay::tabulate(res.size(), [&](size_t i){return res[i].u;});
 	}
 
@@ -535,10 +654,10 @@ public:
 	{
 		parlay::sequence<uint32_t> res;
 		res.reserve(node_pool.size());
-		for(const node &e : node_pool)
+		for(node_id pu=0; pu<node_pool.size(); ++pu)
 		{
-			if(e.level>=level)
-				res.push_back(e.neighbors[level].size());
+			if(get_node(pu).level>=level)
+				res.push_back(neighbourhood(pu,level).size());
 		}
 		return res;
 	}
@@ -552,10 +671,10 @@ public:
 			res = new uint32_t[n];
 			for(uint32_t i=0; i<n; ++i)
 				res[i] = 0;
-			for(const node_id pu : node_pool)
+			for(node_id pu=0; pu<n; ++pu)
 			{
 				if(get_node(pu).level<level) continue;
-				for(const node_id pv : get_node(pu).neighbors[level])
+				for(const node_id pv : neighbourhood(pu,level))
 					res[U::get_id(get_node(pv).data)]++;
 			}
 		}
@@ -572,7 +691,7 @@ public:
 		auto cnt_each = parlay::delayed_seq<size_t>(n, [&](size_t i){
 			node_id pu = i;
 			return get_node(pu).level<l? 0:
-				neighbourhood(get_node(pu),l).size();
+				neighbourhood(pu,l).size();
 		});
 		return parlay::reduce(cnt_each, parlay::addm<size_t>());
 	}
@@ -591,7 +710,7 @@ public:
 		auto cnt_each = parlay::delayed_seq<size_t>(n, [&](size_t i){
 			node_id pu = i;
 			return get_node(pu).level<l? 0:
-				neighbourhood(get_node(pu),l).size();
+				neighbourhood(pu,l).size();
 		});
 		return parlay::reduce(cnt_each, parlay::maxm<size_t>());
 	}
@@ -636,6 +755,17 @@ HNSW<U,Allocator>::HNSW(const std::string &filename_model, G getter)
 	if(!model.is_open())
 		throw std::runtime_error("Failed to open the model");
 
+	uint32_t version_file = 0;
+	model.seekg(4);
+	model.read((char*)&version_file, sizeof(version_file));
+	model.seekg(0);
+	if(version_file==4)
+	{
+		model.close();
+		load_mapped(filename_model, getter);
+		return;
+	}
+
 	const auto size_buffer = 1024*1024*1024; // 1G
 	auto buffer = std::make_unique<char[]>(size_buffer);
 	model.rdbuf()->pubsetbuf(buffer.get(), size_buffer);
@@ -714,14 +844,17 @@ HNSW<U,Allocator>::HNSW(const std::string &filename_model, G getter)
 		u.data = getter(id_u);
 		// addr[id_u] = u;
 	}
-	for(node &u : node_pool)
+	layer0 = Graph<node_id>(get_threshold_m(0), n);
+	parlay::sequence<node_id> nbh_u;
+	for(node_id pu=0; pu<n; ++pu)
 	{
-		u.neighbors = new parlay::sequence<node_id>[u.level+1];
+		node &u = get_node(pu);
+		u.neighbors = new_upper_levels(u.level);
 		for(uint32_t l=0; l<=u.level; ++l)
 		{
 			size_t size;
 			read(size);
-			auto &nbh_u = u.neighbors[l];
+			nbh_u.clear();
 			nbh_u.reserve(size);
 			for(size_t i=0; i<size; ++i)
 			{
@@ -729,6 +862,7 @@ HNSW<U,Allocator>::HNSW(const std::string &filename_model, G getter)
 				read(id_v);
 				nbh_u.push_back(id_v);
 			}
+			set_neighbourhood(pu, l, nbh_u);
 		}
 	}
 	// read entrances
@@ -741,6 +875,84 @@ HNSW<U,Allocator>::HNSW(const std::string &filename_model, G getter)
 		read(id_u);
 		entrance.push_back(id_u);
 	}
+	compact_upper_levels();
+}
+
+template<typename U, template<typename> class Allocator>
+template<typename G>
+void HNSW<U,Allocator>::load_mapped(const std::string &filename_model, G getter)
+{
+	auto [base, size] = mmapStringFromFile(filename_model.c_str());
+	mapping = std::shared_ptr<char>(base, [size=size](char *p){munmap(p, size);});
+
+	if(size<sizeof(flat_header))
+		throw std::runtime_error("Truncated model");
+	const auto &h = *(const flat_header*)base;
+	if(strncmp(h.type,"HNSW",4))
+		throw std::runtime_error("Wrong type of model");
+	if(h.code_U!=(typeid(U).hash_code()^sizeof(U)) ||
+		h.size_elem!=sizeof(typename U::type_elem) || h.size_point!=sizeof(T))
+		throw std::runtime_error("Inconsistent type `U`");
+	const flat_layout pos(h);
+	if(size<pos.size)
+		throw std::runtime_error("Truncated model");
+
+	dim = h.dim;
+	m_l = h.m_l;
+	m = h.m;
+	ef_construction = h.ef_construction;
+	alpha = h.alpha;
+	n = h.n;
+	if(h.degree0!=get_threshold_m(0))
+		throw std::runtime_error("Inconsistent degree of level 0");
+
+	const auto *ids = (const uint32_t*)(base+pos.ids);
+	const auto *levels = (const uint32_t*)(base+pos.levels);
+	node_pool = parlay::tabulate(n, [&](node_id pu){
+		return node{levels[pu], nullptr, getter(ids[pu])};
+	});
+	upper_begin = (const uint64_t*)(base+pos.upper_begin);
+	upper_offsets = (const uint64_t*)(base+pos.upper_offsets);
+	upper_edges = (const node_id*)(base+pos.upper_edges);
+	const auto *eps = (const node_id*)(base+pos.entrance);
+	entrance = parlay::sequence<node_id>(eps, eps+h.num_entrance);
+	layer0 = Graph<node_id>(h.degree0, n,
+		std::shared_ptr<node_id[]>(mapping, (node_id*)(base+pos.layer0)));
+}
+
+// Moves the upper levels from the per node lists, a sequence per level
+// of each node, into one CSR array, and frees the lists.
+template<typename U, template<typename> class Allocator>
+void HNSW<U,Allocator>::compact_upper_levels()
+{
+	auto csr = std::make_shared<upper_levels>();
+	auto [level_begin, num_upper] = parlay::scan(parlay::tabulate(n, [&](node_id pu){
+		return uint64_t(get_node(pu).level);
+	}));
+	level_begin.push_back(num_upper);
+	csr->begin = std::move(level_begin);
+	auto nodes = parlay::tabulate(num_upper, [&](uint64_t i){
+		return node_id(std::upper_bound(csr->begin.begin(), csr->begin.end(), i)-csr->begin.begin()-1);
+	});
+	auto [offsets, num_upper_edges] = parlay::scan(parlay::tabulate(num_upper, [&](uint64_t i){
+		return uint64_t(get_node(nodes[i]).neighbors[i-csr->begin[nodes[i]]].size());
+	}));
+	offsets.push_back(num_upper_edges);
+	csr->offsets = std::move(offsets);
+	csr->edges = parlay::sequence<node_id>::uninitialized(num_upper_edges);
+	parlay::parallel_for(0, num_upper, [&](uint64_t i){
+		const auto &nbh = get_node(nodes[i]).neighbors[i-csr->begin[nodes[i]]];
+		std::copy(nbh.begin(), nbh.end(), csr->edges.begin()+csr->offsets[i]);
+	});
+	parlay::parallel_for(0, n, [&](node_id pu){
+		auto &u = get_node(pu);
+		delete[] u.neighbors;
+		u.neighbors = nullptr;
+	});
+	upper_begin = csr->begin.begin();
+	upper_offsets = csr->offsets.begin();
+	upper_edges = csr->edges.begin();
+	upper_csr = std::move(csr);
 }
 
 template<typename U, template<typename> class Allocator>
@@ -765,10 +977,11 @@ HNSW<U,Allocator>::HNSW(Iter begin, Iter end, uint32_t dim_, float m_l_, uint32_
 	// node *entrance_init = allocator.allocate(1);
 	// node_pool.push_back(entrance_init);
 	node_pool.resize(1);
+	layer0 = Graph<node_id>(get_threshold_m(0), 1);
 	node_id entrance_init = 0;
 	new(&get_node(entrance_init)) node{
 		level_ep, 
-		new parlay::sequence<node_id>[level_ep+1], 
+		new_upper_levels(level_ep), 
 		*rand_seq.begin()
 		/*anything else*/
 	};
@@ -776,6 +989,9 @@ HNSW<U,Allocator>::HNSW(Iter begin, Iter end, uint32_t dim_, float m_l_, uint32_
 
 	uint32_t batch_begin=0, batch_end=1, size_limit=n*0.02;
 	float progress = 0.0;
+	// the sum of the degrees in layer 0, kept up to date from the changes
+	// each batch makes
+	int64_t degree_sum = 0;
 	while(batch_end<n)
 	{
 		batch_begin = batch_end;
@@ -786,9 +1002,25 @@ HNSW<U,Allocator>::HNSW(Iter begin, Iter end, uint32_t dim_, float m_l_, uint32_
 		*/
 		// batch_end = batch_begin+1;
 
-		insert(rand_seq.begin()+batch_begin, rand_seq.begin()+batch_end, true);
+		parlay::internal::timer t_batch;
+		insert_counts counts;
+		insert(rand_seq.begin()+batch_begin, rand_seq.begin()+batch_end, true,
+			build_telemetry::get().enabled()? &counts: nullptr);
 		// insert(rand_seq.begin()+batch_begin, rand_seq.begin()+batch_end, false);
 
+		if(build_telemetry::get().enabled())
+		{
+			degree_sum += counts.degree_change;
+			telemetry_record r("hnsw", "batch");
+			r.add("size", batch_end-batch_begin).add("inserted", batch_end)
+			 .add("batch_s", t_batch.total_time())
+			 .add("distance_comps", counts.distance_comps)
+			 .add("prunes", counts.prunes)
+			 .add("avg_degree", degree_sum/(double)batch_end)
+			 .add("levels", get_node(entrance[0]).level+1);
+			build_telemetry::get().write(r);
+		}
+
 		if(batch_end>n*(progress+0.05))
 		{
 			progress = float(batch_end)/n;
@@ -802,6 +1034,7 @@ HNSW<U,Allocator>::HNSW(Iter begin, Iter end, uint32_t dim_, float m_l_, uint32_
 	// fprintf(stderr, "# visited: %lu\n", parlay::reduce(total_visited,parlay::addm<size_t>{}));
 	// fprintf(stderr, "# eval: %lu\n", parlay::reduce(total_eval,parlay::addm<size_t>{}));
 	// fprintf(stderr, "size of C: %lu\n", parlay::reduce(total_size_C,parlay::addm<size_t>{}));
+	compact_upper_levels();
 	fprintf(stderr, "Index built\n");
 
 	#if 0
@@ -825,8 +1058,12 @@ HNSW<U,Allocator>::HNSW(Iter begin, Iter end, uint32_t dim_, float m_l_, uint32_
 
 template<typename U, template<typename> class Allocator>
 template<typename Iter>
-void HNSW<U,Allocator>::insert(Iter begin, Iter end, bool from_blank)
+void HNSW<U,Allocator>::insert(Iter begin, Iter end, bool from_blank, insert_counts *counts)
 {
+	// a built, loaded or mapped model is read-only, and its nodes keep
+	// no upper levels
+	if(upper_offsets)
+		throw std::runtime_error("Cannot insert into a compacted model");
 	const auto level_ep = get_node(entrance[0]).level;
 	const auto size_batch = std::distance(begin,end);
 	auto node_new = std::make_unique<node_id[]>(size_batch);
@@ -834,6 +1071,14 @@ void HNSW<U,Allocator>::insert(Iter begin, Iter end, bool from_blank)
 	auto eps = std::make_unique<parlay::sequence<node_id>[]>(size_batch);
 	//const float factor_m = from_blank? 0.5: 1;
 	const auto factor_m = 1;
+	// distances computed and prunes done for each new node, if counted
+	auto cmps = parlay::sequence<uint32_t>(counts? size_batch: 0, 0);
+	auto prunes = parlay::sequence<uint32_t>(counts? size_batch: 0, 0);
+	auto control = [&](uint32_t i){
+		search_control c{};
+		if(counts) c.count_cmps = &cmps[i];
+		return c;
+	};
 
 	debug_output("Insert %lu elements; from blank? [%c]\n", size_batch, "NY"[from_blank]);
 
@@ -843,6 +1088,7 @@ void HNSW<U,Allocator>::insert(Iter begin, Iter end, bool from_blank)
 	{
 		auto offset = node_pool.size();
 		node_pool.resize(offset+size_batch);
+		layer0.resize(offset+size_batch);
 	parlay::parallel_for(0, size_batch, [&](uint32_t i){
 		const T &q = *(begin+i);
 		const auto level_u = get_level_random();
@@ -851,7 +1097,7 @@ void HNSW<U,Allocator>::insert(Iter begin, Iter end, bool from_blank)
 
 		new(&get_node(pu)) node{
 			level_u,
-			new parlay::sequence<node_id>[level_u+1],
+			new_upper_levels(level_u),
 			q
 		};
 		node_new[i] = pu;
@@ -874,7 +1120,7 @@ void HNSW<U,Allocator>::insert(Iter begin, Iter end, bool from_blank)
 		eps_u = entrance;
 		for(uint32_t l=level_ep; l>level_u; --l)
 		{
-			const auto res = search_layer(u, eps_u, 1, l); // TODO: optimize
+			const auto res = search_layer(u, eps_u, 1, l, control(i)); // TODO: optimize
 			eps_u.clear();
 			eps_u.push_back(res[0].u);
 		}
@@ -893,8 +1139,10 @@ void HNSW<U,Allocator>::insert(Iter begin, Iter end, bool from_blank)
 			if((uint32_t)l_c>u.level) return;
 
 			auto &eps_u = eps[i]; // TODO: check
-			auto res = search_layer(u, eps_u, ef_construction, l_c);
-			auto neighbors_vec = select_neighbors(u.data, res, get_threshold_m(l_c)/**factor_m*/, l_c);
+			auto res = search_layer(u, eps_u, ef_construction, l_c, control(i));
+			auto neighbors_vec = select_neighbors(u.data, res, get_threshold_m(l_c)/**factor_m*/, l_c,
+				false, false, counts? &cmps[i]: nullptr);
+			if(counts) prunes[i]++;
 			// move the content from `neighbors_vec` to `u.neighbors[l_c]`
 			// auto &nbh_u = nbh_new[i];
 			auto &edge_u = edge_add[i];
@@ -934,17 +1182,25 @@ void HNSW<U,Allocator>::insert(Iter begin, Iter end, bool from_blank)
 		parlay::parallel_for(0, size_batch, [&](uint32_t i){
 			auto &u = get_node(node_new[i]);
 			if((uint32_t)l_c<=u.level)
-				neighbourhood(u,l_c) = std::move(nbh_new[i]);
+				set_neighbourhood(node_new[i], l_c, nbh_new[i]);
 		});
 
 		debug_output("Adding reverse edges\n");
 		// now we add edges in the other direction
 		auto edge_add_flatten = parlay::flatten(edge_add);
 		auto edge_add_grouped = parlay::group_by_key(edge_add_flatten);
+		// the distances computed by the reverse edge prunes of each node,
+		// and the change of its degree
+		auto rev_cmps = parlay::sequence<uint32_t>(counts? edge_add_grouped.size(): 0, 0);
+		auto rev_degree = parlay::sequence<int64_t>(counts? edge_add_grouped.size(): 0, 0);
+		if(counts && l_c==0)
+			counts->degree_change += parlay::reduce(parlay::delayed_seq<int64_t>(size_batch, [&](size_t i){
+				return (int64_t)nbh_new[i].size();
+			}));
 
 		parlay::parallel_for(0, edge_add_grouped.size(), [&](size_t j){
 			node_id pv = edge_add_grouped[j].first;
-			auto &nbh_v = neighbourhood(get_node(pv),l_c);
+			auto nbh_v = neighbourhood(pv,l_c);
 			auto &nbh_v_add = edge_add_grouped[j].second;
 
 			// std::unordered_set<node_id> hash_table(nbh_v.begin(),nbh_v.end());
@@ -973,9 +1229,14 @@ void HNSW<U,Allocator>::insert(Iter begin, Iter end, bool from_blank)
 
 				std::sort(candidates.begin(), candidates.end(), farthest());
 
-				nbh_v.resize(m_s);
-				for(size_t k=0; k<m_s; ++k)
-					nbh_v[k] = candidates[k].u;
+				if(counts)
+				{
+					rev_cmps[j] = size_nbh_total;
+					rev_degree[j] = (int64_t)m_s-(int64_t)nbh_v.size();
+				}
+				set_neighbourhood(pv, l_c, parlay::tabulate(m_s, [&](size_t k){
+					return candidates[k].u;
+				}));
 				/*
 				auto res = select_neighbors(get_node(pv).data, candidates, m_s, l_c);
 				nbh_v.clear();
@@ -984,8 +1245,31 @@ void HNSW<U,Allocator>::insert(Iter begin, Iter end, bool from_blank)
 				*/
 				// nbh_v = select_neighbors(get_node(pv).data, candidates, m_s, l_c);
 			}
-			else nbh_v.insert(nbh_v.end(),nbh_v_add.begin(), nbh_v_add.end());
+			else
+			{
+				add_neighbourhood(pv, l_c, nbh_v_add);
+				if(counts) rev_degree[j] = nbh_v_add.size();
+			}
 		});
+
+		if(counts)
+		{
+			counts->distance_comps += parlay::reduce(parlay::delayed_seq<size_t>(rev_cmps.size(), [&](size_t j){
+				return (size_t)rev_cmps[j];
+			}));
+			counts->prunes += parlay::count_if(rev_cmps, [](uint32_t c){return c>0;});
+			if(l_c==0) counts->degree_change += parlay::reduce(rev_degree);
+		}
+	}
+
+	if(counts)
+	{
+		counts->distance_comps += parlay::reduce(parlay::delayed_seq<size_t>(size_batch, [&](size_t i){
+			return (size_t)cmps[i];
+		}));
+		counts->prunes += parlay::reduce(parlay::delayed_seq<size_t>(size_batch, [&](size_t i){
+			return (size_t)prunes[i];
+		}));
 	}
 
 	debug_output("Updating entrance\n");
@@ -1097,7 +1381,10 @@ auto HNSW<U,Allocator>::search_layer(const node &u, const parlay::sequence<node_
 	auto points = parlay::delayed_seq<const T&>(node_pool.size(), [&](size_t i) -> const T&{
 		return node_pool[i].data;
 	});
-	auto res = beam_search_impl<node_id>(u.data, g, points, eps, QP);
+	// level 0 is searched directly on its flat adjacency array
+	auto res = l_c==0?
+		beam_search_impl<node_id>(u.data, layer0, points, eps, QP):
+		beam_search_impl<node_id>(u.data, g, points, eps, QP);
 	const auto &pairElts = std::get<0>(res);
 	const auto &frontier = std::get<0>(pairElts);
 	if(ctrl.count_cmps)
@@ -1183,11 +1470,11 @@ auto HNSW<U,Allocator>::search_layer_bak(const node &u, const parlay::sequence<n
 			dist_in_search[*ctrl.log_dist].push_back(t);
 		}
 
-		const auto &c = get_node(C.begin()->u);
+		const node_id pc = C.begin()->u;
 		// std::pop_heap(C.begin(), C.end(), nearest());
 		// C.pop_back();
 		C.erase(C.begin());
-		for(node_id pv: neighbourhood(c, l_c))
+		for(node_id pv: neighbourhood(pc, l_c))
 		{
 		#ifdef USE_HASHTBL
 			const auto id = U::get_id(get_node(pv).data);
@@ -1317,7 +1604,8 @@ auto HNSW<U,Allocator>::search_layer_new_ex(const node &u, const parlay::sequenc
 		auto it = C.lower_bound(dist_ex{threshold,nullptr,0});
 		*/
 		const auto dc = it->depth;
-		const auto &c = *(it->u);
+		const node_id pc = it->u;
+		const auto &c = get_node(pc);
 		// W_.push_back(C[0]);
 		W_.push_back(*it);
 		// std::pop_heap(C.begin(), C.end(), nearest());
@@ -1329,7 +1617,7 @@ auto HNSW<U,Allocator>::search_layer_new_ex(const node &u, const parlay::sequenc
 		const uint32_t id_c = U::get_id(c.data);
 		verbose_output("Eval\t[%u](%f){%u}\t[%u]\n", id_c, it->d, dc, indeg[id_c]);
 		uint32_t cnt_insert = 0;
-		for(node_id pv: neighbourhood(c, l_c))
+		for(node_id pv: neighbourhood(pc, l_c))
 		{
 			// if(visited[U::get_id(get_node(pv).data)]) continue;
 			// visited[U::get_id(get_node(pv).data)] = true;
@@ -1474,7 +1762,7 @@ auto HNSW<U,Allocator>::beam_search_ex(const node &u, const parlay::sequence<nod
 			}
 			return true;
 		};
-		for(node_id pv : neighbourhood(get_node(current_vtx),l_c))
+		for(node_id pv : neighbourhood(current_vtx,l_c))
 			// current_vtx.out_neighbors().foreach_cond(f);
 			f(current_vtx, pv);
 
@@ -1619,71 +1907,66 @@ void HNSW<U,Allocator>::save(const std::string &filename_model) const
 	if(!model.is_open())
 		throw std::runtime_error("Failed to create the model");
 
-	const auto size_buffer = 1024*1024*1024; // 1G
-	auto buffer = std::make_unique<char[]>(size_buffer);
-	model.rdbuf()->pubsetbuf(buffer.get(), size_buffer);
-
-	const auto write = [&](const auto &data, auto ...args){
-		auto write_impl = [&](auto &f, const auto &data, auto ...args){
-			using T = std::remove_reference_t<decltype(data)>;
-			if constexpr(std::is_pointer_v<std::decay_t<T>>)
-			{
-				auto write_array = [&](const auto &data, size_t size, auto ...args){
-					for(size_t i=0; i<size; ++i)
-						f(f, data[i], args...);
-				};
-				// use the array extent as the size
-				if constexpr(sizeof...(args)==0 && std::is_array_v<T>)
-				{
-					write_array(data, std::extent_v<T>);
-				}
-				else
-				{
-					static_assert(sizeof...(args), "size was not provided");
-					write_array(data, args...);
-				}
-			}
-			else
-			{
-				static_assert(std::is_standard_layout_v<T>);
-				model.write((const char*)&data, sizeof(data));
-			}
-		};
-		write_impl(write_impl, data, args...);
+	// the level offsets: the lists of pu on levels 1..level
+	// are upper_offsets[upper_begin[pu], upper_begin[pu+1])
+	auto [upper_begin, num_upper] = parlay::scan(parlay::tabulate(n, [&](node_id pu){
+		return uint64_t(get_node(pu).level);
+	}));
+	upper_begin.push_back(num_upper);
+	// the i-th upper level list
+	auto upper_list = [&, &upper_begin=upper_begin](uint64_t i){
+		node_id pu = std::upper_bound(upper_begin.begin(), upper_begin.end(), i)-upper_begin.begin()-1;
+		return neighbourhood(pu, i-upper_begin[pu]+1);
 	};
-	// write header (version number, type info, etc)
-	write("HNSW", 4);
-	write(uint32_t(3)); // version
-	write(typeid(U).hash_code()^sizeof(U));
-	fprintf(stderr, "U type written %s\n", typeid(U).name());
-	write(sizeof(node));
-	// write parameter configuration
-	write(dim);
-	write(m_l);
-	write(m);
-	write(ef_construction);
-	write(alpha);
-	write(n);
-	// write indices
-	for(const auto &u : node_pool)
-	{
-		write(u.level);
-		write(uint32_t(U::get_id(u.data)));
-	}
-	for(const auto &u : node_pool)
+	auto [upper_offsets, num_upper_edges] = parlay::scan(parlay::tabulate(num_upper, [&](uint64_t i){
+		return uint64_t(upper_list(i).size());
+	}));
+	upper_offsets.push_back(num_upper_edges);
+
+	flat_header h{{'H','N','S','W'}, 4, typeid(U).hash_code()^sizeof(U),
+		uint32_t(sizeof(typename U::type_elem)), uint32_t(sizeof(T)),
+		dim, m_l, m, ef_construction, alpha, n,
+		get_threshold_m(0), uint32_t(entrance.size()), num_upper, num_upper_edges};
+	const flat_layout pos(h);
+
+	size_t written = 0;
+	auto write = [&](const void *data, size_t bytes){
+		model.write((const char*)data, bytes);
+		written += bytes;
+	};
+	auto write_at = [&](size_t offset, const auto &seq){
+		static const char zero[64] = {};
+		write(zero, offset-written);
+		write(seq.begin(), seq.size()*sizeof(*seq.begin()));
+	};
+	write(&h, sizeof(h));
+	write_at(pos.ids, parlay::tabulate(n, [&](node_id pu){
+		return uint32_t(U::get_id(get_node(pu).data));
+	}));
+	write_at(pos.levels, parlay::tabulate(n, [&](node_id pu){
+		return get_node(pu).level;
+	}));
+	write_at(pos.upper_begin, upper_begin);
+	write_at(pos.upper_offsets, upper_offsets);
+	write_at(pos.upper_edges, parlay::flatten(parlay::tabulate(num_upper, [&](uint64_t i){
+		return parlay::to_sequence(upper_list(i));
+	})));
+	write_at(pos.entrance, entrance);
+	// level 0 in blocks, with the unused slots of each list zeroed
+	const size_t stride = h.degree0+1, block = 1000000;
+	for(size_t begin=0; begin<n; begin+=block)
 	{
-		for(uint32_t l=0; l<=u.level; ++l)
-		{
-			write(u.neighbors[l].size());
-			for(node_id pv : u.neighbors[l])
-				write(pv);
-		}
+		const size_t end = std::min<size_t>(n, begin+block);
+		write_at(pos.layer0+begin*stride*sizeof(node_id),
+			parlay::tabulate((end-begin)*stride, [&](size_t i){
+				const auto e = layer0[begin+i/stride];
+				const size_t j = i%stride;
+				return j==0? node_id(e.size()): j<=e.size()? e[j-1]: node_id(0);
+			}));
 	}
-	// write entrances
-	write(entrance.size());
-	for(node_id pu : entrance)
-		write(pu);
-} 
+	if(!model)
+		throw std::runtime_error("Failed to write the model");
+}
 
 } // namespace HNSW
 
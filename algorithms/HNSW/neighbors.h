@@ -0,0 +1,160 @@
+// This code is part of the Problem Based Benchmark Suite (PBBS)
+// Copyright (c) 2011 Guy Blelloch and the PBBS team
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights (to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <type_traits>
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "parlay/random.h"
+#include "../utils/types.h"
+#include "../utils/stats.h"
+#include "../utils/parse_results.h"
+#include "../utils/check_nn_recall.h"
+#include "../utils/graph.h"
+#include "HNSW.hpp"
+
+// The HNSW model is not a Graph: ANN reads it from -graph_path and
+// writes it to -graph_outfile itself, and neighborsTime.C leaves G empty.
+#define ANN_SAVES_INDEX
+
+namespace parlayANN {
+
+// searches all the queries on the HNSW index H with beam width
+// QP.beamSize (ef), visiting at most QP.limit points on layer 0; HNSW
+// does not track visited points, so only comparisons are reported
+template<typename HNSW_, typename PointRange, typename indexType>
+nn_result checkRecall_HNSW(HNSW_ &H,
+                           const PointRange &Base_Points,
+                           const PointRange &Query_Points,
+                           const groundTruth<indexType> &GT,
+                           const long k,
+                           const QueryParams &QP,
+                           const bool verbose) {
+  if (GT.size() > 0 && k > GT.dimension()) {
+    std::cout << k << "@" << k << " too large for ground truth data of size "
+              << GT.dimension() << std::endl;
+    abort();
+  }
+
+  // neighbors of query i are at ngh[i * QP.k, (i + 1) * QP.k)
+  parlay::sequence<indexType> ngh(Query_Points.size() * QP.k);
+
+  parlay::internal::timer t;
+  stats<indexType> QueryStats(Query_Points.size());
+  QueryStats.clear();
+  // to help clear the cache between runs
+  auto volatile xx = parlay::random_permutation<long>(5000000);
+  t.next_time();
+  parlay::parallel_for(0, Query_Points.size(), [&] (long i) {
+    uint32_t cmps = 0;
+    search_control ctrl{};
+    ctrl.count_cmps = &cmps;
+    if (QP.limit < (long) Base_Points.size()) ctrl.limit_eval = QP.limit;
+    auto res = H.search(Query_Points[i], QP.k, QP.beamSize, ctrl);
+    // pad with an id that matches no ground truth
+    for (long j = 0; j < QP.k; j++)
+      ngh[i * QP.k + j] = j < (long) res.size() ? res[j].first : (indexType) Base_Points.size();
+    QueryStats.increment_dist(i, cmps);
+  });
+  float query_time = t.next_time();
+
+  float recall = ground_truth_recall(ngh, QP.k, Base_Points, Query_Points, GT, k);
+  float QPS = Query_Points.size() / query_time;
+  if (verbose)
+    std::cout << "search: ef=" << QP.beamSize << ", k=" << QP.k
+              << ", limit=" << QP.limit
+              << ", recall=" << recall
+              << ", comparisons=" << QueryStats.dist_stats()[0]
+              << ", QPS=" << QPS << std::endl;
+
+  auto stats_ = {QueryStats.dist_stats(), QueryStats.visited_stats()};
+  parlay::sequence<indexType> stats = parlay::flatten(stats_);
+  nn_result N(recall, stats, QPS, k, QP.beamSize, QP.cut, Query_Points.size(), QP.limit, QP.degree_limit, k);
+  return N;
+}
+
+// Builds an HNSW index with m = BP.R, efc = BP.L, BP.alpha and BP.m_l
+// (1/ln(m) if not given), or loads it from BP.index_path if the graph
+// was given, and runs the standard search sweep on it.
+template<typename Point, typename PointRange, typename indexType>
+void HNSW_ANN(long k, BuildParams &BP,
+              PointRange &Query_Points,
+              groundTruth<indexType> GT, char *res_file,
+              bool graph_built, PointRange &Points) {
+  if (BP.exact_visited) {
+    std::cout << "Error: HNSW search does not support -exact_visited" << std::endl;
+    abort();
+  }
+  if (BP.time_limit > 0 || BP.dist_budget > 0) {
+    std::cout << "Error: HNSW search does not support -time_limit or -dist_budget" << std::endl;
+    abort();
+  }
+  parlay::internal::timer t("ANN");
+  using desc = Desc_HNSW<typename Point::T, Point>;
+  using index = ANN::HNSW<desc>;
+
+  double m_l = BP.m_l > 0 ? BP.m_l : 1 / std::log((double) BP.R);
+  double idx_time;
+  auto H = [&] {
+    if (graph_built)
+      return index(BP.index_path, [&] (uint32_t i) {return Points[i];});
+    auto ps = parlay::delayed_seq<Point>(Points.size(), [&] (size_t i) {return Points[i];});
+    return index(ps.begin(), ps.end(), Points.dimension(), m_l, BP.R, BP.L, BP.alpha);
+  }();
+  idx_time = graph_built ? 0 : t.next_time();
+  if (!BP.index_outfile.empty()) H.save(BP.index_outfile);
+
+  std::string name = "HNSW";
+  // (a loaded model has its own parameters)
+  std::string params = "m = " + std::to_string(H.m) + ", efc = " + std::to_string(H.ef_construction) +
+    ", m_l = " + std::to_string(H.m_l);
+  double avg_deg = H.cnt_degree(0) / (double) std::max<size_t>(H.cnt_vertex(0), 1);
+  Graph_ G_(name, params, Points.size(), avg_deg, H.get_degree_max(0), idx_time);
+  G_.print();
+  std::cout << "HNSW has " << H.get_height() + 1 << " layers" << std::endl;
+
+  if (Query_Points.size() != 0) {
+    auto check = [&] (const long k, const QueryParams QP) {
+      return checkRecall_HNSW(H, Points, Query_Points, GT, k, QP, BP.verbose);};
+    sweep_and_parse(G_, check, (long) Points.size(), (long) H.get_degree_max(0),
+                    res_file, k, BP.Q);
+  }
+}
+
+// G is not used: the index is the HNSW model (see ANN_SAVES_INDEX)
+template<typename Point, typename PointRange, typename indexType>
+void ANN(Graph<indexType> &G, long k, BuildParams &BP,
+         PointRange &Query_Points,
+         groundTruth<indexType> GT, char *res_file,
+         bool graph_built, PointRange &Points) {
+  // HNSW nodes hold their points by value
+  if constexpr (std::is_default_constructible_v<Point>) {
+    HNSW_ANN<Point>(k, BP, Query_Points, GT, res_file, graph_built, Points);
+  } else {
+    std::cout << "Error: HNSW does not support quantized mips points" << std::endl;
+    abort();
+  }
+}
+
+} // end namespace
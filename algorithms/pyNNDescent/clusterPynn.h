@@ -25,6 +25,7 @@
 #include <math.h>
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <queue>
 #include <random>
@@ -35,6 +36,7 @@
 #include "parlay/primitives.h"
 #include "parlay/random.h"
 #include "../utils/union.h"
+#include "../utils/telemetry.h"
 
 namespace parlayANN {
   
@@ -49,11 +51,12 @@ struct clusterPID {
 
   parlay::sequence<parlay::sequence<pid>> intermediate_edges;
 
-  void naive_neighbors(PR &Points,
-                       parlay::sequence<size_t>& active_indices,
-                       long maxK) {
+  // the (point, maxK nearest other points in the leaf) of each point of
+  // a leaf, closest first
+  static parlay::sequence<std::pair<size_t, parlay::sequence<pid>>>
+  naive_neighbors(PR &Points, parlay::sequence<size_t>& active_indices, long maxK) {
     size_t n = active_indices.size();
-    parlay::parallel_for(0, n, [&](size_t i) {
+    return parlay::tabulate(n, [&](size_t i) {
       auto less = [&](pid a, pid b) { return a.second < b.second; };
       std::priority_queue<pid, std::vector<pid>, decltype(less)> Q(less);
       size_t index = active_indices[i];
@@ -62,7 +65,7 @@ struct clusterPID {
         if (j != i) {
           distanceType dist = Points[index].distance(Points[active_indices[j]]);
           pid e = std::make_pair(active_indices[j], dist);
-          if (Q.size() >= maxK) {
+          if ((long) Q.size() >= maxK) {
             distanceType topdist = Q.top().second;
             if (dist < topdist) {
               Q.pop();
@@ -76,99 +79,50 @@ struct clusterPID {
       size_t q = Q.size();
       parlay::sequence<pid> sorted_edges(q);
       for (indexType  j = 0; j < q; j++) {
-        sorted_edges[j] = Q.top();
+        sorted_edges[q - 1 - j] = Q.top();
         Q.pop();
       }
-      auto rev_edges = parlay::reverse(sorted_edges);
-      auto [new_best, changed] =
-          seq_union_bounded(intermediate_edges[index], rev_edges, maxK, less);
-      intermediate_edges[index] = new_best;
+      return std::make_pair(index, std::move(sorted_edges));
     });
   }
 
-
-  void random_clustering(PR &Points,
-                         parlay::sequence<size_t>& active_indices,
-                         parlay::random& rnd, long cluster_size,
-                         long K) {
-    if (active_indices.size() <= cluster_size)
-      naive_neighbors(Points, active_indices, K);
-    else {
-      auto [f, s] = select_two_random(active_indices, rnd);
-
-      auto left_rnd = rnd.fork(0);
-      auto right_rnd = rnd.fork(1);
-
-      if (Points[f]==Points[s]) {
-        parlay::sequence<size_t> closer_first;
-        parlay::sequence<size_t> closer_second;
-        for (indexType i = 0; i < active_indices.size(); i++) {
-          if (i < active_indices.size() / 2)
-            closer_first.push_back(active_indices[i]);
-          else
-            closer_second.push_back(active_indices[i]);
-        }
-        auto left_rnd = rnd.fork(0);
-        auto right_rnd = rnd.fork(1);
-        parlay::par_do(
-            [&]() {
-              random_clustering(Points, closer_first, left_rnd, cluster_size,
-                                K);
-            },
-            [&]() {
-              random_clustering(Points, closer_second, right_rnd, cluster_size,
-                                K);
-            });
-      } else {
-        // Split points based on which of the two points are closer.
-        auto closer_first =
-            parlay::filter(parlay::make_slice(active_indices), [&](size_t ind) {
-              distanceType dist_first = Points[ind].distance(Points[f]);
-              distanceType dist_second = Points[ind].distance(Points[s]);
-              return dist_first <= dist_second;
-            });
-
-        auto closer_second =
-            parlay::filter(parlay::make_slice(active_indices), [&](size_t ind) {
-              distanceType dist_first = Points[ind].distance(Points[f]);
-              distanceType dist_second = Points[ind].distance(Points[s]);
-              return dist_second < dist_first;
-            });
-
-
-        parlay::par_do(
-            [&]() {
-              random_clustering(Points, closer_first, left_rnd, cluster_size, 
-                                K);
-            },
-            [&]() {
-              random_clustering(Points, closer_second, right_rnd, cluster_size,
-                                  K);
-        });
-
-      }
-    }
-  }
-
-  void random_clustering_wrapper(PR &Points,
-                                 long cluster_size, long K) {
-    std::random_device rd;
-    std::mt19937 rng(rd());
-    std::uniform_int_distribution<indexType> uni(0, Points.size());
-    parlay::random rnd(uni(rng));
-    auto active_indices =
-        parlay::tabulate(Points.size(), [&](size_t i) { return i; });
-    random_clustering(Points, active_indices, rnd, cluster_size, K);
-  }
-
+  // Builds the cluster trees one at a time, and merges the nearest
+  // neighbors each point has in its leaves into old_nbh.  Each leaf is
+  // merged as soon as it is found, so only the neighbors of the leaves
+  // in progress are held besides intermediate_edges.  Trees are not
+  // built concurrently, since leaves of different trees share points.
   void multiple_clustertrees(PR &Points,
                              long cluster_size, long num_clusters,
                              long K,
                              parlay::sequence<parlay::sequence<pid>>& old_nbh) {
     intermediate_edges = parlay::sequence<parlay::sequence<pid>>(Points.size());
+    cluster_trees<PR> C(Points, cluster_size);
+    auto less = [&](pid a, pid b) { return a.second < b.second; };
+    build_telemetry &telemetry = build_telemetry::get();
     for (long i = 0; i < num_clusters; i++) {
-      random_clustering_wrapper(Points, cluster_size, K);
-      std::cout << "Cluster " << i << std::endl; 
+      parlay::internal::timer t;
+      // each leaf point is compared with the others of its leaf
+      std::atomic<long> leaf_comps = 0;
+      // each point is in one leaf of a tree, so the merges of a tree's
+      // leaves are independent
+      C.leaves(i, 1, [&](long, parlay::sequence<size_t> &ids) {
+        leaf_comps += (long) ids.size() * (ids.size() - 1);
+        auto nbhs = naive_neighbors(Points, ids, K);
+        parlay::parallel_for(0, nbhs.size(), [&](size_t j) {
+          auto &[index, leaf_nbhs] = nbhs[j];
+          auto [new_best, changed] =
+            seq_union_bounded(intermediate_edges[index], leaf_nbhs, K, less);
+          intermediate_edges[index] = new_best;
+        });
+        return ids.size();});
+      std::cout << "Cluster " << i << std::endl;
+      if (telemetry.enabled()) {
+        telemetry_record r("pynn", "trees");
+        r.add("first_tree", i).add("trees", 1).add("cluster_size", cluster_size)
+          .add("trees_s", t.total_time())
+          .add("distance_comps", leaf_comps.load()).add("prunes", 0);
+        telemetry.write(r);
+      }
     }
     parlay::parallel_for(0, Points.size(),
                          [&](size_t i) { old_nbh[i] = intermediate_edges[i]; });
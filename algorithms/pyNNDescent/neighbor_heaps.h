@@ -0,0 +1,135 @@
+// This code is part of the Problem Based Benchmark Suite (PBBS)
+// Copyright (c) 2011 Guy Blelloch and the PBBS team
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights (to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <utility>
+
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "parlay/sequence.h"
+
+namespace parlayANN {
+
+// The K closest neighbors found so far for each of n points, kept as
+// bounded max-heaps on distance (the farthest neighbor is at the root)
+// in one flat array of K slots per point.  Each entry is flagged "new"
+// until it has taken part in a local join of NN-descent.
+//
+// push() may be called concurrently: a point's heap is updated under a
+// per-point spinlock, and candidates no closer than the current farthest
+// neighbor are rejected without taking the lock.  The other methods are
+// not safe to call concurrently with push() on the same point.
+template<typename indexType, typename distanceType>
+struct neighbor_heaps {
+  struct entry {
+    indexType id;
+    distanceType dist;
+    bool is_new;
+  };
+  using pid = std::pair<indexType, distanceType>;
+
+  neighbor_heaps(size_t n, long K)
+    : n(n), K(K), entries(n * K), sizes(n, 0), stamps(n, 0),
+      locks(new std::atomic<bool>[n]), bounds(new std::atomic<distanceType>[n]) {
+    parlay::parallel_for(0, n, [&] (size_t i) {
+      locks[i] = false;
+      bounds[i] = std::numeric_limits<distanceType>::max();
+    });
+  }
+
+  size_t size() const {return n;}
+  long size(size_t i) const {return sizes[i];}
+  entry* begin(size_t i) {return entries.begin() + i * K;}
+  entry* end(size_t i) {return begin(i) + sizes[i];}
+
+  // Adds j at distance d to the neighbors of i, flagged new, unless it
+  // is already there or is no closer than the K neighbors i has.
+  // stamp records the round in which i last changed.  Returns whether j
+  // was added.
+  bool push(indexType i, indexType j, distanceType d, int stamp) {
+    if (d >= bounds[i].load(std::memory_order_relaxed)) return false;
+    while (locks[i].exchange(true, std::memory_order_acquire));
+    bool added = insert(i, j, d, true);
+    if (added) stamps[i] = stamp;
+    locks[i].store(false, std::memory_order_release);
+    return added;
+  }
+
+  // As push, without locking.
+  bool insert(indexType i, indexType j, distanceType d, bool is_new) {
+    entry* h = begin(i);
+    long s = sizes[i];
+    if (s == K && d >= h[0].dist) return false;
+    for (long l = 0; l < s; l++)
+      if (h[l].id == j) return false;
+    long l;
+    if (s < K) {  // sift up from the new leaf
+      l = s;
+      while (l > 0 && h[(l - 1) / 2].dist < d) {
+        h[l] = h[(l - 1) / 2];
+        l = (l - 1) / 2;
+      }
+      sizes[i] = s + 1;
+    } else {  // replace the root and sift down
+      l = 0;
+      while (true) {
+        long c = 2 * l + 1;
+        if (c >= K) break;
+        if (c + 1 < K && h[c + 1].dist > h[c].dist) c++;
+        if (h[c].dist <= d) break;
+        h[l] = h[c];
+        l = c;
+      }
+    }
+    h[l] = entry{j, d, is_new};
+    if (sizes[i] == K) bounds[i].store(h[0].dist, std::memory_order_relaxed);
+    return true;
+  }
+
+  // whether i has changed in the given round
+  bool changed(size_t i, int stamp) const {return stamps[i] == stamp;}
+
+  // the neighbors of i, closest first
+  parlay::sequence<pid> sorted(size_t i) {
+    auto nbhs = parlay::tabulate(sizes[i], [&] (long l) {
+      return pid(begin(i)[l].id, begin(i)[l].dist);});
+    std::sort(nbhs.begin(), nbhs.end(), [] (pid a, pid b) {
+      return a.second < b.second || (a.second == b.second && a.first < b.first);});
+    return nbhs;
+  }
+
+private:
+  size_t n;
+  long K;
+  parlay::sequence<entry> entries;
+  parlay::sequence<long> sizes;
+  parlay::sequence<int> stamps;
+  std::unique_ptr<std::atomic<bool>[]> locks;
+  std::unique_ptr<std::atomic<distanceType>[]> bounds;
+};
+
+} // end namespace
@@ -21,15 +21,20 @@
 // WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <algorithm>
+#include <cassert>
 #include "parlay/parallel.h"
 #include "parlay/primitives.h"
 #include "parlay/random.h"
 #include "parlay/internal/get_time.h"
-#include <random>
-#include <set>
+#include <fstream>
+#include <limits>
 #include <queue>
+#include <random>
+#include <string>
 #include <math.h>
+#include "../utils/graph.h"
 #include "clusterPynn.h"
+#include "neighbor_heaps.h"
 
 namespace parlayANN {
 
@@ -40,154 +45,135 @@ struct pyNN_index{
 	using PR = PointRange;
     using edge = std::pair<indexType, indexType>;
     using pid = std::pair<indexType,distanceType>;
-    using labelled_edge = std::pair<indexType, pid>;
+
+    using heaps = neighbor_heaps<indexType, distanceType>;
 
     long K;
 	double delta;
+	double rho; // fraction of the new neighbors sampled for each round
 
     static constexpr auto less = [] (edge a, edge b) {return a.second < b.second;};
 
-    pyNN_index(long md, double Delta) : K(md), delta(Delta) {}
+    pyNN_index(long md, double Delta, double Rho = 1.0) : K(md), delta(Delta), rho(Rho) {}
 
     parlay::sequence<parlay::sequence<pid>> old_neighbors;
 
-    void push_into_queue(std::priority_queue<edge, std::vector<edge>, decltype(less)> &Q, edge p){
-        if(Q.size() < 2*K){
-            Q.push(p);
-        } else{
-            indexType highest_p = Q.top().second;
-            if(p.second < highest_p){
-                Q.pop();
-                Q.push(p);
+    // The neighbors of each point that take part in a round of local
+    // joins: a sample of at most rho*K of its new neighbors, which are
+    // flagged old as they are sampled, and all of its old ones.
+    void sample_neighbors(heaps &H, int round,
+                          parlay::sequence<parlay::sequence<indexType>> &new_nbhs,
+                          parlay::sequence<parlay::sequence<indexType>> &old_nbhs){
+        long S = std::max<long>(1, (long) (rho * K));
+        parlay::parallel_for(0, H.size(), [&] (size_t i){
+            parlay::sequence<typename heaps::entry*> fresh;
+            for(auto e = H.begin(i); e != H.end(i); e++){
+                if(e->is_new) fresh.push_back(e);
+                else old_nbhs[i].push_back(e->id);
             }
-        }
-    }
-
-    parlay::sequence<int> nn_descent(PR &Points, parlay::sequence<int> &changed){
-        auto new_changed = parlay::sequence<int>(Points.size(), 0);
-        auto rev = reverse_graph();
-        parlay::random_generator gen;
-        size_t n=Points.size();
-        std::uniform_int_distribution<indexType> dis(0, n-1);
-        int batch_size = 100000;
-        std::pair<indexType, parlay::sequence<indexType>> *begin;
-		std::pair<indexType, parlay::sequence<indexType>> *end = rev.begin();
-		int counter = 0;
-		while(end != rev.end()){
-			counter++;
-			begin = end;
-			int remaining = rev.end() - end;
-			end += std::min(remaining, batch_size);
-			nn_descent_chunk(Points, changed, new_changed, begin, end);
-		}
-        return new_changed;
-    }
-
-    void nn_descent_chunk(PR &Points, parlay::sequence<int> &changed, 
-		parlay::sequence<int> &new_changed, std::pair<indexType, parlay::sequence<indexType>> *begin, 
-		std::pair<indexType, parlay::sequence<indexType>> *end){
-        size_t stride = end - begin;
-	auto less = [&] (pid a, pid b) {return a.second < b.second;};
-	auto grouped_labelled = parlay::tabulate(stride, [&] (size_t i){
-            indexType index = (begin+i)->first;
-            std::set<indexType> to_filter;
-            to_filter.insert(index);
-            for(indexType j=0; j<old_neighbors[index].size(); j++){
-                to_filter.insert(old_neighbors[index][j].first);
+            if((long) fresh.size() > S){
+                std::mt19937_64 gen(parlay::hash64(i * 1000003 + round));
+                std::shuffle(fresh.begin(), fresh.end(), gen);
+                fresh.resize(S);
             }
-            auto f = [&] (indexType a) {return (to_filter.find(a) == to_filter.end());};
-            auto filtered_candidates = parlay::filter((begin+i)->second, f);
-	    parlay::sequence<labelled_edge> edges;
-	    edges.reserve(K*2);
-	    for(indexType l=0; l<filtered_candidates.size(); l++){
-                indexType j=filtered_candidates[l];
-		distanceType j_max = old_neighbors[j][old_neighbors[j].size()-1].second;
-		for(indexType m=l+1; m<filtered_candidates.size(); m++){
-                    indexType k=filtered_candidates[m];
-		    if (changed[j] || changed[k]) {
-              distanceType dist = Points[j].distance(Points[k]);
-		      distanceType k_max = old_neighbors[k][old_neighbors[k].size()-1].second;
-		      if(dist < j_max) edges.push_back(std::make_pair(j, std::make_pair(k, dist)));
-		      if(dist < k_max) edges.push_back(std::make_pair(k, std::make_pair(j, dist)));
-		    }
-		}
-	    }
-            for(indexType l=0; l<old_neighbors[index].size(); l++){
-                indexType j = old_neighbors[index][l].first;
-                for(const indexType& k : filtered_candidates){
-		  if (changed[index] || changed[k]) {
-                    distanceType dist = Points[j].distance(Points[k]);
-                    distanceType j_max = old_neighbors[j][old_neighbors[j].size()-1].second;
-                    distanceType k_max = old_neighbors[k][old_neighbors[k].size()-1].second;
-                    if(dist < j_max) edges.push_back(std::make_pair(j, std::make_pair(k, dist)));
-                    if(dist < k_max) edges.push_back(std::make_pair(k, std::make_pair(j, dist)));
-		  }
-                }
-            }
-			return edges;
-								 }, 1);
-		auto candidates = parlay::group_by_key(parlay::flatten(grouped_labelled));
-        parlay::parallel_for(0, candidates.size(), [&] (size_t i){
-            auto less2 = [&] (pid a, pid b) {
-                if(a.second < b.second) return true;
-                else if(a.second == b.second){
-                    if(a.first < b.first) return true;
-                }
-                return false;
-            };
-            parlay::sort_inplace(candidates[i].second, less2);
-            indexType cur_index=std::numeric_limits<unsigned int>::max();
-            parlay::sequence<pid> filtered_candidates;
-            for(const pid& p : candidates[i].second){
-                if(p.first!=cur_index){
-                    filtered_candidates.push_back(p);
-                    cur_index = p.first;
-                }
-            }
-            indexType index = candidates[i].first;
-            auto less3 = [&] (pid a, pid b) {return a.second < b.second;};
-            auto [new_edges, change] = seq_union_bounded(old_neighbors[index], filtered_candidates, K, less3);
-            if(change){
-                new_changed[index]=1;
-                old_neighbors[index]=new_edges;
+            for(auto e : fresh){
+                e->is_new = false;
+                new_nbhs[i].push_back(e->id);
             }
         });
     }
 
-    parlay::sequence<std::pair<indexType, parlay::sequence<indexType>>> reverse_graph(){
-        parlay::sequence<parlay::sequence<edge>> to_group = parlay::tabulate(old_neighbors.size(), [&] (size_t i){
-            size_t s = old_neighbors[i].size();
-            parlay::sequence<edge> e(s);
-            for(indexType j=0; j<s; j++){
-                e[j] = std::make_pair(old_neighbors[i][j].first, (int) i);
-            }
-            return e; 
+    // For each point, a sample of at most rho*K of the points that have
+    // it in their lists.
+    parlay::sequence<parlay::sequence<indexType>> reverse_sample(
+        parlay::sequence<parlay::sequence<indexType>> &nbhs, int round){
+        long S = std::max<long>(1, (long) (rho * K));
+        auto to_group = parlay::tabulate(nbhs.size(), [&] (size_t i){
+            return parlay::tabulate(nbhs[i].size(), [&] (size_t j){
+                return std::make_pair(nbhs[i][j], (indexType) i);});
         });
-        auto sorted_graph =  parlay::group_by_key(parlay::flatten(to_group));
-        parlay::parallel_for(0, sorted_graph.size(), [&] (size_t i){
-            auto shuffled = parlay::remove_duplicates(parlay::random_shuffle(sorted_graph[i].second, i));
-            indexType upper_bound = std::min((long) shuffled.size(), K);
-            auto truncated = parlay::tabulate(upper_bound, [&] (size_t j){
-                return shuffled[j];
-            });
-            sorted_graph[i].second = truncated;
+        auto grouped = parlay::group_by_key_ordered(parlay::flatten(to_group));
+        parlay::sequence<parlay::sequence<indexType>> reversed(nbhs.size());
+        parlay::parallel_for(0, grouped.size(), [&] (size_t i){
+            indexType index = grouped[i].first;
+            auto &sources = grouped[i].second;
+            if((long) sources.size() > S){
+                auto shuffled = parlay::random_shuffle(sources, index * 1000003 + round);
+                reversed[index] = parlay::to_sequence(shuffled.head(S));
+            } else reversed[index] = std::move(sources);
         });
-        return sorted_graph;
+        return reversed;
+    }
+
+    // One round of NN-descent.  Each point joins its sampled new neighbors
+    // (forward and reverse) with each other and with its old ones, and the
+    // distances found are pushed straight into the heaps of both points of
+    // each pair.  Returns the number of points whose neighbors changed,
+    // and the number of distances computed.
+    std::pair<size_t, long> nn_descent(PR &Points, heaps &H, int round){
+        size_t n = H.size();
+        parlay::sequence<parlay::sequence<indexType>> new_nbhs(n), old_nbhs(n);
+        sample_neighbors(H, round, new_nbhs, old_nbhs);
+        auto new_rev = reverse_sample(new_nbhs, round);
+        auto old_rev = reverse_sample(old_nbhs, round);
+        auto distinct = [] (parlay::sequence<indexType> &ids, parlay::sequence<indexType> &more){
+            ids.append(more);
+            std::sort(ids.begin(), ids.end());
+            ids.resize(std::unique(ids.begin(), ids.end()) - ids.begin());
+        };
+        auto joins = parlay::tabulate(n, [&] (size_t i){
+            auto &news = new_nbhs[i];
+            auto &olds = old_nbhs[i];
+            distinct(news, new_rev[i]);
+            distinct(olds, old_rev[i]);
+            long count = 0;
+            auto join = [&] (indexType a, indexType b){
+                distanceType dist = Points[a].distance(Points[b]);
+                H.push(a, b, dist, round);
+                H.push(b, a, dist, round);
+                count++;
+            };
+            for(size_t l=0; l<news.size(); l++){
+                for(size_t m=l+1; m<news.size(); m++) join(news[l], news[m]);
+                for(indexType k : olds)
+                    if(k != news[l]) join(news[l], k);
+            }
+            return count;
+        }, 1);
+        size_t changed = parlay::reduce(parlay::delayed_tabulate(n, [&] (size_t i){
+            return (size_t) H.changed(i, round);}));
+        return std::pair(changed, parlay::reduce(joins));
     }
 
     int nn_descent_wrapper(PR &Points){
 		size_t n = Points.size();
-		parlay::sequence<int> changed = parlay::tabulate(n, [&] (size_t i) {return 1;});
+		heaps H(n, K);
+		parlay::parallel_for(0, n, [&] (size_t i){
+			for(const pid& p : old_neighbors[i]) H.insert(i, p.first, p.second, true);
+			old_neighbors[i] = parlay::sequence<pid>();
+		});
+		size_t changed = n;
 		int rounds = 0;
         int max_rounds = std::max(10, (int) log2(Points.dimension()));
         if(Points.dimension()==256) max_rounds=20; //hack for ssnpp
-		while(parlay::reduce(changed) >= delta*n && rounds < max_rounds){
-			auto new_changed = nn_descent(Points, changed);
-			changed = new_changed;
+		while(changed >= delta*n && rounds < max_rounds){
+			parlay::internal::timer t;
 			rounds++;
-            std::cout << parlay::reduce(new_changed) << " elements changed" << std::endl;
+			auto [round_changed, distance_comps] = nn_descent(Points, H, rounds);
+			changed = round_changed;
+            std::cout << changed << " elements changed" << std::endl;
 			std::cout << "Round " << rounds << " of " <<  max_rounds << " completed" << std::endl; 
+			if (build_telemetry::get().enabled()) {
+				telemetry_record r("pynn", "round");
+				// NN-descent only keeps the closest K in each heap, it
+				// does not prune
+				r.add("round", rounds).add("changed", (long) changed)
+				  .add("round_s", t.total_time())
+				  .add("distance_comps", distance_comps).add("prunes", 0);
+				build_telemetry::get().write(r);
+			}
 		}
+		parlay::parallel_for(0, n, [&] (size_t i){old_neighbors[i] = H.sorted(i);});
 
 		std::cout << "descent converged in " << rounds << " rounds";
         if(rounds < max_rounds) std::cout << " (Early termination)";
@@ -195,7 +181,8 @@ struct pyNN_index{
 		return rounds;
 	}
 
-    void undirect_and_prune(GraphI &G, PR &Points, double alpha){
+    // Returns the number of distances computed.
+    long undirect_and_prune(GraphI &G, PR &Points, double alpha){
         parlay::sequence<parlay::sequence<edge>> to_group = parlay::tabulate(old_neighbors.size(), [&] (size_t i){
             size_t s = old_neighbors[i].size();
             assert(s == K);
@@ -206,7 +193,7 @@ struct pyNN_index{
             return e; 
         });
         auto undirected_graph = parlay::group_by_key_ordered(parlay::flatten(to_group));
-        parlay::parallel_for(0, undirected_graph.size(), [&] (size_t i){
+        auto undirect_comps = parlay::tabulate(undirected_graph.size(), [&] (size_t i){
             indexType index = undirected_graph[i].first;
             auto filtered = parlay::remove_duplicates(undirected_graph[i].second);
             auto undirected_pids = parlay::tabulate(filtered.size(), [&] (size_t j){
@@ -218,8 +205,10 @@ struct pyNN_index{
             auto less3 = [&] (pid a, pid b) {return a.second < b.second;};
             auto merged_pids = seq_union(old_neighbors[index], undirected_pids, less3);
             old_neighbors[index] = merged_pids;
+            return (long) filtered.size();
         });
-        parlay::parallel_for(0, G.size(), [&] (size_t i){
+        auto prune_comps = parlay::tabulate(G.size(), [&] (size_t i){
+            long count = 0;
             parlay::sequence<indexType> new_out = parlay::sequence<indexType>();
 			for(const pid& j : old_neighbors[i]){
 				if(new_out.size() == K) break;
@@ -229,22 +218,117 @@ struct pyNN_index{
 					bool add = true;
 					for(const indexType& k : new_out){
                         distanceType dist = Points[j.first].distance(Points[k]);
+                        count++;
 						if(dist_p > alpha*dist) {add = false; break;}
 					}
 					if(add) new_out.push_back(j.first);
 				}
 			}
             G[i].update_neighbors(new_out);
+            return count;
         });
+        return parlay::reduce(undirect_comps) + parlay::reduce(prune_comps);
     }
 
 
-    void build_index(GraphI &G, PR &Points, long cluster_size, long num_clusters, double alpha){
+    // Writes the K-nearest neighbor graph found by NN-descent in the ibin
+    // groundtruth layout read by groundTruth: the number of points and K
+    // as ints, then the ids of the neighbors of every point (closest
+    // first), then their distances.  Points with fewer than K neighbors
+    // repeat their farthest one, and a point with none (only possible if
+    // n = 1) lists itself at the largest distance.
+    void save_knn(const std::string &path){
+        size_t n = old_neighbors.size();
+        std::cout << "Writing " << K << "-NN graph of " << n << " points to " << path << std::endl;
+        std::ofstream writer(path, std::ios::binary | std::ios::out);
+        if(!writer.is_open()){
+            std::cout << "Error: could not write kNN graph " << path << std::endl;
+            abort();
+        }
+        int preamble[2] = {static_cast<int>(n), static_cast<int>(K)};
+        writer.write((char*) preamble, 2 * sizeof(int));
+        auto nth = [&] (size_t i, long j) {
+            auto &nbhs = old_neighbors[i];
+            if(nbhs.size() == 0)
+                return pid((indexType) i, std::numeric_limits<distanceType>::max());
+            return nbhs[std::min<long>(j, nbhs.size() - 1)];
+        };
+        size_t BLOCK_SIZE = 1000000;
+        for(size_t floor = 0; floor < n; floor += BLOCK_SIZE){
+            size_t ceiling = std::min(floor + BLOCK_SIZE, n);
+            auto ids = parlay::tabulate((ceiling - floor) * K, [&] (size_t l){
+                return static_cast<int>(nth(floor + l / K, l % K).first);});
+            writer.write((char*) ids.begin(), ids.size() * sizeof(int));
+        }
+        for(size_t floor = 0; floor < n; floor += BLOCK_SIZE){
+            size_t ceiling = std::min(floor + BLOCK_SIZE, n);
+            auto dists = parlay::tabulate((ceiling - floor) * K, [&] (size_t l){
+                return static_cast<float>(nth(floor + l / K, l % K).second);});
+            writer.write((char*) dists.begin(), dists.size() * sizeof(float));
+        }
+        writer.close();
+    }
+
+    // Recall of the K-nearest neighbor graph, measured against brute
+    // force on num_samples points chosen at random.  Each sample keeps
+    // only its k smallest distances, in a bounded max-heap.
+    double knn_recall(PR &Points, size_t num_samples = 1000){
+        size_t n = old_neighbors.size();
+        num_samples = std::min(num_samples, n);
+        auto samples = parlay::random_permutation<indexType>(n);
+        long k = std::min<long>(K, n - 1);
+        if(k <= 0) return 1.0;
+        auto hits = parlay::tabulate(num_samples, [&] (size_t s){
+            indexType i = samples[s];
+            std::priority_queue<distanceType> exact;
+            for(size_t j = 0; j < n; j++){
+                if(j == i) continue;
+                distanceType d = Points[i].distance(Points[j]);
+                if((long) exact.size() < k) exact.push(d);
+                else if(d < exact.top()){
+                    exact.pop();
+                    exact.push(d);
+                }
+            }
+            distanceType kth = exact.top();
+            // found neighbors at most as far as the exact k-th count, so
+            // ties at the k-th distance are not misses
+            size_t found = 0;
+            for(const pid& p : old_neighbors[i])
+                if(p.second <= kth) found++;
+            return std::min<size_t>(found, k);
+        }, 1);
+        return parlay::reduce(hits) / (double) (num_samples * k);
+    }
+
+    // If knn_path is given, the K-nearest neighbor graph is also written
+    // there (see save_knn), and its recall on a sample is reported.
+    void build_index(GraphI &G, PR &Points, long cluster_size, long num_clusters, double alpha,
+                     const std::string &knn_path = ""){
 		clusterPID<Point, PointRange, indexType> C;
         old_neighbors = parlay::sequence<parlay::sequence<pid>>(G.size());
 		C.multiple_clustertrees(Points, cluster_size, num_clusters, K, old_neighbors);
 		nn_descent_wrapper(Points);
-		undirect_and_prune(G, Points, alpha);
+		if(knn_path != ""){
+			save_knn(knn_path);
+			double recall = knn_recall(Points);
+			std::cout << K << "-NN graph recall on sampled points: " << recall << std::endl;
+			if (build_telemetry::get().enabled()) {
+				telemetry_record r("pynn", "knn");
+				r.add("k", K).add("knn_recall", recall);
+				build_telemetry::get().write(r);
+			}
+		}
+		parlay::internal::timer t;
+		long distance_comps = undirect_and_prune(G, Points, alpha);
+		if (build_telemetry::get().enabled()) {
+			auto degrees = parlay::delayed_tabulate(G.size(), [&] (size_t i) {return (long) G[i].size();});
+			telemetry_record r("pynn", "prune");
+			r.add("prune_s", t.total_time())
+			  .add("distance_comps", distance_comps).add("prunes", (long) G.size())
+			  .add("avg_degree", parlay::reduce(degrees) / (double) G.size());
+			build_telemetry::get().write(r, true);
+		}
 	}
 };
 
@@ -15,9 +15,36 @@
 #include "types.h"
 #include "graph.h"
 #include "stats.h"
+#include "tombstones.h"
 
 namespace parlayANN {
 
+// Exact set of visited ids in [0,n), one per worker.  Each entry holds
+// the epoch in which it was last marked, so the set is cleared between
+// searches by bumping the epoch, and only zeroed when the epoch wraps.
+template<typename indexType, typename tagType = uint16_t>
+struct visited_table {
+  std::vector<tagType> tags;
+  tagType epoch = 0;
+
+  void reset(size_t n) {
+    if (tags.size() < n) {
+      tags.assign(n, 0);
+      epoch = 0;
+    }
+    if (++epoch == 0) {
+      std::fill(tags.begin(), tags.end(), 0);
+      epoch = 1;
+    }
+  }
+
+  bool test_and_set(indexType a) {
+    if (tags[a] == epoch) return true;
+    tags[a] = epoch;
+    return false;
+  }
+};
+
 // main beam search
 template<typename indexType, typename Point, typename PointRange,
          typename QPoint, typename QPointRange, class GT>
@@ -29,11 +56,16 @@ filtered_beam_search(const GT &G,
                      const QPoint qp, const QPointRange &Q_Points,
                      const parlay::sequence<indexType> starting_points,
                      const QueryParams &QP,
-                     bool use_filtering = false
+                     bool use_filtering = false,
+                     bool* truncated = nullptr,
+                     const Tombstones<indexType>* deleted = nullptr
                      ) {
   using dtype = typename Point::distanceType;
   using id_dist = std::pair<indexType, dtype>;
   int beamSize = QP.beamSize;
+  auto start_time = std::chrono::steady_clock::now();
+  bool bounded = QP.time_limit > 0 || QP.dist_budget > 0;
+  if (truncated != nullptr) *truncated = false;
 
   if (starting_points.size() == 0) {
     std::cout << "beam search expects at least one start point" << std::endl;
@@ -48,10 +80,14 @@ filtered_beam_search(const GT &G,
   };
 
   // used as a hash filter (can give false negative -- i.e. can say
-  // not in table when it is)
+  // not in table when it is), unless an exact visited table is requested,
+  // which costs a tag per point per worker
+  static thread_local visited_table<indexType> table;
+  if (QP.exact_visited) table.reset(Points.size());
   int bits = std::max<int>(10, std::ceil(std::log2(beamSize * beamSize)) - 2);
-  std::vector<indexType> hash_filter(1 << bits, -1);
+  std::vector<indexType> hash_filter(QP.exact_visited ? 0 : (1 << bits), -1);
   auto has_been_seen = [&](indexType a) -> bool {
+    if (QP.exact_visited) return table.test_and_set(a);
     int loc = parlay::hash64_2(a) & ((1 << bits) - 1);
     if (hash_filter[loc] == a) return true;
     hash_filter[loc] = a;
@@ -71,7 +107,7 @@ filtered_beam_search(const GT &G,
 
   // The subset of the frontier that has not been visited
   // Use the first of these to pick next vertex to visit.
-  std::vector<id_dist> unvisited_frontier(beamSize);
+  std::vector<id_dist> unvisited_frontier(std::max<size_t>(beamSize, frontier.size()));
   for (int i=0; i < frontier.size(); i++)
     unvisited_frontier[i] = frontier[i];
 
@@ -105,9 +141,16 @@ filtered_beam_search(const GT &G,
   // The main loop.  Terminate beam search when the entire frontier
   // has been visited or have reached max_visit.
   while (remain > offset && num_visited < QP.limit) {
+    // if out of time or distance budget, return the best found so far
+    // (the first node is always expanded so the frontier is not empty)
+    if (bounded && num_visited > 0 && QP.out_of_budget(start_time, full_dist_cmps)) {
+      if (truncated != nullptr) *truncated = true;
+      break;
+    }
     // the next node to visit is the unvisited frontier node that is closest to p
     id_dist current = unvisited_frontier[offset];
-    G[current.first].prefetch();
+    auto nbhs = G[current.first];
+    nbhs.prefetch();
     // add to visited set
     auto position = std::upper_bound(visited.begin(), visited.end(), current, less);
     visited.insert(position, current);
@@ -127,9 +170,9 @@ filtered_beam_search(const GT &G,
     // approximate hash it will be removed below by the union.
     pruned.clear();
     filtered.clear();
-    long num_elts = std::min<long>(G[current.first].size(), QP.degree_limit);
+    long num_elts = std::min<long>(nbhs.size(), QP.degree_limit);
     for (indexType i=0; i<num_elts; i++) {
-      auto a = G[current.first][i];
+      auto a = nbhs[i];
       if (has_been_seen(a) || Points[a].same_as(p)) continue;  // skip if already seen
       Q_Points[a].prefetch();
       pruned.push_back(a);
@@ -208,18 +251,307 @@ filtered_beam_search(const GT &G,
               unvisited_frontier.begin());
   }
 
+  // lazily deleted points are searched through but not returned
+  if (deleted != nullptr && deleted->count() > 0)
+    frontier.erase(std::remove_if(frontier.begin(), frontier.end(),
+                                  [&] (id_dist x) {return deleted->is_deleted(x.first);}),
+                   frontier.end());
+
   return std::make_pair(std::make_pair(parlay::to_sequence(frontier),
                                        parlay::to_sequence(visited)),
                         full_dist_cmps);
 }
 
+// Beam search restricted to points that satisfy a predicate (e.g. an
+// attribute filter).  The frontier is over all points so the search can
+// navigate through points that fail the predicate, while points that
+// pass are kept in a separate result set of size at most beamSize.
+// Post-filtering the ordinary beam would instead lose almost all of the
+// work when few points pass.  Returns (results, visited) and the number
+// of distance comparisons.
+template<typename indexType, typename Point, typename PointRange,
+         class GT, typename Pred>
+std::pair<std::pair<parlay::sequence<std::pair<indexType, typename Point::distanceType>>,
+                    parlay::sequence<std::pair<indexType, typename Point::distanceType>>>,
+          size_t>
+predicate_beam_search(const GT &G,
+                      const Point p, const PointRange &Points,
+                      const parlay::sequence<indexType> starting_points,
+                      const QueryParams &QP,
+                      const Pred& passes,
+                      bool* truncated = nullptr) {
+  using dtype = typename Point::distanceType;
+  using id_dist = std::pair<indexType, dtype>;
+  size_t beamSize = QP.beamSize;
+  auto start_time = std::chrono::steady_clock::now();
+  bool bounded = QP.time_limit > 0 || QP.dist_budget > 0;
+  if (truncated != nullptr) *truncated = false;
+
+  if (starting_points.size() == 0) {
+    std::cout << "beam search expects at least one start point" << std::endl;
+    abort();
+  }
+
+  auto less = [&](id_dist a, id_dist b) {
+    return a.second < b.second || (a.second == b.second && a.first < b.first);
+  };
+
+  // same approximate hash filter as filtered_beam_search
+  int bits = std::max<int>(10, std::ceil(std::log2(beamSize * beamSize)) - 2);
+  std::vector<indexType> hash_filter(1 << bits, -1);
+  auto has_been_seen = [&](indexType a) -> bool {
+    int loc = parlay::hash64_2(a) & ((1 << bits) - 1);
+    if (hash_filter[loc] == a) return true;
+    hash_filter[loc] = a;
+    return false;
+  };
+
+  // results holds the closest points found so far that pass the
+  // predicate, sorted by distance and of size at most beamSize
+  std::vector<id_dist> results;
+  results.reserve(beamSize + 1);
+  auto add_result = [&] (id_dist x) {
+    if (!passes(x.first)) return;
+    if (results.size() == beamSize && !less(x, results.back())) return;
+    auto pos = std::lower_bound(results.begin(), results.end(), x, less);
+    if (pos != results.end() && pos->first == x.first) return;
+    results.insert(pos, x);
+    if (results.size() > beamSize) results.pop_back();
+  };
+
+  std::vector<id_dist> frontier;
+  frontier.reserve(beamSize);
+  for (auto q : starting_points) {
+    if (has_been_seen(q)) continue;
+    id_dist x(q, Points[q].distance(p));
+    frontier.push_back(x);
+    add_result(x);
+  }
+  std::sort(frontier.begin(), frontier.end(), less);
+  if (frontier.size() > beamSize) frontier.resize(beamSize);
+
+  std::vector<id_dist> unvisited_frontier(std::max<size_t>(beamSize, frontier.size()));
+  for (size_t i=0; i < frontier.size(); i++)
+    unvisited_frontier[i] = frontier[i];
+
+  std::vector<id_dist> visited;
+  visited.reserve(2 * beamSize);
+
+  size_t dist_cmps = starting_points.size();
+  int remain = frontier.size();
+  int num_visited = 0;
+
+  std::vector<id_dist> new_frontier(2 * beamSize + G.max_degree());
+  std::vector<id_dist> candidates;
+  candidates.reserve(G.max_degree() + beamSize);
+  std::vector<indexType> unseen;
+  unseen.reserve(G.max_degree());
+
+  while (remain > 0 && num_visited < QP.limit) {
+    if (bounded && num_visited > 0 && QP.out_of_budget(start_time, dist_cmps)) {
+      if (truncated != nullptr) *truncated = true;
+      break;
+    }
+    id_dist current = unvisited_frontier[0];
+    G[current.first].prefetch();
+    auto position = std::upper_bound(visited.begin(), visited.end(), current, less);
+    visited.insert(position, current);
+    num_visited++;
+    bool frontier_full = frontier.size() == beamSize;
+
+    unseen.clear();
+    long num_elts = std::min<long>(G[current.first].size(), QP.degree_limit);
+    for (indexType i=0; i<num_elts; i++) {
+      auto a = G[current.first][i];
+      if (has_been_seen(a) || Points[a].same_as(p)) continue;
+      Points[a].prefetch();
+      unseen.push_back(a);
+    }
+
+    dtype cutoff = (frontier_full
+                    ? frontier[frontier.size() - 1].second
+                    : (dtype)std::numeric_limits<int>::max());
+    for (auto a : unseen) {
+      id_dist x(a, Points[a].distance(p));
+      dist_cmps++;
+      add_result(x);
+      if (x.second >= cutoff) continue;
+      candidates.push_back(x);
+    }
+
+    std::sort(candidates.begin(), candidates.end(), less);
+    auto candidates_end = std::unique(candidates.begin(), candidates.end(),
+                                      [] (auto a, auto b) {return a.first == b.first;});
+    auto new_frontier_size =
+      std::set_union(frontier.begin(), frontier.end(), candidates.begin(),
+                     candidates_end, new_frontier.begin(), less) -
+      new_frontier.begin();
+    candidates.clear();
+    new_frontier_size = std::min<size_t>(beamSize, new_frontier_size);
+
+    // the cut is applied relative to the k-th closest passing point,
+    // since the frontier may be dominated by points that fail
+    if (QP.k > 0 && (long) results.size() > QP.k && Points[0].is_metric()) {
+      dtype bound = QP.cut * results[QP.k - 1].second;
+      new_frontier_size = std::max<long>(
+        (std::upper_bound(new_frontier.begin(),
+                          new_frontier.begin() + new_frontier_size,
+                          std::pair{0, bound}, less) -
+         new_frontier.begin()), std::min<long>(QP.k, new_frontier_size));
+    }
+
+    frontier.clear();
+    for (indexType i = 0; i < new_frontier_size; i++)
+      frontier.push_back(new_frontier[i]);
+
+    remain = (std::set_difference(frontier.begin(), frontier.end(),
+                                  visited.begin(), visited.end(),
+                                  unvisited_frontier.begin(), less) -
+              unvisited_frontier.begin());
+  }
+
+  return std::make_pair(std::make_pair(parlay::to_sequence(results),
+                                       parlay::to_sequence(visited)),
+                        dist_cmps);
+}
+
+// Single query searches with a beam at least this wide are worth running
+// with parallel_beam_search.
+const long parallel_beam_threshold = 500;
+
+// Beam search for a single query that expands up to width frontier
+// nodes per round in parallel.  The seen filter is shared across the
+// workers, and the candidates they find are merged into the frontier at
+// the end of each round.  Expanding several nodes per round can visit
+// some nodes a sequential search would skip, so it does somewhat more
+// work in total, but it reduces the latency of a query with a large
+// beam.  Returns the same (frontier, visited) pair and distance count as
+// beam_search.
+template<typename indexType, typename Point, typename PointRange, class GT>
+std::pair<std::pair<parlay::sequence<std::pair<indexType, typename Point::distanceType>>,
+                    parlay::sequence<std::pair<indexType, typename Point::distanceType>>>,
+          size_t>
+parallel_beam_search(const GT &G,
+                     const Point p, const PointRange &Points,
+                     const parlay::sequence<indexType> starting_points,
+                     const QueryParams &QP,
+                     long width = 0,
+                     bool* truncated = nullptr) {
+  using dtype = typename Point::distanceType;
+  using id_dist = std::pair<indexType, dtype>;
+  long beamSize = QP.beamSize;
+  if (width == 0) width = std::max<long>(2, std::min<long>(parlay::num_workers(), 32));
+  auto start_time = std::chrono::steady_clock::now();
+  bool bounded = QP.time_limit > 0 || QP.dist_budget > 0;
+  if (truncated != nullptr) *truncated = false;
+
+  if (starting_points.size() == 0) {
+    std::cout << "beam search expects at least one start point" << std::endl;
+    abort();
+  }
+
+  auto less = [&](id_dist a, id_dist b) {
+    return a.second < b.second || (a.second == b.second && a.first < b.first);
+  };
+
+  // a concurrent version of the approximate hash filter used by
+  // filtered_beam_search.  Like that one it can report a seen point as
+  // unseen, so duplicates are removed again when merging.
+  int bits = std::max<int>(10, std::ceil(std::log2(beamSize * beamSize)) - 2);
+  parlay::sequence<std::atomic<indexType>> hash_filter(1 << bits);
+  parlay::parallel_for(0, 1 << bits, [&] (long i) {hash_filter[i] = -1;});
+  auto has_been_seen = [&](indexType a) -> bool {
+    int loc = parlay::hash64_2(a) & ((1 << bits) - 1);
+    indexType old = hash_filter[loc].load();
+    if (old == a) return true;
+    return !hash_filter[loc].compare_exchange_strong(old, a) && old == a;
+  };
+
+  std::vector<id_dist> frontier;
+  for (auto q : starting_points) {
+    if (has_been_seen(q)) continue;
+    frontier.push_back(id_dist(q, Points[q].distance(p)));
+  }
+  std::sort(frontier.begin(), frontier.end(), less);
+  if (frontier.size() > beamSize) frontier.resize(beamSize);
+
+  std::vector<id_dist> visited;
+  std::vector<id_dist> unvisited(frontier.size());
+  std::vector<id_dist> merged;
+  size_t dist_cmps = starting_points.size();
+
+  while (visited.size() < QP.limit) {
+    // out of time or distance budget (checked once per round)
+    if (bounded && visited.size() > 0 && QP.out_of_budget(start_time, dist_cmps)) {
+      if (truncated != nullptr) *truncated = true;
+      break;
+    }
+    // the closest (up to) width unvisited nodes are expanded this round
+    unvisited.resize(frontier.size());
+    long num_unvisited = (std::set_difference(frontier.begin(), frontier.end(),
+                                              visited.begin(), visited.end(),
+                                              unvisited.begin(), less) -
+                          unvisited.begin());
+    long num_expand = std::min<long>({num_unvisited, width, QP.limit - (long) visited.size()});
+    if (num_expand == 0) break;
+
+    merged.resize(visited.size() + num_expand);
+    std::merge(visited.begin(), visited.end(), unvisited.begin(),
+               unvisited.begin() + num_expand, merged.begin(), less);
+    std::swap(visited, merged);
+
+    dtype cutoff = (frontier.size() == beamSize
+                    ? frontier.back().second
+                    : (dtype)std::numeric_limits<int>::max());
+    auto found = parlay::tabulate(num_expand, [&] (long i) {
+      indexType current = unvisited[i].first;
+      long num_elts = std::min<long>(G[current].size(), QP.degree_limit);
+      parlay::sequence<id_dist> out;
+      out.reserve(num_elts);
+      long cmps = 0;
+      for (long j = 0; j < num_elts; j++) {
+        auto a = G[current][j];
+        if (has_been_seen(a) || Points[a].same_as(p)) continue;
+        dtype dist = Points[a].distance(p);
+        cmps++;
+        if (dist >= cutoff) continue;
+        out.push_back(id_dist(a, dist));
+      }
+      return std::make_pair(std::move(out), cmps);
+    }, 1);
+    for (auto &f : found) dist_cmps += f.second;
+
+    auto candidates = parlay::flatten(parlay::map(found, [] (auto &f) {return f.first;}));
+    std::sort(candidates.begin(), candidates.end(), less);
+    auto candidates_end = std::unique(candidates.begin(), candidates.end(),
+                                      [] (auto a, auto b) {return a.first == b.first;});
+    merged.resize(frontier.size() + (candidates_end - candidates.begin()));
+    long new_frontier_size =
+      std::set_union(frontier.begin(), frontier.end(), candidates.begin(),
+                     candidates_end, merged.begin(), less) - merged.begin();
+    new_frontier_size = std::min<long>(beamSize, new_frontier_size);
+    if (QP.k > 0 && new_frontier_size > QP.k && Points[0].is_metric())
+      new_frontier_size = std::max<long>(
+        (std::upper_bound(merged.begin(), merged.begin() + new_frontier_size,
+                          std::pair{0, QP.cut * merged[QP.k].second}, less) -
+         merged.begin()), std::min<long>(frontier.size(), new_frontier_size));
+    merged.resize(new_frontier_size);
+    std::swap(frontier, merged);
+  }
+
+  return std::make_pair(std::make_pair(parlay::to_sequence(frontier),
+                                       parlay::to_sequence(visited)),
+                        dist_cmps);
+}
+
 // version without filtering
 template<typename Point, typename PointRange, typename indexType>
 std::pair<std::pair<parlay::sequence<std::pair<indexType, typename Point::distanceType>>,
                     parlay::sequence<std::pair<indexType, typename Point::distanceType>>>, size_t>
 beam_search(const Point p, const Graph<indexType> &G, const PointRange &Points,
-            const parlay::sequence<indexType> starting_points, const QueryParams &QP) {
-  return filtered_beam_search(G, p, Points, p, Points, starting_points, QP, false);
+            const parlay::sequence<indexType> starting_points, const QueryParams &QP,
+            bool* truncated = nullptr) {
+  return filtered_beam_search(G, p, Points, p, Points, starting_points, QP, false, truncated);
 }
 
 // backward compatibility (for hnsw)
@@ -235,9 +567,10 @@ template<typename Point, typename PointRange, typename indexType>
 std::pair<std::pair<parlay::sequence<std::pair<indexType, typename Point::distanceType>>,
                     parlay::sequence<std::pair<indexType, typename Point::distanceType>>>, indexType>
 beam_search(const Point p, const Graph<indexType> &G, const PointRange &Points,
-            const indexType starting_point, const QueryParams &QP) {
+            const indexType starting_point, const QueryParams &QP,
+            bool* truncated = nullptr) {
   parlay::sequence<indexType> start_points = {starting_point};
-  return beam_search(p, G, Points, start_points, QP);
+  return beam_search(p, G, Points, start_points, QP, truncated);
 }
 
 // a range search that first finds a close point using a beam search,
@@ -248,7 +581,11 @@ range_search(Point p, GT &G, PointRange &Points,
              parlay::sequence<indexType> starting_points,
              typename Point::distanceType radius,
              typename Point::distanceType radius_2,
-             QueryParams &QP, bool use_existing = false) {
+             QueryParams &QP, bool use_existing = false,
+             bool* truncated = nullptr) {
+  auto start_time = std::chrono::steady_clock::now();
+  bool bounded = QP.time_limit > 0 || QP.dist_budget > 0;
+  if (truncated != nullptr) *truncated = false;
   // first search for a starting point within the radius
 
   std::vector<indexType> result;
@@ -278,6 +615,11 @@ range_search(Point p, GT &G, PointRange &Points,
   // now do a BFS over all vertices with distance less than radius
   long position = 0;
   while (position < result.size()) {
+    // if out of time or distance budget, return what is in range so far
+    if (bounded && QP.out_of_budget(start_time, distance_comparisons)) {
+      if (truncated != nullptr) *truncated = true;
+      break;
+    }
     indexType next = result[position++];
     std::vector<indexType> unseen;
     for (long i = 0; i < G[next].size(); i++) {
@@ -305,7 +647,27 @@ range_search(Point p, GT &G, PointRange &Points,
   return std::pair(result, distance_comparisons);
 }
 
-// searches every element in q starting from a randomly selected point
+// Writes the first k of the (id, distance) pairs in elts to ids[0, k)
+// and dists[0, k) (dists can be null).  A search that ran out of time or
+// distance budget can find fewer than k, in which case the rest are
+// padded with the largest id and distance.
+template<typename Elts, typename indexType, typename distanceType>
+void write_neighbors(const Elts &elts, long k,
+                     indexType* ids, distanceType* dists) {
+  long num = std::min<long>(k, elts.size());
+  for (long j = 0; j < num; j++) {
+    ids[j] = elts[j].first;
+    if (dists != nullptr) dists[j] = elts[j].second;
+  }
+  for (long j = num; j < k; j++) {
+    ids[j] = std::numeric_limits<indexType>::max();
+    if (dists != nullptr) dists[j] = std::numeric_limits<distanceType>::max();
+  }
+}
+
+// searches every element in q starting from a randomly selected point.
+// Fewer than k neighbors are returned for a query that runs out of time
+// or distance budget (see QueryParams) before finding k.
 template<typename PointRange, typename indexType>
 parlay::sequence<parlay::sequence<indexType>>
 beamSearchRandom(const PointRange& Query_Points,
@@ -332,24 +694,62 @@ beamSearchRandom(const PointRange& Query_Points,
   });
 
   parlay::parallel_for(0, Query_Points.size(), [&](size_t i) {
-    parlay::sequence<indexType> neighbors = parlay::sequence<indexType>(QP.k);
     indexType start = indices[i];
     parlay::sequence<std::pair<indexType, typename Point::distanceType>> beamElts;
     parlay::sequence<std::pair<indexType, typename Point::distanceType>> visitedElts;
+    bool truncated;
     auto [pairElts, dist_cmps] =
-      beam_search(Query_Points[i], G, Base_Points, start, QP);
+      beam_search(Query_Points[i], G, Base_Points, start, QP, &truncated);
     beamElts = pairElts.first;
     visitedElts = pairElts.second;
-    for (indexType j = 0; j < QP.k; j++) {
-      neighbors[j] = beamElts[j].first;
-    }
-    all_neighbors[i] = neighbors;
+    long num = std::min<long>(QP.k, beamElts.size());
+    all_neighbors[i] = parlay::tabulate(num, [&] (long j) {return beamElts[j].first;});
     QueryStats.increment_visited(i, visitedElts.size());
     QueryStats.increment_dist(i, dist_cmps);
+    if (truncated) QueryStats.set_truncated(i);
   });
   return all_neighbors;
 }
 
+// Same as beamSearchRandom but writes the results into caller provided
+// arrays, laid out as in qsearchAllInto.  dists can be null.
+template<typename PointRange, typename indexType, typename distanceType>
+void beamSearchRandomInto(const PointRange& Query_Points,
+                          const Graph<indexType> &G,
+                          const PointRange &Base_Points,
+                          stats<indexType> &QueryStats,
+                          const QueryParams &QP,
+                          indexType* ids, distanceType* dists,
+                          long stride = 0) {
+  if (QP.k > QP.beamSize) {
+    std::cout << "Error: beam search parameter Q = " << QP.beamSize
+              << " same size or smaller than k = " << QP.k << std::endl;
+    abort();
+  }
+  if (stride == 0) stride = QP.k;
+  size_t n = G.size();
+
+  parlay::random_generator gen;
+  std::uniform_int_distribution<long> dis(0, n - 1);
+  auto indices = parlay::tabulate(Query_Points.size(), [&](size_t i) {
+    auto r = gen[i];
+    return dis(r);
+  });
+
+  parlay::parallel_for(0, Query_Points.size(), [&](size_t i) {
+    indexType start = indices[i];
+    bool truncated;
+    auto [pairElts, dist_cmps] =
+      beam_search(Query_Points[i], G, Base_Points, start, QP, &truncated);
+    auto& [beamElts, visitedElts] = pairElts;
+    write_neighbors(beamElts, QP.k, ids + i * stride,
+                    dists == nullptr ? nullptr : dists + i * stride);
+    QueryStats.increment_visited(i, visitedElts.size());
+    QueryStats.increment_dist(i, dist_cmps);
+    if (truncated) QueryStats.set_truncated(i);
+  });
+}
+
 template<typename PointRange, typename indexType>
 parlay::sequence<parlay::sequence<indexType>>
 searchAll(PointRange& Query_Points,
@@ -372,20 +772,99 @@ searchAll(PointRange &Query_Points,
   }
   parlay::sequence<parlay::sequence<indexType>> all_neighbors(Query_Points.size());
   parlay::parallel_for(0, Query_Points.size(), [&](size_t i) {
-    parlay::sequence<indexType> neighbors = parlay::sequence<indexType>(QP.k);
-    auto [pairElts, dist_cmps] = beam_search(Query_Points[i], G, Base_Points, starting_points, QP);
+    bool truncated;
+    auto [pairElts, dist_cmps] = beam_search(Query_Points[i], G, Base_Points, starting_points, QP,
+                                             &truncated);
     auto [beamElts, visitedElts] = pairElts;
-    for (indexType j = 0; j < QP.k; j++) {
-      neighbors[j] = beamElts[j].first;
-    }
-    all_neighbors[i] = neighbors;
+    long num = std::min<long>(QP.k, beamElts.size());
+    all_neighbors[i] = parlay::tabulate(num, [&] (long j) {return beamElts[j].first;});
     QueryStats.increment_visited(i, visitedElts.size());
     QueryStats.increment_dist(i, dist_cmps);
+    if (truncated) QueryStats.set_truncated(i);
   });
 
   return all_neighbors;
 }
 
+// Same as searchAll but writes the k neighbors of query i and their
+// distances to ids[i * stride + j] and dists[i * stride + j] (see
+// qsearchAllInto).  dists can be null.  The queries can be any range
+// of points, e.g. a view of a caller's array.  Queries that run out of
+// time or budget with fewer than k are padded (see write_neighbors).
+template<typename QueryRange, typename PointRange, typename indexType, typename distanceType>
+void searchAllInto(const QueryRange &Query_Points,
+                   const Graph<indexType> &G, const PointRange &Base_Points,
+                   stats<indexType> &QueryStats,
+                   const parlay::sequence<indexType> &starting_points,
+                   const QueryParams &QP,
+                   indexType* ids, distanceType* dists,
+                   long stride = 0) {
+  if (QP.k > QP.beamSize) {
+    std::cout << "Error: beam search parameter Q = " << QP.beamSize
+              << " same size or smaller than k = " << QP.k << std::endl;
+    abort();
+  }
+  if (stride == 0) stride = QP.k;
+  parlay::parallel_for(0, Query_Points.size(), [&](size_t i) {
+    bool truncated;
+    auto [pairElts, dist_cmps] = beam_search(Query_Points[i], G, Base_Points, starting_points, QP,
+                                             &truncated);
+    auto& [beamElts, visitedElts] = pairElts;
+    write_neighbors(beamElts, QP.k, ids + i * stride,
+                    dists == nullptr ? nullptr : dists + i * stride);
+    QueryStats.increment_visited(i, visitedElts.size());
+    QueryStats.increment_dist(i, dist_cmps);
+    if (truncated) QueryStats.set_truncated(i);
+  });
+}
+
+// searches every element in q for its nearest neighbors among the base
+// points that carry all of the query's labels.  Each search starts from
+// starting_point and from the entry point of each of the query's labels.
+// Fewer than k neighbors are returned if fewer are found.
+template<typename PointRange, typename Labels, typename indexType>
+parlay::sequence<parlay::sequence<indexType>>
+labelSearchAll(const PointRange &Query_Points, const Labels &Query_Labels,
+               const Graph<indexType> &G,
+               const PointRange &Base_Points, const Labels &Base_Labels,
+               stats<indexType> &QueryStats,
+               indexType starting_point,
+               const QueryParams &QP) {
+  if (QP.k > QP.beamSize) {
+    std::cout << "Error: beam search parameter Q = " << QP.beamSize
+              << " same size or smaller than k = " << QP.k << std::endl;
+    abort();
+  }
+  if (Query_Labels.size() != Query_Points.size()) {
+    std::cout << "Error: " << Query_Labels.size() << " query labels for "
+              << Query_Points.size() << " queries" << std::endl;
+    abort();
+  }
+  if (Base_Labels.size() != Base_Points.size()) {
+    std::cout << "Error: " << Base_Labels.size() << " base labels for "
+              << Base_Points.size() << " points" << std::endl;
+    abort();
+  }
+  parlay::sequence<parlay::sequence<indexType>> all_neighbors(Query_Points.size());
+  parlay::parallel_for(0, Query_Points.size(), [&](size_t i) {
+    auto ql = Query_Labels[i];
+    parlay::sequence<indexType> starts = {starting_point};
+    for (auto l : ql)
+      if (Base_Labels.count(l) > 0) starts.push_back(Base_Labels.entry_point(l));
+    auto passes = [&] (indexType j) {return Base_Labels.matches(j, ql);};
+    bool truncated;
+    auto [pairElts, dist_cmps] = predicate_beam_search(G, Query_Points[i], Base_Points,
+                                                       starts, QP, passes, &truncated);
+    auto [resultElts, visitedElts] = pairElts;
+    long num = std::min<long>(QP.k, resultElts.size());
+    all_neighbors[i] = parlay::tabulate(num, [&] (long j) {return resultElts[j].first;});
+    QueryStats.increment_visited(i, visitedElts.size());
+    QueryStats.increment_dist(i, dist_cmps);
+    if (truncated) QueryStats.set_truncated(i);
+  });
+  return all_neighbors;
+}
+
 // Returns a sequence of nearest neighbors each with their distance
 template<typename Point, typename QPoint, typename QQPoint,
          typename PointRange, typename QPointRange, typename QQPointRange,
@@ -401,26 +880,33 @@ beam_search_rerank(const Point &p,
                    stats<indexType> &QueryStats,
                    const parlay::sequence<indexType> starting_points,
                    const QueryParams &QP,
-                   bool stats = true) {
+                   bool stats = true,
+                   bool* truncated_out = nullptr) {
   using dtype = typename Point::distanceType;
   using id_dist = std::pair<indexType, dtype>;
   auto QPP = QP;
 
   bool use_rerank = (Base_Points.params.num_bytes() != Q_Base_Points.params.num_bytes());
   bool use_filtering = (Q_Base_Points.params.num_bytes() != QQ_Base_Points.params.num_bytes());
+  bool truncated;
   auto [pairElts, dist_cmps] = filtered_beam_search(G,
                                                     qp, Q_Base_Points,
                                                     qqp, QQ_Base_Points,
-                                                    starting_points, QPP, use_filtering);
+                                                    starting_points, QPP, use_filtering,
+                                                    &truncated);
   auto [beamElts, visitedElts] = pairElts;
-  if (beamElts.size() < QP.k) {
+  // a search cut short by its time or distance budget returns what it found
+  if ((long) beamElts.size() < QP.k && !truncated) {
     std::cout << "Error: for point id " << p.id() << " beam search returned " << beamElts.size() << " elements, which is less than k = " << QP.k << std::endl;
     abort();
   }
+  long num = std::min<long>(QP.k, beamElts.size());
+  if (truncated_out != nullptr) *truncated_out = truncated;
   
   if (stats) {
     QueryStats.increment_visited(p.id(), visitedElts.size());
     QueryStats.increment_dist(p.id(), dist_cmps);
+    if (truncated) QueryStats.set_truncated(p.id());
   }
 
   if (use_rerank) {
@@ -438,14 +924,14 @@ beam_search_rerank(const Point &p,
 
     // keep first k
     parlay::sequence<id_dist> results;
-    for (int i= 0; i < QP.k; i++)
+    for (int i= 0; i < num; i++)
       results.push_back(pts[i]);
 
     return results;
   } else {
     //return beamElts;
     parlay::sequence<id_dist> results;
-    for (int i= 0; i < QP.k; i++) {
+    for (int i= 0; i < num; i++) {
       int j = beamElts[i].first;
       results.push_back(id_dist(j, p.distance(Base_Points[j])));
     }
@@ -564,6 +1050,43 @@ qsearchAll(const PointRange &Query_Points,
   return all_neighbors;
 }
 
+// Same as qsearchAll but writes the k neighbors of query i and their
+// distances into caller provided arrays, at ids[i * stride + j] and
+// dists[i * stride + j] for j < k (stride defaults to k).  Avoids
+// allocating a result per query, and keeps the distances.  dists can be
+// null if they are not needed.  Queries that run out of time or budget
+// with fewer than k are padded (see write_neighbors).
+template<typename PointRange, typename QPointRange, typename QQPointRange,
+         typename indexType, typename distanceType>
+void qsearchAllInto(const PointRange &Query_Points,
+                    const QPointRange &Q_Query_Points,
+                    const QQPointRange &QQ_Query_Points,
+                    const Graph<indexType> &G,
+                    const PointRange &Base_Points,
+                    const QPointRange &Q_Base_Points,
+                    const QQPointRange &QQ_Base_Points,
+                    stats<indexType> &QueryStats,
+                    const indexType starting_point,
+                    const QueryParams &QP,
+                    indexType* ids, distanceType* dists,
+                    long stride = 0) {
+  if (QP.k > QP.beamSize) {
+    std::cout << "Error: beam search parameter Q = " << QP.beamSize
+              << " same size or smaller than k = " << QP.k << std::endl;
+    abort();
+  }
+  if (stride == 0) stride = QP.k;
+  parlay::sequence<indexType> starting_points = {starting_point};
+  parlay::parallel_for(0, Query_Points.size(), [&](size_t i) {
+    auto ngh_dist = beam_search_rerank(Query_Points[i], Q_Query_Points[i], QQ_Query_Points[i],
+                                       G,
+                                       Base_Points, Q_Base_Points, QQ_Base_Points,
+                                       QueryStats, starting_points, QP);
+    write_neighbors(ngh_dist, QP.k, ids + i * stride,
+                    dists == nullptr ? nullptr : dists + i * stride);
+  });
+}
+
 // template<typename Point, typename PointRange, typename indexType>
 // parlay::sequence<parlay::sequence<indexType>>
 // RangeSearch(PointRange& Query_Points,
@@ -11,50 +11,22 @@
 #include "parlay/primitives.h"
 #include "types.h"
 #include "stats.h"
+#include "telemetry.h"
 
 namespace parlayANN {
 
-template<typename PointRange, typename QPointRange, typename QQPointRange, typename indexType>
-nn_result checkRecall(const Graph<indexType> &G,
-                      const PointRange &Base_Points,
-                      const PointRange &Query_Points,
-                      const QPointRange &Q_Base_Points,
-                      const QPointRange &Q_Query_Points,
-                      const QQPointRange &QQ_Base_Points,
-                      const QQPointRange &QQ_Query_Points,
-                      const groundTruth<indexType> &GT,
-                      const bool random,
-                      const long start_point,
-                      const long k,
-                      const QueryParams &QP,
-                      const bool verbose) {
+// recall@k of the neighbors ngh[i * ngh_k, i * ngh_k + k) reported for
+// each query i; neighbors tied in distance with the k-th nearest count
+// as correct
+template<typename PointRange, typename indexType>
+float ground_truth_recall(const parlay::sequence<indexType> &ngh, long ngh_k,
+                          const PointRange &Base_Points,
+                          const PointRange &Query_Points,
+                          const groundTruth<indexType> &GT,
+                          const long k) {
   using Point = typename PointRange::Point;
+  auto all_ngh = [&] (long i) {return ngh.cut(i * ngh_k, (i + 1) * ngh_k);};
 
-  if (GT.size() > 0 && k > GT.dimension()) {
-    std::cout << k << "@" << k << " too large for ground truth data of size "
-              << GT.dimension() << std::endl;
-    abort();
-  }
-
-  parlay::sequence<parlay::sequence<indexType>> all_ngh;
-
-  parlay::internal::timer t;
-  float query_time;
-  stats<indexType> QueryStats(Query_Points.size());
-  QueryStats.clear();
-  // to help clear the cache between runs
-  auto volatile xx = parlay::random_permutation<long>(5000000);
-  t.next_time();
-  if (random) {
-    all_ngh = beamSearchRandom(Query_Points, G, Base_Points, QueryStats, QP);
-  } else {
-    all_ngh = qsearchAll<PointRange, QPointRange, QQPointRange, indexType>(Query_Points, Q_Query_Points, QQ_Query_Points,
-                                                                           G,
-                                                                           Base_Points, Q_Base_Points, QQ_Base_Points,
-                                                                           QueryStats, start_point, QP);
-  }
-  query_time = t.next_time();
-  
   float recall = 0.0;
   //TODO deprecate this after further testing
   bool dists_present = true;
@@ -63,12 +35,12 @@ nn_result checkRecall(const Graph<indexType> &G,
     int numCorrect = 0;
     for (indexType i = 0; i < n; i++) {
       std::set<indexType> reported_nbhs;
-      if (all_ngh[i].size() != k) {
-        std::cout << "bad number of neighbors reported: " << all_ngh[i].size() << std::endl;
+      if ((long) all_ngh(i).size() < k) {
+        std::cout << "bad number of neighbors reported: " << all_ngh(i).size() << std::endl;
         abort();
       }
-      for (indexType l = 0; l < k; l++) reported_nbhs.insert((all_ngh[i])[l]);
-      if (reported_nbhs.size() != k) {
+      for (indexType l = 0; l < k; l++) reported_nbhs.insert((all_ngh(i))[l]);
+      if ((long) reported_nbhs.size() != k) {
         std::cout << "duplicate entries in reported neighbors" << std::endl;
         abort();
       }
@@ -98,7 +70,7 @@ nn_result checkRecall(const Graph<indexType> &G,
         }
       }
       std::set<int> reported_nbhs;
-      for (indexType l = 0; l < k; l++) reported_nbhs.insert((all_ngh[i])[l]);
+      for (indexType l = 0; l < k; l++) reported_nbhs.insert((all_ngh(i))[l]);
       for (indexType l = 0; l < results_with_ties.size(); l++) {
         if (reported_nbhs.find(results_with_ties[l]) != reported_nbhs.end()) {
           numCorrect += 1;
@@ -107,7 +79,58 @@ nn_result checkRecall(const Graph<indexType> &G,
     }
     recall = static_cast<float>(numCorrect) / static_cast<float>(k * n);
   }
+  return recall;
+}
+
+template<typename PointRange, typename QPointRange, typename QQPointRange, typename indexType>
+nn_result checkRecall(const Graph<indexType> &G,
+                      const PointRange &Base_Points,
+                      const PointRange &Query_Points,
+                      const QPointRange &Q_Base_Points,
+                      const QPointRange &Q_Query_Points,
+                      const QQPointRange &QQ_Base_Points,
+                      const QQPointRange &QQ_Query_Points,
+                      const groundTruth<indexType> &GT,
+                      const bool random,
+                      const long start_point,
+                      const long k,
+                      const QueryParams &QP,
+                      const bool verbose) {
+  if (GT.size() > 0 && k > GT.dimension()) {
+    std::cout << k << "@" << k << " too large for ground truth data of size "
+              << GT.dimension() << std::endl;
+    abort();
+  }
+
+  // neighbors of query i are at ngh[i * QP.k, (i + 1) * QP.k)
+  parlay::sequence<indexType> ngh(Query_Points.size() * QP.k);
+  parlay::sequence<float> ngh_dists(Query_Points.size() * QP.k);
+
+  parlay::internal::timer t;
+  float query_time;
+  stats<indexType> QueryStats(Query_Points.size());
+  QueryStats.clear();
+  // to help clear the cache between runs
+  auto volatile xx = parlay::random_permutation<long>(5000000);
+  t.next_time();
+  if (random) {
+    beamSearchRandomInto(Query_Points, G, Base_Points, QueryStats, QP,
+                         ngh.begin(), ngh_dists.begin());
+  } else {
+    qsearchAllInto(Query_Points, Q_Query_Points, QQ_Query_Points,
+                   G,
+                   Base_Points, Q_Base_Points, QQ_Base_Points,
+                   QueryStats, (indexType) start_point, QP,
+                   ngh.begin(), ngh_dists.begin());
+  }
+  query_time = t.next_time();
+  
+  float recall = ground_truth_recall(ngh, QP.k, Base_Points, Query_Points, GT, k);
   float QPS = Query_Points.size() / query_time;
+  size_t num_truncated = QueryStats.num_truncated();
+  if (num_truncated > 0)
+    std::cout << num_truncated << " of " << Query_Points.size()
+              << " queries ran out of time or distance budget" << std::endl;
   if (verbose)
     std::cout << "search: Q=" << QP.beamSize << ", k=" << QP.k
               << ", limit=" << QP.limit
@@ -174,43 +197,35 @@ void search_and_parse(Graph_ G_,
                       PointRange &Query_Points,
                       groundTruth<indexType> GT, char* res_file, long k,
                       bool verbose = false,
-                      long fixed_beam_width = 0) {
-  search_and_parse(G_, G, Base_Points, Query_Points, Base_Points, Query_Points, Base_Points, Query_Points, GT, res_file, k, false, 0u, verbose, fixed_beam_width);
+                      long fixed_beam_width = 0,
+                      bool exact_visited = false,
+                      double time_limit = 0.0,
+                      long dist_budget = 0) {
+  search_and_parse(G_, G, Base_Points, Query_Points, Base_Points, Query_Points, Base_Points, Query_Points, GT, res_file, k, false, 0u, verbose, fixed_beam_width, 100, exact_visited,
+                   time_limit, dist_budget);
 }
 
-template<typename PointRange, typename QPointRange, typename QQPointRange, typename indexType>
-void search_and_parse(Graph_ G_,
-                      Graph<indexType> &G,
-                      PointRange &Base_Points,
-                      PointRange &Query_Points,
-                      QPointRange &Q_Base_Points,
-                      QPointRange &Q_Query_Points,
-                      QQPointRange &QQ_Base_Points,
-                      QQPointRange &QQ_Query_Points,
-                      groundTruth<indexType> GT, char* res_file, long k,
-                      bool random = true,
-                      indexType start_point = 0,
-                      bool verbose = false,
-                      long fixed_beam_width = 0,
-                      int rerank_factor = 100) {
+// The standard sweep of query parameters for an index of n points with
+// the given maximum degree: beam widths from k to 1000, then searches
+// limited to visiting 10 to 35 points, then one "best accuracy" search.
+// check(k, QP) runs all the queries with QP and returns their result.
+// The results are summarized by recall bucket and written to res_file.
+template<typename Check>
+void sweep_and_parse(Graph_ G_, Check check, long n, long max_degree,
+                     char* res_file, long k,
+                     long fixed_beam_width = 0,
+                     int rerank_factor = 100,
+                     bool exact_visited = false) {
   parlay::sequence<nn_result> results;
   std::vector<long> beams;
   std::vector<long> allr;
   std::vector<double> cuts;
 
-  auto check = [&] (const long k, const QueryParams QP) {
-    return checkRecall(G,
-                       Base_Points, Query_Points,
-                       Q_Base_Points, Q_Query_Points,
-                       QQ_Base_Points, QQ_Query_Points,
-                       GT,
-                       random,
-                       start_point, k, QP, verbose);};
-
   QueryParams QP;
-  QP.limit = (long) G.size();
+  QP.limit = n;
   QP.rerank_factor = rerank_factor;
-  QP.degree_limit = (long) G.max_degree();
+  QP.degree_limit = max_degree;
+  QP.exact_visited = exact_visited;
   beams = {10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 22, 24, 26, 28, 30, 32,
     34, 36, 38, 40, 45, 50, 55, 60, 65, 70, 80, 90, 100, 120, 140, 160,
     180, 200, 225, 250, 275, 300, 375, 500, 750, 1000};
@@ -242,18 +257,20 @@ void search_and_parse(Graph_ G_,
       // {10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 28, 30, 35}; //
       parlay::sequence<long> limits = {10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 28, 30, 35};
       //calculate_limits(results[0].avg_visited);
-      //parlay::sequence<long> degree_limits = calculate_limits(G.max_degree());
-      //degree_limits.push_back(G.max_degree());
-      QP = QueryParams(r, r, 1.35, (long) G.size(), (long) G.max_degree());
+      //parlay::sequence<long> degree_limits = calculate_limits(max_degree);
+      //degree_limits.push_back(max_degree);
+      QP = QueryParams(r, r, 1.35, n, max_degree);
+      QP.exact_visited = exact_visited;
       for(long l : limits){
         QP.limit = l;
         QP.beamSize = std::max<long>(l, r);
         //for(long dl : degree_limits){
-        QP.degree_limit = std::min<int>(G.max_degree(), 5 * l);
+        QP.degree_limit = std::min<int>(max_degree, 5 * l);
         results.push_back(check(r, QP));
       }
       // check "best accuracy"
-      QP = QueryParams((long) 100, (long) 1000, (double) 10.0, (long) G.size(), (long) G.max_degree());
+      QP = QueryParams((long) 100, (long) 1000, (double) 10.0, n, max_degree);
+      QP.exact_visited = exact_visited;
       results.push_back(check(r, QP));
 
       parlay::sequence<float> buckets =  {.1, .2, .3,  .4,  .5,  .6, .7, .75,  .8, .85,
@@ -263,10 +280,196 @@ void search_and_parse(Graph_ G_,
       std::cout << std::endl;
       if (res_file != NULL)
         write_to_csv(std::string(res_file), ret_buckets, res, G_);
+
+      // compare against the hash filter: with the exact table no
+      // distance is computed twice, so the difference in comparisons
+      // is (roughly) the redundant work due to the hash filter
+      if (exact_visited) {
+        std::cout << "Visited filter comparison (hash vs. exact):" << std::endl;
+        for (long Q : {r, 2 * r, 5 * r, 10 * r, 50 * r}) {
+          QP = QueryParams(r, Q, 1.35, n, max_degree, rerank_factor);
+          QP.exact_visited = false;
+          nn_result H = check(r, QP);
+          QP.exact_visited = true;
+          nn_result E = check(r, QP);
+          std::cout << "Q = " << Q
+                    << ": recall " << H.recall << " vs. " << E.recall
+                    << ", QPS " << H.QPS << " vs. " << E.QPS
+                    << ", average cmps " << H.avg_cmps << " vs. " << E.avg_cmps
+                    << ", redundant cmps per query = " << ((long) H.avg_cmps - (long) E.avg_cmps)
+                    << std::endl;
+        }
+        std::cout << std::endl;
+      }
     }
   }
 }
 
+template<typename PointRange, typename QPointRange, typename QQPointRange, typename indexType>
+void search_and_parse(Graph_ G_,
+                      Graph<indexType> &G,
+                      PointRange &Base_Points,
+                      PointRange &Query_Points,
+                      QPointRange &Q_Base_Points,
+                      QPointRange &Q_Query_Points,
+                      QQPointRange &QQ_Base_Points,
+                      QQPointRange &QQ_Query_Points,
+                      groundTruth<indexType> GT, char* res_file, long k,
+                      bool random = true,
+                      indexType start_point = 0,
+                      bool verbose = false,
+                      long fixed_beam_width = 0,
+                      int rerank_factor = 100,
+                      bool exact_visited = false,
+                      double time_limit = 0.0,
+                      long dist_budget = 0) {
+  // every query of the sweep gets the same time and distance budget
+  auto check = [&] (const long k, QueryParams QP) {
+    QP.time_limit = time_limit;
+    QP.dist_budget = dist_budget;
+    return checkRecall(G,
+                       Base_Points, Query_Points,
+                       Q_Base_Points, Q_Query_Points,
+                       QQ_Base_Points, QQ_Query_Points,
+                       GT,
+                       random,
+                       start_point, k, QP, verbose);};
+  sweep_and_parse(G_, check, (long) G.size(), (long) G.max_degree(), res_file, k,
+                  fixed_beam_width, rerank_factor, exact_visited);
+}
+
+// recall of label filtered search; the ground truth is expected to be
+// computed over the base points that pass each query's filter
+template<typename PointRange, typename Labels, typename indexType>
+nn_result checkLabelRecall(const Graph<indexType> &G,
+                           const PointRange &Base_Points,
+                           const PointRange &Query_Points,
+                           const Labels &Base_Labels,
+                           const Labels &Query_Labels,
+                           const groundTruth<indexType> &GT,
+                           const long start_point,
+                           const long k,
+                           const QueryParams &QP,
+                           const bool verbose) {
+  if (GT.size() > 0 && k > GT.dimension()) {
+    std::cout << k << "@" << k << " too large for ground truth data of size "
+              << GT.dimension() << std::endl;
+    abort();
+  }
+
+  parlay::internal::timer t;
+  stats<indexType> QueryStats(Query_Points.size());
+  QueryStats.clear();
+  auto volatile xx = parlay::random_permutation<long>(5000000);
+  t.next_time();
+  auto all_ngh = labelSearchAll(Query_Points, Query_Labels, G,
+                                Base_Points, Base_Labels,
+                                QueryStats, (indexType) start_point, QP);
+  float query_time = t.next_time();
+
+  // ground truth rows may be padded (with ids out of range) when fewer
+  // than k base points pass the filter
+  float recall = 0.0;
+  if (GT.size() > 0) {
+    size_t n = Query_Points.size();
+    auto correct = parlay::tabulate(n, [&] (size_t i) {
+      std::set<indexType> reported_nbhs(all_ngh[i].begin(), all_ngh[i].end());
+      long c = 0, total = 0;
+      for (long l = 0; l < k; l++) {
+        indexType g = GT.coordinates(i, l);
+        if (g >= Base_Points.size()) break;
+        total++;
+        if (reported_nbhs.count(g) > 0) c++;
+      }
+      return std::pair<long, long>(c, total);});
+    long numCorrect = parlay::reduce(parlay::map(correct, [] (auto x) {return x.first;}));
+    long numTotal = parlay::reduce(parlay::map(correct, [] (auto x) {return x.second;}));
+    recall = (numTotal == 0) ? 1.0 : static_cast<float>(numCorrect) / static_cast<float>(numTotal);
+  }
+  float QPS = Query_Points.size() / query_time;
+  size_t num_truncated = QueryStats.num_truncated();
+  if (num_truncated > 0)
+    std::cout << num_truncated << " of " << Query_Points.size()
+              << " queries ran out of time or distance budget" << std::endl;
+  if (verbose)
+    std::cout << "filtered search: Q=" << QP.beamSize << ", k=" << QP.k
+              << ", recall=" << recall
+              << ", visited=" << QueryStats.visited_stats()[0]
+              << ", comparisons=" << QueryStats.dist_stats()[0]
+              << ", QPS=" << QPS << std::endl;
+
+  auto stats_ = {QueryStats.dist_stats(), QueryStats.visited_stats()};
+  parlay::sequence<indexType> stats = parlay::flatten(stats_);
+  nn_result N(recall, stats, QPS, k, QP.beamSize, QP.cut, Query_Points.size(), QP.limit, QP.degree_limit, k);
+  return N;
+}
+
+// sweeps the beam width for label filtered search
+template<typename PointRange, typename Labels, typename indexType>
+void label_search_and_parse(Graph<indexType> &G,
+                            PointRange &Base_Points,
+                            PointRange &Query_Points,
+                            Labels &Base_Labels,
+                            Labels &Query_Labels,
+                            groundTruth<indexType> GT, long k,
+                            indexType start_point = 0,
+                            bool verbose = false,
+                            double time_limit = 0.0,
+                            long dist_budget = 0) {
+  parlay::sequence<nn_result> results;
+  if (k == 0) k = 10;
+  std::vector<long> beams = {10, 15, 20, 30, 40, 50, 75, 100, 150, 200,
+    300, 500, 750, 1000};
+  QueryParams QP(k, k, 1.35, (long) G.size(), (long) G.max_degree());
+  QP.time_limit = time_limit;
+  QP.dist_budget = dist_budget;
+  for (long Q : beams) {
+    if (Q < k) continue;
+    QP.beamSize = Q;
+    results.push_back(checkLabelRecall(G, Base_Points, Query_Points,
+                                       Base_Labels, Query_Labels,
+                                       GT, start_point, k, QP, verbose));
+  }
+  parlay::sequence<float> buckets =  {.1, .2, .3,  .4,  .5,  .6, .7, .75,  .8, .85,
+    .9, .93, .95, .97, .98, .99, .995, .999, .9995,
+    .9999, .99995, .99999};
+  std::cout << "Label filtered search:" << std::endl;
+  parse_result(results, buckets);
+  std::cout << std::endl;
+}
+
+// Has the build telemetry report the recall@k of the first num_queries
+// queries, searched with beam width Q from start on the graph as it is
+// being built, against the ground truth of the full set.  G, Points and
+// Query_Points must outlive the build; call clear_telemetry_recall after
+// it.
+template<typename PointRange, typename indexType>
+void set_telemetry_recall(const Graph<indexType> &G, const PointRange &Points,
+                          const PointRange &Query_Points, groundTruth<indexType> GT,
+                          indexType start, long num_queries = 100, long k = 10, long Q = 64) {
+  build_telemetry &telemetry = build_telemetry::get();
+  if (!telemetry.enabled() || Query_Points.size() == 0 || GT.size() == 0) return;
+  num_queries = std::min<long>(num_queries, Query_Points.size());
+  k = std::min<long>(k, GT.dimension());
+  telemetry.set_recall([&G, &Points, &Query_Points, GT, start, num_queries, k, Q] () {
+    QueryParams QP(k, std::max(k, Q), 1.35, (long) G.size(), G.max_degree());
+    auto hits = parlay::tabulate(num_queries, [&] (long i) {
+      auto [pairElts, dist_cmps] = beam_search(Query_Points[i], G, Points, start, QP);
+      auto &beam = pairElts.first;
+      std::set<indexType> reported;
+      for (long j = 0; j < std::min<long>(k, beam.size()); j++) reported.insert(beam[j].first);
+      long cnt = 0;
+      for (long j = 0; j < k; j++) cnt += reported.count(GT.coordinates(i, j));
+      return cnt;
+    });
+    return parlay::reduce(hits) / (double) (num_queries * k);
+  });
+}
+
+inline void clear_telemetry_recall() {
+  build_telemetry::get().set_recall(nullptr);
+}
+
 // template<typename Point, typename PointRange, typename indexType>
 // void search_and_parse(Graph_ G_,
 //                       Graph<indexType> &G,
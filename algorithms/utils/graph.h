@@ -23,6 +23,7 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <fcntl.h>
 #include <iostream>
 #include <sys/mman.h>
@@ -47,8 +48,9 @@ struct edgeRange{
 
   edgeRange() : edges(parlay::make_slice<indexType*, indexType*>(nullptr, nullptr)) {}
 
-  edgeRange(indexType* start, indexType* end, indexType id)
-    : edges(parlay::make_slice<indexType*, indexType*>(start,end)), id_(id) {
+  edgeRange(indexType* start, indexType* end, indexType id,
+            std::atomic<uint32_t>* version = nullptr)
+    : edges(parlay::make_slice<indexType*, indexType*>(start,end)), id_(id), version(version) {
     maxDeg = edges.size() - 1;
   }
 
@@ -65,8 +67,10 @@ struct edgeRange{
                 << maxDeg << std::endl;
       abort();
     } else {
+      begin_write();
       edges[edges[0]+1] = nbh;
       edges[0] += 1;
+      end_write();
     }
   }
 
@@ -77,10 +81,12 @@ struct edgeRange{
                 << maxDeg << std::endl;
       abort();
     }
+    begin_write();
     edges[0] = r.size();
     for (int i = 0; i < r.size(); i++) {
       edges[i+1] = r[i];
     }
+    end_write();
   }
 
   template<typename rangeType>
@@ -92,14 +98,31 @@ struct edgeRange{
       std::cout << r.size() << std::endl;
       abort();
     }
+    begin_write();
     for (int i = 0; i < r.size(); i++) {
       edges[edges[0] + i + 1] = r[i];
     }
     edges[0] += r.size();
+    end_write();
+  }
+
+  // Adds k neighbors that have already been written past the end of the
+  // list (into the slots begin()[size()], ..., begin()[size()+k-1]).
+  void commit_appended(long k){
+    if (edges[0] + k > maxDeg) {
+      std::cout << "ERROR in commit_appended for point " << id_
+                << ": cannot exceed max degree " << maxDeg << std::endl;
+      abort();
+    }
+    begin_write();
+    edges[0] += k;
+    end_write();
   }
 
   void clear_neighbors(){
+    begin_write();
     edges[0] = 0;
+    end_write();
   }
 
   void prefetch() const {
@@ -110,7 +133,26 @@ struct edgeRange{
 
   template<typename F>
   void sort(F&& less){
-    std::sort(edges.begin() + 1, edges.begin() + 1 + edges[0], less);}
+    begin_write();
+    std::sort(edges.begin() + 1, edges.begin() + 1 + edges[0], less);
+    end_write();
+  }
+
+  // Copies the neighbors into buffer (which must have room for the max
+  // degree) and returns how many there are.  If the graph is versioned
+  // the copy is taken under the vertex's seqlock, so it is a consistent
+  // snapshot even while a writer is updating the list.
+  long copy_neighbors(indexType* buffer) const {
+    while (true) {
+      uint32_t v = (version == nullptr) ? 0 : version->load(std::memory_order_acquire);
+      if (v & 1) continue;  // writer in progress
+      long d = std::min<long>(edges[0], maxDeg);
+      for (long i = 0; i < d; i++) buffer[i] = edges[i+1];
+      if (version == nullptr) return d;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (version->load(std::memory_order_relaxed) == v) return d;
+    }
+  }
 
   indexType* begin() const {return edges.begin() + 1;}
 
@@ -120,6 +162,18 @@ private:
   parlay::slice<indexType*, indexType*> edges;
   long maxDeg;
   indexType id_;
+  std::atomic<uint32_t>* version = nullptr;
+
+  // seqlock: the version is odd while the list is being written
+  void begin_write() {
+    if (version == nullptr) return;
+    version->fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void end_write() {
+    if (version != nullptr) version->fetch_add(1, std::memory_order_release);
+  }
 };
 
 template<typename indexType_>
@@ -128,23 +182,112 @@ struct Graph{
   
   long max_degree() const {return maxDeg;}
   size_t size() const {return n;}
+  size_t capacity() const {return cap;}
 
   Graph(){}
 
   void allocate_graph(long maxDeg, size_t n) {
     long cnt = n * (maxDeg + 1);
-    long num_bytes = cnt * sizeof(indexType);
+    long num_bytes = std::max<long>(cnt * sizeof(indexType), 1);
     indexType* ptr = (indexType*) aligned_alloc(1l << 21, num_bytes);
     madvise(ptr, num_bytes, MADV_HUGEPAGE);
     parlay::parallel_for(0, cnt, [&] (long i) {ptr[i] = 0;});
     graph = std::shared_ptr<indexType[]>(ptr, std::free);
+    cap = n;
   }
 
   Graph(long maxDeg, size_t n) : maxDeg(maxDeg), n(n) {
     allocate_graph(maxDeg, n);
   }
 
-  Graph(char* gFile){
+  // A graph over existing storage with maxDeg + 1 slots per vertex,
+  // e.g. part of a mapped file, which storage keeps alive.  If the
+  // storage is read-only the adjacency lists must not be updated.
+  Graph(long maxDeg, size_t n, std::shared_ptr<indexType[]> storage)
+    : n(n), cap(n), maxDeg(maxDeg), graph(std::move(storage)) {}
+
+  // Grows the storage to hold new_cap vertices, keeping the existing
+  // edges.  Not safe to call concurrently with readers, since the
+  // adjacency lists move.
+  void reserve(size_t new_cap) {
+    if (new_cap <= cap) return;
+    if (compacted()) {
+      std::cout << "Error: cannot grow a compacted graph" << std::endl;
+      abort();
+    }
+    std::shared_ptr<indexType[]> old = graph;
+    auto old_versions = versions;
+    allocate_graph(maxDeg, new_cap);
+    indexType* gr = graph.get();
+    indexType* og = old.get();
+    parlay::parallel_for(0, n * (maxDeg + 1), [&] (long i) {gr[i] = og[i];});
+    if (old_versions != nullptr) {
+      enable_versions();
+      parlay::parallel_for(0, n, [&] (long i) {
+        versions[i] = old_versions[i].load();});
+    }
+  }
+
+  // Sets the number of vertices, growing the capacity geometrically if
+  // needed.  New vertices have no edges.
+  void resize(size_t new_n) {
+    if (new_n > cap) reserve(std::max(new_n, 2 * cap));
+    n = new_n;
+  }
+
+  // Adds a seqlock version to each vertex so that readers using
+  // copy_neighbors see consistent adjacency lists while the graph is
+  // updated concurrently (see vamana/dynamic_index.h).
+  void enable_versions() {
+    auto v = std::shared_ptr<std::atomic<uint32_t>[]>(new std::atomic<uint32_t>[cap]);
+    parlay::parallel_for(0, cap, [&] (long i) {v[i] = 0;});
+    versions = v;
+  }
+
+  bool versioned() const {return versions != nullptr;}
+
+  // Moves the edges into variable-degree (CSR) storage, where each
+  // vertex takes one slot for its degree plus one per edge, instead of
+  // max_degree() + 1 slots.  Meant for graphs whose build is finished
+  // (e.g. HCNNG, where max_degree() is num_clusters * MST_deg but most
+  // vertices have far fewer edges): the adjacency lists can still be
+  // read, sorted or shrunk, but not extended, and max_degree() becomes
+  // the largest actual degree.  Not safe to call concurrently with
+  // readers.
+  void compact() {
+    if (compacted()) return;
+    auto degrees = parlay::tabulate(n, [&] (size_t i) {
+      return (size_t) (*this)[i].size() + 1;});
+    long new_maxDeg = n == 0 ? 0 : (long) parlay::reduce(degrees, parlay::maxm<size_t>()) - 1;
+    auto [o, total] = parlay::scan(degrees);
+    auto off = std::shared_ptr<size_t[]>(new size_t[n + 1]);
+    parlay::parallel_for(0, n, [&] (size_t i) {off[i] = o[i];});
+    off[n] = total;
+    indexType* ptr = (indexType*) malloc(std::max<size_t>(total * sizeof(indexType), 1));
+    parlay::parallel_for(0, n, [&] (size_t i) {
+      auto e = (*this)[i];
+      ptr[off[i]] = e.size();
+      for (size_t j = 0; j < e.size(); j++) ptr[off[i] + 1 + j] = e[j];
+    });
+    std::cout << "Compacted graph from " << memory_bytes() / 1e6 << " MB to "
+              << total * sizeof(indexType) / 1e6 << " MB" << std::endl;
+    graph = std::shared_ptr<indexType[]>(ptr, std::free);
+    offsets = off;
+    maxDeg = new_maxDeg;
+    cap = n;
+  }
+
+  bool compacted() const {return offsets != nullptr;}
+
+  // bytes used by the adjacency lists
+  size_t memory_bytes() const {
+    size_t slots = compacted() ? offsets[n] : cap * (maxDeg + 1);
+    return slots * sizeof(indexType);
+  }
+
+  // If compact is set the graph is read directly into variable-degree
+  // storage (see compact()).
+  Graph(char* gFile, bool compact = false){
     std::ifstream reader(gFile);
     if (!reader.is_open()) {
       std::cout << "graph file " << gFile << " not found" << std::endl;
@@ -170,11 +313,19 @@ struct Graph{
     auto degrees = parlay::tabulate(degrees0.size(), [&] (size_t i){
       return static_cast<size_t>(degrees0[i]);});
     auto [o, total] = parlay::scan(degrees);
-    auto offsets = o;
+    auto edge_offsets = o;
     std::cout << "Total edges read from file: " << total << std::endl;
-    offsets.push_back(total);
-
-    allocate_graph(max_deg, n);
+    edge_offsets.push_back(total);
+    // the start of vertex i's degree slot, in the compact layout
+    auto offsets_of = [&] (size_t i) {return edge_offsets[i] + i;};
+
+    if (compact) {
+      offsets = std::shared_ptr<size_t[]>(new size_t[n + 1]);
+      parlay::parallel_for(0, n + 1, [&] (size_t i) {offsets[i] = offsets_of(i);});
+      graph = std::shared_ptr<indexType[]>(
+        (indexType*) malloc(std::max<size_t>((total + n) * sizeof(indexType), 1)), std::free);
+      cap = n;
+    } else allocate_graph(max_deg, n);
 
     //write 1000000 vertices at a time
     size_t BLOCK_SIZE = 1000000;
@@ -183,7 +334,7 @@ struct Graph{
     while(index < n){
       size_t g_floor = index;
       size_t g_ceiling = g_floor + BLOCK_SIZE <= n ? g_floor + BLOCK_SIZE : n;
-      size_t total_size_to_read = offsets[g_ceiling] - offsets[g_floor];
+      size_t total_size_to_read = edge_offsets[g_ceiling] - edge_offsets[g_floor];
       indexType* edges_start = new indexType[total_size_to_read];
       reader.read((char*) (edges_start), sizeof(indexType) * total_size_to_read);
       indexType* edges_end = edges_start + total_size_to_read;
@@ -191,9 +342,10 @@ struct Graph{
         parlay::make_slice(edges_start, edges_end);
       indexType* gr = graph.get();
       parlay::parallel_for(g_floor, g_ceiling, [&] (size_t i){
-        gr[i * (maxDeg + 1)] = degrees[i];
+        size_t start = compact ? offsets_of(i) : i * (maxDeg + 1);
+        gr[start] = degrees[i];
         for(size_t j = 0; j < degrees[i]; j++){
-          gr[i * (maxDeg + 1) + 1 + j] = edges[offsets[i] - total_size_read + j];
+          gr[start + 1 + j] = edges[edge_offsets[i] - total_size_read + j];
         }
       });
       total_size_read += total_size_to_read;
@@ -236,17 +388,24 @@ struct Graph{
       std::cout << "ERROR: graph index out of range: " << i << std::endl;
       abort();
     }
-    return edgeRange<indexType>(graph.get() + i * (maxDeg + 1),
-                                graph.get() + (i + 1) * (maxDeg + 1),
-                                i);
+    size_t start = compacted() ? offsets[i] : i * (maxDeg + 1);
+    size_t end = compacted() ? offsets[i + 1] : (i + 1) * (maxDeg + 1);
+    return edgeRange<indexType>(graph.get() + start,
+                                graph.get() + end,
+                                i,
+                                versions == nullptr ? nullptr : versions.get() + i);
   }
 
   ~Graph(){}
 
 private:
   size_t n;
+  size_t cap = 0;
   long maxDeg;
   std::shared_ptr<indexType[]> graph;
+  // the start of each vertex's list, if the graph is compacted
+  std::shared_ptr<size_t[]> offsets;
+  std::shared_ptr<std::atomic<uint32_t>[]> versions;
 };
 
 } // end namespace
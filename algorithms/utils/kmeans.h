@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "parlay/random.h"
+
+namespace parlayANN {
+
+// k-means clustering for partitioning points, e.g. into the shards of
+// a partitioned build.  The centroids are float vectors and distances to
+// them are squared Euclidean distances, so the points need element
+// access (Euclidian_Point and Mips_Point, including the integer types).
+template<typename PointRange>
+struct kmeans {
+  using Point = typename PointRange::Point;
+
+  kmeans(long k, long dims) : k(k), dims(dims), centroids(k * dims, 0.0) {}
+
+  long num_clusters() const {return k;}
+
+  const float* centroid(long c) const {return centroids.begin() + c * dims;}
+
+  // Lloyd's algorithm on a random sample of at most sample_size points,
+  // starting from k distinct random sample points.
+  void fit(const PointRange &Points, long sample_size, int iters) {
+    long n = Points.size();
+    long m = std::min(n, std::max(sample_size, k));
+    auto sample = parlay::random_permutation<long>(n);
+    sample.resize(m);
+    parlay::parallel_for(0, std::min(k, m), [&] (long c) {
+      set_centroid(c, Points[sample[c]]);});
+
+    for (int it = 0; it < iters; it++) {
+      auto assign = parlay::tabulate(m, [&] (long i) {
+        return std::pair((long) nearest(Points[sample[i]], 1)[0].first, i);});
+      auto groups = parlay::group_by_key(assign);
+      parlay::parallel_for(0, groups.size(), [&] (long g) {
+        auto &[c, members] = groups[g];
+        std::vector<double> sum(dims, 0.0);
+        for (long i : members) {
+          auto p = Points[sample[i]];
+          for (long j = 0; j < dims; j++) sum[j] += p[j];
+        }
+        for (long j = 0; j < dims; j++)
+          centroids[c * dims + j] = sum[j] / members.size();
+      });
+      // centroids that lost all their points are moved to a random point
+      auto empty = parlay::sequence<bool>(k, true);
+      for (auto &g : groups) empty[g.first] = false;
+      parlay::random_generator gen(it);
+      std::uniform_int_distribution<long> dis(0, m - 1);
+      parlay::parallel_for(0, k, [&] (long c) {
+        if (empty[c]) {
+          auto r = gen[c];
+          set_centroid(c, Points[sample[dis(r)]]);
+        }
+      });
+    }
+  }
+
+  // the (centroid, squared distance) pairs of the r centroids closest
+  // to p, closest first
+  std::vector<std::pair<long, float>> nearest(const Point &p, long r) const {
+    std::vector<std::pair<long, float>> best;
+    best.reserve(k);
+    for (long c = 0; c < k; c++) {
+      const float* x = centroid(c);
+      float d = 0;
+      for (long j = 0; j < dims; j++) {
+        float diff = x[j] - (float) p[j];
+        d += diff * diff;
+      }
+      best.push_back(std::pair(c, d));
+    }
+    r = std::min(r, k);
+    std::partial_sort(best.begin(), best.begin() + r, best.end(),
+                      [] (auto a, auto b) {return a.second < b.second;});
+    best.resize(r);
+    return best;
+  }
+
+private:
+  long k;
+  long dims;
+  parlay::sequence<float> centroids;
+
+  void set_centroid(long c, const Point &p) {
+    for (long j = 0; j < dims; j++) centroids[c * dims + j] = p[j];
+  }
+};
+
+} // end namespace
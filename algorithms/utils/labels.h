@@ -0,0 +1,123 @@
+#ifndef ALGORITHMS_ANN_LABELS_H_
+#define ALGORITHMS_ANN_LABELS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+
+namespace parlayANN {
+
+// Per-point integer labels (attributes), stored columnar as a CSR
+// structure: the labels of point i are labels[offsets[i]:offsets[i+1]],
+// sorted.  Kept separate from the PointRange so that points without
+// labels pay nothing.
+template<typename indexType = unsigned int, typename labelType = unsigned int>
+struct PointLabels {
+  parlay::sequence<size_t> offsets;
+  parlay::sequence<labelType> labels;
+
+  PointLabels() : offsets(1, 0), num_labels_(0) {}
+
+  PointLabels(const parlay::sequence<parlay::sequence<labelType>> &L) {
+    auto [offs, total] = parlay::scan(parlay::map(L, [] (auto &l) {return l.size();}));
+    offsets = std::move(offs);
+    offsets.push_back(total);
+    labels = parlay::flatten(L);
+    finish();
+  }
+
+  // Reads labels in the sparse matrix format used by the big-ann
+  // filtered track (.spmat): int64 nrow, ncol, nnz, then int64
+  // indptr[nrow+1], int32 indices[nnz], float data[nnz] (data is ignored).
+  PointLabels(char* filename) : offsets(1, 0), num_labels_(0) {
+    if (filename == NULL) return;
+    std::ifstream reader(filename, std::ios::binary);
+    if (!reader.is_open()) {
+      std::cout << "Label file " << filename << " not found" << std::endl;
+      abort();
+    }
+    int64_t nrow, ncol, nnz;
+    reader.read((char*)&nrow, sizeof(int64_t));
+    reader.read((char*)&ncol, sizeof(int64_t));
+    reader.read((char*)&nnz, sizeof(int64_t));
+    std::cout << "Labels: detected " << nrow << " points with " << ncol
+              << " labels and " << nnz << " entries" << std::endl;
+    parlay::sequence<int64_t> indptr(nrow + 1);
+    reader.read((char*)indptr.begin(), (nrow + 1) * sizeof(int64_t));
+    parlay::sequence<int32_t> indices(nnz);
+    reader.read((char*)indices.begin(), nnz * sizeof(int32_t));
+    offsets = parlay::map(indptr, [] (int64_t x) {return (size_t) x;});
+    labels = parlay::map(indices, [] (int32_t x) {return (labelType) x;});
+    finish();
+  }
+
+  size_t size() const {return offsets.size() - 1;}
+
+  // one more than the largest label used
+  size_t num_labels() const {return num_labels_;}
+
+  auto operator [] (long i) const {
+    return parlay::make_slice(labels.begin() + offsets[i],
+                              labels.begin() + offsets[i + 1]);
+  }
+
+  bool has_label(indexType i, labelType l) const {
+    auto L = (*this)[i];
+    return std::binary_search(L.begin(), L.end(), l);
+  }
+
+  // true if point i carries every label in ql (conjunctive filter)
+  template<typename Labels>
+  bool matches(indexType i, const Labels &ql) const {
+    for (auto l : ql)
+      if (!has_label(i, l)) return false;
+    return true;
+  }
+
+  // number of points carrying label l
+  size_t count(labelType l) const {
+    return (l < num_labels_) ? counts[l] : 0;
+  }
+
+  // a point carrying label l, used to seed filtered searches so they
+  // start within the filtered subset
+  indexType entry_point(labelType l) const {
+    return (l < num_labels_) ? entry_points[l] : std::numeric_limits<indexType>::max();
+  }
+
+private:
+  size_t num_labels_;
+  parlay::sequence<size_t> counts;
+  parlay::sequence<indexType> entry_points;
+
+  void finish() {
+    parlay::parallel_for(0, size(), [&] (long i) {
+      std::sort(labels.begin() + offsets[i], labels.begin() + offsets[i + 1]);});
+    num_labels_ = (labels.size() == 0) ? 0 : (size_t) parlay::reduce(labels, parlay::maxm<labelType>()) + 1;
+
+    // count points per label and take the lowest numbered point of each
+    // label as its entry point
+    parlay::sequence<std::atomic<size_t>> cnts(num_labels_);
+    parlay::sequence<std::atomic<indexType>> entries(num_labels_);
+    parlay::parallel_for(0, num_labels_, [&] (long l) {
+      cnts[l] = 0;
+      entries[l] = std::numeric_limits<indexType>::max();});
+    parlay::parallel_for(0, size(), [&] (long i) {
+      for (auto l : (*this)[i]) {
+        cnts[l]++;
+        indexType old = entries[l].load();
+        while ((indexType) i < old && !entries[l].compare_exchange_weak(old, (indexType) i));
+      }});
+    counts = parlay::tabulate(num_labels_, [&] (long l) {return cnts[l].load();});
+    entry_points = parlay::tabulate(num_labels_, [&] (long l) {return entries[l].load();});
+  }
+};
+
+} // end namespace
+
+#endif // ALGORITHMS_ANN_LABELS_H_
@@ -131,6 +131,56 @@ struct PointRange{
   byte* location(long i) const {
     return values.get() + i * aligned_bytes;
   }
+
+  size_t capacity() const { return cap == 0 ? n : cap; }
+
+  // Grows the storage to hold new_cap points, keeping the existing ones.
+  // Not safe to call concurrently with readers, since the points move.
+  void reserve(size_t new_cap) {
+    if (new_cap <= capacity()) return;
+    long total_bytes = new_cap * aligned_bytes;
+    byte* ptr = (byte*) aligned_alloc(1l << 21, total_bytes);
+    madvise(ptr, total_bytes, MADV_HUGEPAGE);
+    if (n > 0) std::memcpy(ptr, values.get(), n * aligned_bytes);
+    values = std::shared_ptr<byte[]>(ptr, std::free);
+    cap = new_cap;
+  }
+
+  // Overwrites point i with p (translated with the existing parameters),
+  // e.g. to reuse the slot of a deleted point.
+  template <typename P>
+  void set_point(long i, const P& p) {
+    Point::translate_point(location(i), p, params);
+  }
+
+  // Appends the points of pr (translated with the existing parameters),
+  // growing the capacity geometrically if needed.
+  template <typename PR>
+  void append(const PR& pr) {
+    size_t m = pr.size();
+    if (n + m > capacity()) reserve(std::max(n + m, 2 * capacity()));
+    byte* vptr = values.get();
+    parlay::parallel_for(0, m, [&] (long i) {
+      Point::translate_point(vptr + (n + i) * aligned_bytes, pr[i], params);});
+    n += m;
+  }
+
+  // A new range holding copies of the points with the given ids, in
+  // that order, with the same parameters (no translation).
+  template <typename Seq>
+  PointRange subset(const Seq& ids) const {
+    PointRange sub;
+    sub.params = params;
+    sub.aligned_bytes = aligned_bytes;
+    sub.n = ids.size();
+    long total_bytes = std::max<long>(sub.n * aligned_bytes, 1);
+    byte* ptr = (byte*) aligned_alloc(1l << 21, total_bytes);
+    madvise(ptr, total_bytes, MADV_HUGEPAGE);
+    sub.values = std::shared_ptr<byte[]>(ptr, std::free);
+    parlay::parallel_for(0, sub.n, [&] (long i) {
+      std::memcpy(sub.location(i), location(ids[i]), aligned_bytes);});
+    return sub;
+  }
   
   parameters params;
 
@@ -138,6 +188,7 @@ private:
   std::shared_ptr<byte[]> values;
   long aligned_bytes;
   size_t n;
+  size_t cap = 0;
 };
 
 } // end namespace
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "euclidian_point.h"
+#include "mips_point.h"
+
+namespace parlayANN {
+
+// Scratch space for the prune: the candidate vectors are gathered into
+// a contiguous tile of rows (each padded to a multiple of 64 bytes) so
+// the inner loop streams through memory instead of chasing point ids.
+struct prune_tile {
+  using byte = uint8_t;
+
+  byte* row(long i) const {return data.get() + i * stride;}
+
+  void reserve(long rows, long row_bytes) {
+    stride = 64 * ((std::max<long>(row_bytes, 1) - 1) / 64 + 1);
+    if (rows * stride <= capacity) return;
+    capacity = std::max(rows * stride, 2 * capacity);
+    data = std::unique_ptr<byte[], decltype(&std::free)>(
+      (byte*) aligned_alloc(64, capacity), std::free);
+  }
+
+private:
+  std::unique_ptr<byte[], decltype(&std::free)> data{nullptr, std::free};
+  long capacity = 0;
+  long stride = 0;
+};
+
+// Distances from row a of the tile to the rows in idx[0..cnt), for
+// cnt <= 4.  For float Euclidean and MIPS points this is a blocked
+// kernel: each element of a is loaded once for all rows and each row is
+// accumulated in 8 independent lanes, which the compiler vectorizes.
+// Other point types fall back to Point::distance on the tile rows.
+template<typename Point, typename distanceType = typename Point::distanceType>
+void tile_distances(const prune_tile &tile, long a, const long* idx, int cnt,
+                    const typename Point::parameters &params, distanceType* out) {
+  constexpr bool euclidean = std::is_same_v<Point, Euclidian_Point<float>>;
+  constexpr bool mips = std::is_same_v<Point, Mips_Point<float>>;
+  if constexpr (euclidean || mips) {
+    constexpr int lanes = 8;
+    long d = params.dims;
+    const float* x = (const float*) tile.row(a);
+    const float* y[4];
+    float acc[4][lanes] = {};
+    for (int r = 0; r < cnt; r++) y[r] = (const float*) tile.row(idx[r]);
+    long j = 0;
+    for (; j + lanes <= d; j += lanes)
+      for (int r = 0; r < cnt; r++)
+        for (int l = 0; l < lanes; l++) {
+          if constexpr (euclidean) {
+            float diff = y[r][j + l] - x[j + l];
+            acc[r][l] += diff * diff;
+          } else acc[r][l] += y[r][j + l] * x[j + l];
+        }
+    for (int r = 0; r < cnt; r++) {
+      float sum = 0;
+      for (int l = 0; l < lanes; l++) sum += acc[r][l];
+      for (long k = j; k < d; k++) {
+        if constexpr (euclidean) sum += (y[r][k] - x[k]) * (y[r][k] - x[k]);
+        else sum += y[r][k] * x[k];
+      }
+      out[r] = euclidean ? sum : -sum;
+    }
+  } else {
+    Point pa(tile.row(a), -1, params);
+    for (int r = 0; r < cnt; r++)
+      out[r] = pa.distance(Point(tile.row(idx[r]), -1, params));
+  }
+}
+
+// robustPrune as in the DiskANN paper, shared by the Vamana, range
+// Vamana and HCNNG builds.  The candidates are (id, distance to p)
+// pairs, and are sorted and deduplicated here.  Candidates are selected
+// in order of distance to p, and each selected p_star prunes every
+// remaining candidate p_prime with alpha * d(p_star, p_prime) <=
+// d(p, p_prime).  Those distances are computed on the gathered tile in
+// blocks of four live candidates, skipping ones already pruned.
+// Returns the new neighbors (at most degree) and the number of
+// distance comparisons.
+template<typename PointRange, typename indexType, typename distanceType>
+std::pair<parlay::sequence<indexType>, long>
+blocked_robust_prune(indexType p,
+                     std::vector<std::pair<indexType, distanceType>> &candidates,
+                     const PointRange &Points, double alpha, size_t degree) {
+  using Point = typename PointRange::Point;
+  using pid = std::pair<indexType, distanceType>;
+
+  auto less = [&] (pid a, pid b) {
+    return a.second < b.second || (a.second == b.second && a.first < b.first);
+  };
+  std::sort(candidates.begin(), candidates.end(), less);
+  candidates.erase(std::unique(candidates.begin(), candidates.end(),
+                               [&] (pid x, pid y) {return x.first == y.first;}),
+                   candidates.end());
+  long m = candidates.size();
+
+  static thread_local prune_tile tile;
+  static thread_local std::vector<char> pruned;
+  int num_bytes = Points.params.num_bytes();
+  tile.reserve(m, num_bytes);
+  for (long i = 0; i < m; i++)
+    std::memcpy(tile.row(i), Points.location(candidates[i].first), num_bytes);
+  pruned.assign(m, 0);
+
+  std::vector<indexType> new_nbhs;
+  new_nbhs.reserve(degree);
+  long distance_comps = 0;
+  long idx[4];
+  distanceType dists[4];
+
+  for (long s = 0; s < m && new_nbhs.size() < degree; s++) {
+    if (pruned[s] || candidates[s].first == p) continue;
+    new_nbhs.push_back(candidates[s].first);
+    if (new_nbhs.size() == degree) break;
+    long i = s + 1;
+    while (i < m) {
+      int cnt = 0;
+      for (; i < m && cnt < 4; i++)
+        if (!pruned[i]) idx[cnt++] = i;
+      if (cnt == 0) break;
+      tile_distances<Point>(tile, s, idx, cnt, Points.params, dists);
+      distance_comps += cnt;
+      for (int r = 0; r < cnt; r++)
+        if (alpha * dists[r] <= candidates[idx[r]].second) pruned[idx[r]] = 1;
+    }
+  }
+  return std::pair(parlay::to_sequence(new_nbhs), distance_comps);
+}
+
+} // end namespace
@@ -0,0 +1,133 @@
+#ifndef ALGORITHMS_ANN_QUERY_CACHE_H_
+#define ALGORITHMS_ANN_QUERY_CACHE_H_
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "parlay/utilities.h"
+
+namespace parlayANN {
+
+// key for a query from the exact values of its coordinates
+template<typename Point>
+uint64_t exact_query_key(const Point &q, long dims) {
+  uint64_t h = dims;
+  for (long j = 0; j < dims; j++) {
+    auto x = q[j];
+    uint64_t bits = 0;
+    std::memcpy(&bits, &x, sizeof(x));
+    h = parlay::hash64_2(h ^ bits);
+  }
+  return h;
+}
+
+// key for a query from a quantized signature of it, e.g. with
+// SigPoint = Euclidean_Bit_Point or Mips_Bit_Point.  Queries that are
+// near duplicates usually share a signature, and hence a key.
+template<typename SigPoint, typename Point>
+uint64_t signature_query_key(const Point &q, const typename SigPoint::parameters &params) {
+  int num_bytes = params.num_bytes();
+  std::vector<uint64_t> buffer((num_bytes + 7) / 8, 0);
+  SigPoint::translate_point((uint8_t*) buffer.data(), q, params);
+  uint64_t h = num_bytes;
+  for (auto w : buffer) h = parlay::hash64_2(h ^ w);
+  return h;
+}
+
+// A concurrent cache of search results, direct mapped on the query key
+// with a lock per slot.  Entries record the index generation they were
+// computed under, and invalidate() bumps the generation so that entries
+// from before an update to the index are never returned.  An entry is
+// only used for a search with the same mode, a caller defined value for
+// the remaining search settings (e.g. a hash of the quantization and of
+// the visit and degree limits), and the same or smaller k and beam width.
+template<typename indexType, typename distanceType = float>
+struct QueryCache {
+  using id_dist = std::pair<indexType, distanceType>;
+
+  QueryCache(size_t capacity)
+    : capacity(std::max<size_t>(capacity, 1)),
+      slots(new slot[std::max<size_t>(capacity, 1)]),
+      generation(1), hits(0), misses(0), hit_nanos(0), miss_nanos(0) {}
+
+  std::optional<parlay::sequence<id_dist>> find(uint64_t key, uint64_t mode,
+                                                long k, long beamSize) {
+    slot &s = slots[key % capacity];
+    std::lock_guard<std::mutex> lock(s.mtx);
+    if (s.generation == generation.load() && s.key == key && s.mode == mode &&
+        k <= s.k && beamSize <= s.beamSize)
+      return parlay::to_sequence(s.results.head(std::min<long>(k, s.results.size())));
+    return std::nullopt;
+  }
+
+  void insert(uint64_t key, uint64_t mode, long k, long beamSize,
+              const parlay::sequence<id_dist> &results) {
+    slot &s = slots[key % capacity];
+    std::lock_guard<std::mutex> lock(s.mtx);
+    s.key = key;
+    s.mode = mode;
+    s.generation = generation.load();
+    s.k = k;
+    s.beamSize = beamSize;
+    s.results = parlay::to_sequence(results.head(std::min<long>(k, results.size())));
+  }
+
+  // call whenever the index changes
+  void invalidate() {generation++;}
+
+  void record_hit(long nanos) {hits++; hit_nanos += nanos;}
+  void record_miss(long nanos) {misses++; miss_nanos += nanos;}
+
+  long num_hits() const {return hits.load();}
+  long num_misses() const {return misses.load();}
+  double hit_rate() const {
+    long total = hits.load() + misses.load();
+    return (total == 0) ? 0.0 : hits.load() / (double) total;
+  }
+  // average latencies in microseconds
+  double avg_hit_latency() const {
+    return (hits.load() == 0) ? 0.0 : hit_nanos.load() / (1000.0 * hits.load());
+  }
+  double avg_miss_latency() const {
+    return (misses.load() == 0) ? 0.0 : miss_nanos.load() / (1000.0 * misses.load());
+  }
+
+  void reset_counters() {hits = 0; misses = 0; hit_nanos = 0; miss_nanos = 0;}
+
+  void print() const {
+    std::cout << "query cache: " << num_hits() << " hits, " << num_misses()
+              << " misses, hit rate = " << hit_rate()
+              << ", average hit latency = " << avg_hit_latency()
+              << "us, average miss latency = " << avg_miss_latency() << "us" << std::endl;
+  }
+
+private:
+  struct slot {
+    std::mutex mtx;
+    uint64_t key = 0;
+    uint64_t mode = 0;
+    uint64_t generation = 0;
+    long k = 0;
+    long beamSize = 0;
+    parlay::sequence<id_dist> results;
+  };
+
+  size_t capacity;
+  std::unique_ptr<slot[]> slots;
+  std::atomic<uint64_t> generation;
+  std::atomic<long> hits;
+  std::atomic<long> misses;
+  std::atomic<long> hit_nanos;
+  std::atomic<long> miss_nanos;
+};
+
+} // end namespace
+
+#endif // ALGORITHMS_ANN_QUERY_CACHE_H_
@@ -62,15 +62,21 @@ struct stats{
   stats(size_t n){
     visited = parlay::sequence<indexType>(n, 0);
     distances = parlay::sequence<indexType>(n, 0);
+    truncated = parlay::sequence<indexType>(n, 0);
   }
 
   parlay::sequence<indexType> visited;
   parlay::sequence<indexType> distances;
+  parlay::sequence<indexType> truncated; // 1 if search ran out of time or budget
 
   void increment_dist(indexType i, indexType j){
     distances[i]+=j;}
   void increment_visited(indexType i, indexType j){
     visited[i]+=j;}
+  void set_truncated(indexType i){
+    truncated[i] = 1;}
+
+  size_t num_truncated(){return parlay::reduce(truncated);}
 
   parlay::sequence<indexType> visited_stats(){return statistics(this->visited);}
   parlay::sequence<indexType> dist_stats(){return statistics(this->distances);}
@@ -79,6 +85,7 @@ struct stats{
     size_t n = visited.size();
     visited = parlay::sequence<indexType>(n, 0);
     distances = parlay::sequence<indexType>(n, 0);
+    truncated = parlay::sequence<indexType>(n, 0);
   }
 
   parlay::sequence<indexType> statistics(parlay::sequence<indexType> s){
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+namespace parlayANN {
+
+// Resident set size of the process in bytes (0 if unavailable).
+inline size_t current_rss() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == nullptr) return 0;
+  long pages = 0, resident = 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// One JSON object, built up field by field, e.g.
+//   telemetry_record("vamana", "batch").add("size", 1024).add("beam_s", 0.5)
+struct telemetry_record {
+  telemetry_record(const std::string &builder, const std::string &event) {
+    add("builder", builder);
+    add("event", event);
+  }
+
+  telemetry_record &add(const std::string &key, const std::string &value) {
+    field(key);
+    out << '"';
+    for (char c : value) {
+      if (c == '"' || c == '\\') out << '\\';
+      out << c;
+    }
+    out << '"';
+    return *this;
+  }
+
+  telemetry_record &add(const std::string &key, const char* value) {
+    return add(key, std::string(value));
+  }
+
+  template<typename T>
+  telemetry_record &add(const std::string &key, T value) {
+    field(key);
+    out << value;
+    return *this;
+  }
+
+  std::string str() const {return out.str() + "}";}
+
+private:
+  std::ostringstream out;
+  bool first = true;
+
+  void field(const std::string &key) {
+    out << (first ? "{" : ",") << '"' << key << "\":";
+    first = false;
+  }
+};
+
+// Telemetry of graph builds, written as one JSON object per line to a
+// file.  The builders (Vamana, HCNNG, pyNNDescent and HNSW) write a
+// record per batch or round when it is open, so that the time of a
+// build can be attributed to its phases.  Each record gets the seconds
+// since the file was opened and the current RSS.  If a recall function
+// is set (e.g. sampled recall on held-out queries, see
+// check_nn_recall.h) it is evaluated on every recall_every-th record
+// that asks for it.  It is shared by the whole process, since the builders
+// are called through different interfaces.
+struct build_telemetry {
+
+  static build_telemetry &get() {
+    static build_telemetry telemetry;
+    return telemetry;
+  }
+
+  // recall_every: evaluate the recall function on every recall_every-th
+  // record that asks for it
+  void open(const std::string &path, long recall_every = 10) {
+    std::lock_guard<std::mutex> lock(mtx);
+    this->recall_every = std::max<long>(recall_every, 1);
+    out.open(path, std::ios::out | std::ios::app);
+    if (!out.is_open()) {
+      std::cout << "Error: could not open telemetry file " << path << std::endl;
+      abort();
+    }
+    start = std::chrono::steady_clock::now();
+  }
+
+  bool enabled() const {return out.is_open();}
+
+  void set_recall(std::function<double()> f) {
+    recall = f;
+    num_recall_requests = 0;
+  }
+
+  // Writes r, adding the time and RSS, and the recall if with_recall is
+  // set and it is due.  Not to be called from inside a parallel loop,
+  // since the recall can run a parallel search.
+  void write(telemetry_record &r, bool with_recall = false) {
+    if (!enabled()) return;
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+    r.add("time_s", t.count()).add("rss_mb", current_rss() / (1024.0 * 1024.0));
+    if (with_recall && recall && (num_recall_requests++ % recall_every) == 0)
+      r.add("recall", recall());
+    std::lock_guard<std::mutex> lock(mtx);
+    out << r.str() << std::endl;
+  }
+
+private:
+  build_telemetry() {}
+
+  std::ofstream out;
+  std::mutex mtx;
+  std::chrono::steady_clock::time_point start;
+  std::function<double()> recall;
+  long recall_every = 1;
+  long num_recall_requests = 0;
+};
+
+} // end namespace
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+
+namespace parlayANN {
+
+// Marks for lazily deleted points.  A deleted point stays in the graph
+// (so searches can still route through it) but is never returned, until
+// a consolidation pass removes it from its in-neighbors' lists and its
+// id can be reused.  Marks are atomic bytes so that they can be set
+// while searches are running.
+template<typename indexType>
+struct Tombstones {
+
+  Tombstones() : n(0), num_deleted(0) {}
+
+  Tombstones(size_t n) : n(0), num_deleted(0) {resize(n);}
+
+  size_t size() const {return n;}
+
+  // number of points currently marked
+  size_t count() const {return num_deleted.load();}
+
+  bool is_deleted(indexType i) const {
+    return num_deleted.load(std::memory_order_relaxed) > 0 && i < n &&
+      marks[i].load(std::memory_order_relaxed);
+  }
+
+  // returns false if i was already marked
+  bool mark(indexType i) {
+    if (i >= n) {
+      std::cout << "ERROR: cannot delete point " << i << " of " << n << std::endl;
+      abort();
+    }
+    if (marks[i].exchange(1)) return false;
+    num_deleted++;
+    return true;
+  }
+
+  // used when the id of a consolidated point is reused
+  void unmark(indexType i) {
+    if (marks[i].exchange(0)) num_deleted--;
+  }
+
+  // Grows to new_n points, none of the new ones marked.  Not safe to
+  // call concurrently with other operations.
+  void resize(size_t new_n) {
+    if (new_n > cap) {
+      size_t new_cap = std::max(new_n, 2 * cap);
+      std::shared_ptr<std::atomic<uint8_t>[]> m(new std::atomic<uint8_t>[new_cap]);
+      parlay::parallel_for(0, new_cap, [&] (long i) {
+        m[i] = (i < (long) n) ? marks[i].load() : 0;});
+      marks = m;
+      cap = new_cap;
+    } else parlay::parallel_for(n, new_n, [&] (long i) {marks[i] = 0;});
+    n = new_n;
+  }
+
+  // the marked ids in increasing order
+  parlay::sequence<indexType> deleted_ids() const {
+    auto ids = parlay::tabulate(n, [&] (size_t i) {return (indexType) i;});
+    return parlay::filter(ids, [&] (indexType i) {return marks[i].load() != 0;});
+  }
+
+private:
+  size_t n;
+  size_t cap = 0;
+  std::atomic<size_t> num_deleted;
+  std::shared_ptr<std::atomic<uint8_t>[]> marks;
+};
+
+} // end namespace
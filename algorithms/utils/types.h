@@ -27,6 +27,7 @@
 #define TYPES
 
 #include <algorithm>
+#include <chrono>
 #include <fstream>
 
 #include "parlay/parallel.h"
@@ -155,6 +156,8 @@ struct BuildParams{
   long R; //vamana and pynnDescent
   long L; //vamana
   double m_l = 0; // HNSW
+  std::string index_path = ""; // HNSW: saved model to load (the -graph_path)
+  std::string index_outfile = ""; // HNSW: where to save the model (empty = none)
   double alpha; //vamana and pyNNDescent
   int num_passes; //vamana
 
@@ -163,6 +166,8 @@ struct BuildParams{
   long MST_deg; //HCNNG
 
   double delta; //pyNNDescent
+  double rho = 1.0; //pyNNDescent: fraction of new neighbors sampled per round
+  std::string knn_graph = ""; //pyNNDescent: where to write the k-NN graph (empty = none)
   
   bool verbose;
 
@@ -175,15 +180,27 @@ struct BuildParams{
   long Q = 0; //beam width to pass onto query (0 indicates none specified)
   double trim = 0.0; // for quantization
   double rerank_factor = 100; // for reranking, k * factor = to rerank
+  bool exact_visited = false; // search with an exact visited table
+  double time_limit = 0.0; // search: per query deadline in seconds (0 = none)
+  long dist_budget = 0; // search: max distance comparisons per query (0 = none)
+  std::string checkpoint_path = ""; // vamana: where to write build checkpoints (empty = none)
+  double checkpoint_interval = 600; // vamana: seconds between checkpoints
+  bool resume = false; // vamana: resume the build from checkpoint_path
+  long num_shards = 0; // vamana: partitioned build with this many k-means shards (0 = none)
+  long shard_overlap = 2; // vamana: number of shards each point is put in
+  std::string seed_graph = ""; // vamana: start the build from a "pynn" or "hcnng" graph
+  bool adaptive_batch = false; // vamana: choose batch sizes from measurements
+  double batch_edge_target = .01; // vamana: adaptive batches: target fraction of edges within a batch
+  std::string batch_schedule = ""; // vamana: where to write (adaptive) or read a batch schedule
 
   std::string alg_type;
 
   BuildParams(long R, long L, double a, int num_passes, long nc, long cs, long mst, double de,
               bool verbose = false, int quantize = 0, double radius = 0.0, double radius_2 = 0.0,
               bool self = false, bool range = false, int single_batch = 0, long Q = 0, double trim = 0.0,
-              int rerank_factor = 100)
+              int rerank_factor = 100, bool exact_visited = false)
     : R(R), L(L), alpha(a), num_passes(num_passes), num_clusters(nc), cluster_size(cs), MST_deg(mst), delta(de),
-      verbose(verbose), quantize(quantize), radius(radius), radius_2(radius_2), self(self), range(range), single_batch(single_batch), Q(Q), trim(trim), rerank_factor(rerank_factor) {
+      verbose(verbose), quantize(quantize), radius(radius), radius_2(radius_2), self(self), range(range), single_batch(single_batch), Q(Q), trim(trim), rerank_factor(rerank_factor), exact_visited(exact_visited) {
     if(R != 0 && L != 0 && alpha != 0){alg_type = m_l>0? "HNSW": "Vamana";}
     else if(num_clusters != 0 && cluster_size != 0 && MST_deg != 0){alg_type = "HCNNG";}
     else if(R != 0 && alpha != 0 && num_clusters != 0 && cluster_size != 0 && delta != 0){alg_type = "pyNNDescent";}
@@ -223,6 +240,17 @@ struct QueryParams{
   long degree_limit;
   int rerank_factor = 100;
   float pad = 1.0;
+  bool exact_visited = false; // exact per-worker visited table instead of the hash filter
+  double time_limit = 0.0; // per query deadline in seconds (0 = none)
+  long dist_budget = 0; // max distance comparisons per query (0 = none)
+
+  // true if a search that started at start and has done dist_cmps
+  // distance comparisons has run out of time or budget
+  bool out_of_budget(std::chrono::steady_clock::time_point start, size_t dist_cmps) const {
+    if (dist_budget > 0 && dist_cmps >= (size_t) dist_budget) return true;
+    return (time_limit > 0 &&
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= time_limit);
+  }
 
   QueryParams(long k, long Q, double cut, long limit, long dg, double rerank_factor = 100) : k(k), beamSize(Q), cut(cut), limit(limit), degree_limit(dg), rerank_factor(rerank_factor) {}
 
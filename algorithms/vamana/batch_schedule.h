@@ -0,0 +1,219 @@
+// This code is part of the Problem Based Benchmark Suite (PBBS)
+// Copyright (c) 2011 Guy Blelloch and the PBBS team
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights (to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "../utils/beamSearch.h"
+#include "../utils/graph.h"
+#include "../utils/types.h"
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "parlay/sequence.h"
+
+namespace parlayANN {
+
+// The batch sizes of each pass of a Vamana build.  A build records its
+// schedule, and it can be written to a file (one line per pass) and
+// replayed, so that an adaptively scheduled build can be reproduced.
+struct batch_schedule {
+  parlay::sequence<parlay::sequence<size_t>> passes;
+
+  void add(int pass, size_t size) {
+    if (passes.size() <= (size_t) pass) passes.resize(pass + 1);
+    passes[pass].push_back(size);
+  }
+
+  // the size of batch b of pass, or 0 if the schedule has no such batch
+  size_t size(int pass, size_t b) const {
+    if ((size_t) pass >= passes.size() || b >= passes[pass].size()) return 0;
+    return passes[pass][b];
+  }
+
+  void save(const std::string &path) const {
+    std::ofstream out(path);
+    if (!out.is_open()) {
+      std::cout << "Error: could not write batch schedule " << path << std::endl;
+      abort();
+    }
+    for (auto &sizes : passes) {
+      for (size_t b = 0; b < sizes.size(); b++)
+        out << (b == 0 ? "" : " ") << sizes[b];
+      out << "\n";
+    }
+  }
+
+  static batch_schedule load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+      std::cout << "Error: batch schedule " << path << " not found" << std::endl;
+      abort();
+    }
+    batch_schedule S;
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream sizes(line);
+      S.passes.push_back(parlay::sequence<size_t>());
+      size_t size;
+      while (sizes >> size) S.passes.back().push_back(size);
+    }
+    return S;
+  }
+
+  // e.g. "12 batches, sizes 1 to 4096"
+  std::string summary(int pass) const {
+    if ((size_t) pass >= passes.size() || passes[pass].empty()) return "0 batches";
+    auto &sizes = passes[pass];
+    std::ostringstream s;
+    s << sizes.size() << " batches, sizes " << *std::min_element(sizes.begin(), sizes.end())
+      << " to " << *std::max_element(sizes.begin(), sizes.end());
+    return s.str();
+  }
+};
+
+// Picks the size of each batch of batch_insert from what the previous
+// batch measured, instead of the fixed geometric schedule.
+//
+// Points in the same batch cannot link to each other, so the larger a
+// batch is relative to the graph, the more edges are missed.  The
+// scheduler is given, for a sample of each batch, the fraction of the
+// neighbors the sampled points would get after the batch that are in
+// the batch itself, and scales the batch so this stays at edge_target.
+// Batches smaller than min_per_worker points per worker always grow,
+// since they cannot keep the workers busy, and batches whose insert rate
+// (points per second) still improves may double up to twice edge_target.
+// If the recall of a small probe set (recall_probe) drops by more than
+// drift_tolerance since it was last measured, the next batch is halved.
+// (It declines slowly as the graph grows, even without damage.)
+struct adaptive_batch_scheduler {
+  adaptive_batch_scheduler(size_t max_size, double edge_target,
+                           double drift_tolerance = .02, size_t min_per_worker = 16)
+    : max_size(std::max<size_t>(max_size, 1)), edge_target(edge_target),
+      drift_tolerance(drift_tolerance),
+      parallel_size(min_per_worker * parlay::num_workers()) {}
+
+  size_t next() const {return size;}
+
+  // restarts a resumed pass with batches that keep the workers busy
+  void restart(size_t inserted) {
+    size = std::clamp<size_t>(std::min<size_t>(parallel_size, inserted), 1, max_size);
+  }
+
+  // in_batch: fraction of the sampled new edges within the batch
+  // probe_recall: recall of the probe set
+  // (either is negative if it was not measured for this batch)
+  void observe(size_t batch_size, double seconds, double in_batch, double probe_recall) {
+    double s = (double) batch_size;
+    double rate = s / std::max(seconds, 1e-9);
+    bool improving = rate > 1.1 * best_rate;
+    best_rate = std::max(best_rate, rate);
+    double next;
+    if (probe_recall >= 0 && probe_recall + drift_tolerance < last_recall) {
+      next = s / 2;
+    } else {
+      next = in_batch > 0 ? s * std::min(2.0, edge_target / in_batch) : 2 * s;
+      if (s < parallel_size)
+        next = std::max(next, std::min(2 * s, (double) parallel_size));
+      else if (improving && in_batch <= 2 * edge_target)
+        next = 2 * s;
+    }
+    if (probe_recall >= 0) last_recall = probe_recall;
+    size = std::clamp<size_t>((size_t) next, 1, max_size);
+  }
+
+private:
+  size_t max_size;
+  double edge_target;
+  double drift_tolerance;
+  size_t parallel_size;
+  size_t size = 1;
+  double best_rate = 0;
+  double last_recall = 0;
+};
+
+// Recall@k of searches for a fixed set of probe points (the first
+// points inserted) on the graph as it is being built, against their
+// exact nearest neighbors among the points inserted so far.  The exact
+// neighbors are kept up to date by scanning each inserted point once,
+// so the probes cost k * num_probes * n distances over the whole build,
+// plus the searches.
+template<typename PointRange, typename indexType>
+struct recall_probe {
+  using Point = typename PointRange::Point;
+  using distanceType = typename Point::distanceType;
+  using pid = std::pair<indexType, distanceType>;
+
+  recall_probe(parlay::sequence<indexType> ids, long k = 10)
+    : ids(std::move(ids)), k(k), nearest(this->ids.size()) {}
+
+  // adds the points inserts[scanned, to) to the exact neighbors
+  void scan(const PointRange &Points, const parlay::sequence<indexType> &inserts, size_t to) {
+    parlay::parallel_for(0, ids.size(), [&] (size_t j) {
+      auto &best = nearest[j];
+      auto less = [] (pid a, pid b) {return a.second < b.second;};
+      for (size_t i = scanned; i < to; i++) {
+        indexType v = inserts[i];
+        if (v == ids[j]) continue;
+        distanceType d = Points[ids[j]].distance(Points[v]);
+        if ((long) best.size() < k) {
+          best.push_back(pid(v, d));
+          std::push_heap(best.begin(), best.end(), less);
+        } else if (d < best.front().second) {
+          std::pop_heap(best.begin(), best.end(), less);
+          best.back() = pid(v, d);
+          std::push_heap(best.begin(), best.end(), less);
+        }
+      }
+    });
+    scanned = std::max(scanned, to);
+  }
+
+  double recall(const Graph<indexType> &G, const PointRange &Points, indexType start,
+                long beam_width) {
+    QueryParams QP(k, std::max(k, beam_width), 1.35, (long) Points.size(), G.max_degree());
+    auto hits = parlay::tabulate(ids.size(), [&] (size_t j) {
+      auto [pairElts, dc] = beam_search(Points[ids[j]], G, Points, start, QP);
+      auto &frontier = pairElts.first;
+      size_t found = 0;
+      for (long i = 0; i < k && i < (long) frontier.size(); i++)
+        for (auto x : nearest[j])
+          if (x.first == frontier[i].first) found++;
+      return found;
+    });
+    size_t total = parlay::reduce(parlay::map(nearest, [] (auto &b) {return b.size();}));
+    return total == 0 ? 1.0 : parlay::reduce(hits) / (double) total;
+  }
+
+private:
+  parlay::sequence<indexType> ids;
+  long k;
+  parlay::sequence<std::vector<pid>> nearest;
+  size_t scanned = 0;
+};
+
+} // end namespace
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "../utils/graph.h"
+#include "parlay/primitives.h"
+
+namespace parlayANN {
+
+// Where a Vamana build is: the pass, the random order of the inserts
+// in that pass, and batch_insert's cursor into it.
+template<typename indexType>
+struct build_state {
+  int pass = 0;
+  size_t inc = 0;
+  size_t count = 0;
+  float frac = 0.0;
+  indexType start_point = 0;
+  parlay::sequence<int> rperm;
+};
+
+// Periodic checkpoints of a Vamana build, written by a background
+// thread so that the build is not stopped while the graph is written.
+//
+// The graph keeps changing while it is being written, so each adjacency
+// list is copied under its vertex's seqlock (the build turns on
+// Graph::enable_versions when checkpointing).  Every list written is
+// then one the build actually had, but lists are taken at different
+// times, so a list can include edges added by batches after the
+// recorded cursor, including reverse edges into points before it.
+// Those are edges to real points within the degree bound, as in any
+// intermediate graph of the build, so resuming from it is sound; it just
+// is not the exact graph at the cursor.  This avoids keeping a second
+// copy of the graph in memory.  The graph is
+// written to <path> in the usual graph format (so it can also be loaded
+// with -graph_path) and the state to <path>.meta.  Each is written to a
+// temporary file, flushed to disk and renamed into place, graph first,
+// so the state is never ahead of the graph.  If a write fails the
+// previous checkpoint is kept and the build carries on.
+template<typename indexType>
+struct build_checkpointer {
+  using GraphI = Graph<indexType>;
+
+  build_checkpointer(std::string path, double interval)
+    : path(path), interval(interval), busy(false),
+      last(std::chrono::steady_clock::now()) {}
+
+  ~build_checkpointer() {finish();}
+
+  // true if the interval has passed since the last checkpoint and the
+  // last one has finished writing
+  bool due() const {
+    auto elapsed = std::chrono::steady_clock::now() - last;
+    return !busy.load() && std::chrono::duration<double>(elapsed).count() >= interval;
+  }
+
+  // Starts writing a checkpoint of G and state in the background.
+  void save(const GraphI &G, build_state<indexType> &&state) {
+    if (writer.joinable()) writer.join();
+    busy = true;
+    last = std::chrono::steady_clock::now();
+    // the graph is shared, not copied
+    writer = std::thread([this, G, state = std::move(state)] () {
+      if (!replace(path, [&] (const std::string &tmp) {return write_graph(G, tmp);}) ||
+          !replace(path + ".meta", [&] (const std::string &tmp) {return write_state(G, state, tmp);}))
+        std::cout << "Error: could not write checkpoint " << path
+                  << ", keeping the previous one" << std::endl;
+      else num_saved++;
+      busy = false;
+    });
+  }
+
+  // waits for a checkpoint in progress to be written
+  void finish() {
+    if (writer.joinable()) writer.join();
+  }
+
+  long saved() const {return num_saved.load();}
+
+  // Loads the graph and state of a checkpoint at path into G and state,
+  // checking that they match the build (n points, max degree of G).
+  static void load(const std::string &path, GraphI &G, build_state<indexType> &state) {
+    std::ifstream reader(path + ".meta", std::ios::binary);
+    if (!reader.is_open()) {
+      std::cout << "Error: checkpoint " << path << ".meta not found" << std::endl;
+      abort();
+    }
+    uint64_t magic, n, m, max_deg;
+    reader.read((char*) &magic, sizeof(uint64_t));
+    reader.read((char*) &n, sizeof(uint64_t));
+    reader.read((char*) &max_deg, sizeof(uint64_t));
+    reader.read((char*) &m, sizeof(uint64_t));
+    if (magic != checkpoint_magic || n != G.size() || (long) max_deg != G.max_degree()) {
+      std::cout << "Error: checkpoint " << path << " does not match the build (" << n
+                << " points, max degree " << max_deg << ")" << std::endl;
+      abort();
+    }
+    uint64_t inc, count;
+    reader.read((char*) &state.pass, sizeof(int));
+    reader.read((char*) &inc, sizeof(uint64_t));
+    reader.read((char*) &count, sizeof(uint64_t));
+    reader.read((char*) &state.frac, sizeof(float));
+    reader.read((char*) &state.start_point, sizeof(indexType));
+    state.inc = inc;
+    state.count = count;
+    state.rperm = parlay::sequence<int>(m);
+    reader.read((char*) state.rperm.begin(), m * sizeof(int));
+    if (!reader) {
+      std::cout << "Error: checkpoint " << path << ".meta is truncated" << std::endl;
+      abort();
+    }
+    G = GraphI((char*) path.c_str());
+  }
+
+private:
+  static constexpr uint64_t checkpoint_magic = 0x54504b434e4e4150;  // "PANNCKPT"
+
+  std::string path;
+  double interval;
+  std::atomic<bool> busy;
+  std::atomic<long> num_saved{0};
+  std::chrono::steady_clock::time_point last;
+  std::thread writer;
+
+  // Writes file by calling write on <file>.tmp, flushing it to disk and
+  // renaming it over file.  On failure the temporary is removed, file is
+  // left as it was, and false is returned.
+  template<typename Write>
+  static bool replace(const std::string &file, const Write &write) {
+    std::string tmp = file + ".tmp";
+    bool ok = write(tmp);
+    if (ok) {
+      int fd = open(tmp.c_str(), O_RDONLY);
+      ok = (fd >= 0 && fsync(fd) == 0);
+      if (fd >= 0) close(fd);
+    }
+    if (ok) ok = (rename(tmp.c_str(), file.c_str()) == 0);
+    if (!ok) remove(tmp.c_str());
+    return ok;
+  }
+
+  // Same format as Graph::save, but written sequentially so it can run
+  // on a thread outside of the parallel scheduler.  Each list is copied
+  // with copy_neighbors so its size and edges are read together; the
+  // sizes are only known after the edges are copied, so they are written
+  // last, into the space left for them after the preamble.
+  static bool write_graph(const GraphI &G, const std::string &file) {
+    std::ofstream writer(file, std::ios::binary | std::ios::out);
+    if (!writer.is_open()) return false;
+    size_t n = G.size();
+    indexType preamble[2] = {static_cast<indexType>(n), static_cast<indexType>(G.max_degree())};
+    writer.write((char*) preamble, 2 * sizeof(indexType));
+    std::vector<indexType> sizes(n);
+    writer.write((char*) sizes.data(), n * sizeof(indexType));
+    size_t BLOCK_SIZE = 1000000;
+    std::vector<indexType> data;
+    std::vector<indexType> nbhs(G.max_degree());
+    for (size_t floor = 0; floor < n; floor += BLOCK_SIZE) {
+      size_t ceiling = std::min(floor + BLOCK_SIZE, n);
+      data.clear();
+      for (size_t i = floor; i < ceiling; i++) {
+        long d = G[i].copy_neighbors(nbhs.data());
+        sizes[i] = d;
+        data.insert(data.end(), nbhs.begin(), nbhs.begin() + d);
+      }
+      writer.write((char*) data.data(), data.size() * sizeof(indexType));
+    }
+    writer.seekp(2 * sizeof(indexType));
+    writer.write((char*) sizes.data(), n * sizeof(indexType));
+    writer.close();
+    return !writer.fail();
+  }
+
+  static bool write_state(const GraphI &G, const build_state<indexType> &state,
+                          const std::string &file) {
+    std::ofstream writer(file, std::ios::binary | std::ios::out);
+    if (!writer.is_open()) return false;
+    uint64_t header[4] = {checkpoint_magic, G.size(), (uint64_t) G.max_degree(),
+                          state.rperm.size()};
+    writer.write((char*) header, 4 * sizeof(uint64_t));
+    uint64_t inc = state.inc, count = state.count;
+    writer.write((char*) &state.pass, sizeof(int));
+    writer.write((char*) &inc, sizeof(uint64_t));
+    writer.write((char*) &count, sizeof(uint64_t));
+    writer.write((char*) &state.frac, sizeof(float));
+    writer.write((char*) &state.start_point, sizeof(indexType));
+    writer.write((char*) state.rperm.begin(), state.rperm.size() * sizeof(int));
+    writer.close();
+    return !writer.fail();
+  }
+};
+
+} // end namespace
@@ -0,0 +1,253 @@
+// This code is part of the Problem Based Benchmark Suite (PBBS)
+// Copyright (c) 2011 Guy Blelloch and the PBBS team
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights (to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#pragma once
+
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <vector>
+
+#include "../utils/point_range.h"
+#include "../utils/graph.h"
+#include "../utils/types.h"
+#include "../utils/stats.h"
+#include "../utils/beamSearch.h"
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "index.h"
+
+namespace parlayANN {
+
+// A read-only view of a versioned Graph for searching it while it is
+// being updated.  Each access copies the adjacency list of a vertex
+// under its seqlock, so a search never sees a half written list.
+template<typename indexType>
+struct snapshot_graph {
+  struct neighbors {
+    const indexType* ptr;
+    long d;
+    size_t size() const {return d;}
+    indexType operator [] (long i) const {return ptr[i];}
+    void prefetch() const {}
+  };
+
+  snapshot_graph(const Graph<indexType> &G) : G(G) {}
+
+  long max_degree() const {return G.max_degree();}
+  size_t size() const {return G.size();}
+
+  // the copy lives in a per-thread buffer, so it is valid until the
+  // next access from the same thread
+  neighbors operator [] (indexType i) const {
+    static thread_local std::vector<indexType> buffer;
+    if (buffer.size() < (size_t) G.max_degree()) buffer.resize(G.max_degree());
+    long d = G[i].copy_neighbors(buffer.data());
+    return neighbors{buffer.data(), d};
+  }
+
+private:
+  const Graph<indexType> &G;
+};
+
+// A Vamana index that can be grown by batches of new points while it is
+// being searched.  Inserts are serialized with each other and reuse
+// knn_index::batch_insert (with its prefix doubling) on the new ids.
+// Searches hold a shared lock, so they run concurrently with the
+// searching and pruning phases of an insert and see each adjacency list
+// through its seqlock.  The only exclusive section is growing the
+// storage and writing the new points, which is short.  Points are
+// deleted lazily with tombstones; consolidate() removes them from the
+// graph and their ids are then reused by later inserts.
+template<typename PointRange, typename QPointRange, typename indexType>
+struct dynamic_index {
+  using Point = typename PointRange::Point;
+  using distanceType = typename Point::distanceType;
+  using pid = std::pair<indexType, distanceType>;
+  using PR = PointRange;
+  using QPR = QPointRange;
+  using GraphI = Graph<indexType>;
+
+  // Builds an index on the given points.  If QPoints shares its storage
+  // with Points (no quantization) the two are kept shared as points are
+  // added.  (The points are taken by const reference, since copying a
+  // non-const PointRange would pick its converting constructor.)
+  dynamic_index(BuildParams &BP, const PR &Points, const QPR &QPoints)
+    : BP(BP), I(this->BP), G(BP.R, Points.size()),
+      Points(Points), QPoints(QPoints), shared(shares_storage(Points, QPoints)),
+      BuildStats(Points.size()) {
+    G.enable_versions();
+    I.deleted.resize(G.size());
+    I.build_index(G, this->Points, this->QPoints, BuildStats);
+  }
+
+  // Adopts an already built graph on the given points.
+  dynamic_index(BuildParams &BP, const PR &Points, const QPR &QPoints, const GraphI &G)
+    : BP(BP), I(this->BP), G(G), Points(Points), QPoints(QPoints),
+      shared(shares_storage(Points, QPoints)), BuildStats(Points.size()) {
+    if (G.size() != Points.size()) {
+      std::cout << "ERROR: graph has " << G.size() << " vertices but there are "
+                << Points.size() << " points" << std::endl;
+      abort();
+    }
+    I.set_start();
+    I.deleted.resize(G.size());
+    this->G.enable_versions();
+  }
+
+  // number of ids in use, including deleted points not yet reused
+  size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    return Points.size();
+  }
+
+  // number of points deleted and not yet reused
+  size_t num_deleted() const {return I.deleted.count();}
+
+  // Inserts the points of new_points, which can be any range whose
+  // elements can be translated into a Point (e.g. a PointRange of the
+  // same type or a sequence of sequences).  Ids of consolidated deletes
+  // are reused first, and the rest are new ids at the end.  Returns the
+  // ids assigned, in the order of new_points.
+  template<typename NewPoints>
+  parlay::sequence<indexType> insert(const NewPoints &new_points, bool print = false) {
+    std::lock_guard<std::mutex> insert_lock(insert_mtx);
+    size_t m = new_points.size();
+    size_t num_reused = std::min(m, free_ids.size());
+    parlay::sequence<indexType> ids;
+    {
+      std::unique_lock<std::shared_mutex> lock(mtx);
+      size_t old_n = Points.size();
+      ids = parlay::tabulate(m, [&] (size_t i) {
+        return (i < num_reused) ? free_ids[free_ids.size() - num_reused + i]
+                                : (indexType) (old_n + i - num_reused);});
+      free_ids.resize(free_ids.size() - num_reused);
+
+      // overwrite the reused slots (their edges were cleared when they
+      // were consolidated) and append the rest
+      parlay::parallel_for(0, num_reused, [&] (size_t i) {
+        Points.set_point(ids[i], new_points[i]);
+        if (!shared) QPoints.set_point(ids[i], new_points[i]);
+        I.deleted.unmark(ids[i]);
+      });
+      auto rest = parlay::delayed_tabulate(m - num_reused, [&] (size_t i) {
+        return new_points[num_reused + i];});
+      Points.append(rest);
+      if constexpr (std::is_same_v<PR, QPR>) {
+        if (shared) QPoints = Points;
+        else QPoints.append(rest);
+      } else QPoints.append(rest);
+      G.resize(Points.size());
+      I.deleted.resize(Points.size());
+      // stats cover the most recent insert
+      BuildStats = stats<indexType>(Points.size());
+    }
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    I.batch_insert(ids, G, Points, QPoints, BuildStats, BP.alpha, true, 2, .02, print);
+    return ids;
+  }
+
+  // Lazily deletes the given ids: they are no longer returned by
+  // search, but stay in the graph until consolidate() is called.  Safe
+  // to call concurrently with search and insert, and waits for a running
+  // consolidate().  Returns the number of points newly deleted.
+  size_t remove(const parlay::sequence<indexType> &ids) {
+    std::lock_guard<std::mutex> delete_lock(delete_mtx);
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    for (auto i : ids)
+      if (i >= Points.size()) {
+        std::cout << "ERROR: cannot delete point " << i << " of "
+                  << Points.size() << std::endl;
+        abort();
+      }
+    return I.lazy_delete(ids, G);
+  }
+
+  // Removes the deleted points from the graph, patching the adjacency
+  // lists of their in-neighbors, and makes their ids available for
+  // reuse.  Runs concurrently with search, but not with insert or
+  // remove.  Returns the number of points removed.
+  size_t consolidate() {
+    std::lock_guard<std::mutex> insert_lock(insert_mtx);
+    std::lock_guard<std::mutex> delete_lock(delete_mtx);
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    auto removed = I.consolidate_deletes(G, Points, BP.alpha, BuildStats);
+    // ids already waiting for reuse are reported again, so skip them
+    auto is_free = parlay::sequence<bool>(Points.size(), false);
+    for (auto i : free_ids) is_free[i] = true;
+    auto new_free = parlay::filter(removed, [&] (indexType i) {return !is_free[i];});
+    free_ids.append(new_free);
+    return new_free.size();
+  }
+
+  // Beam search for q; safe to call concurrently with insert.  Returns
+  // (id, distance) pairs for the closest QP.k points found.
+  parlay::sequence<pid> search(const Point &q, const QueryParams &QP) {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    if (Points.size() == 0) return parlay::sequence<pid>();
+    snapshot_graph<indexType> SG(G);
+    parlay::sequence<indexType> starts = {I.get_start()};
+    auto [pairElts, dist_cmps] = filtered_beam_search(SG, q, Points, q, Points, starts, QP,
+                                                      false, nullptr, &I.deleted);
+    auto frontier = pairElts.first;
+    return parlay::tabulate(std::min<long>(QP.k, frontier.size()),
+                            [&] (long i) {return frontier[i];});
+  }
+
+  // Search a batch of queries in parallel; safe to call concurrently
+  // with insert.
+  template<typename QueryRange>
+  parlay::sequence<parlay::sequence<pid>> search_all(const QueryRange &Queries,
+                                                     const QueryParams &QP) {
+    return parlay::tabulate(Queries.size(), [&] (size_t i) {
+      return search(Queries[i], QP);});
+  }
+
+  // The following give direct access for saving or batch evaluation and
+  // should not be used while inserts are in progress.
+  GraphI &graph() {return G;}
+  PR &points() {return Points;}
+  QPR &qpoints() {return QPoints;}
+  indexType get_start() {return I.get_start();}
+  stats<indexType> &build_stats() {return BuildStats;}
+
+private:
+  BuildParams BP;
+  knn_index<PR, QPR, indexType> I;
+  GraphI G;
+  PR Points;
+  QPR QPoints;
+  bool shared;
+  stats<indexType> BuildStats;
+  parlay::sequence<indexType> free_ids;
+  mutable std::shared_mutex mtx;
+  std::mutex insert_mtx;
+  std::mutex delete_mtx; // held by remove and consolidate
+
+  static bool shares_storage(const PR &Points, const QPR &QPoints) {
+    if constexpr (std::is_same_v<PR, QPR>)
+      return Points.size() > 0 && Points.location(0) == QPoints.location(0);
+    else return false;
+  }
+};
+
+} // end namespace
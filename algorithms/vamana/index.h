@@ -25,17 +25,24 @@
 #include <math.h>
 
 #include <algorithm>
+#include <atomic>
+#include <memory>
 #include <random>
 #include <set>
 
 #include "../utils/point_range.h"
 #include "../utils/graph.h"
 #include "../utils/types.h"
+#include "../utils/tombstones.h"
 #include "parlay/parallel.h"
 #include "parlay/primitives.h"
 #include "parlay/delayed.h"
 #include "parlay/random.h"
 #include "../utils/beamSearch.h"
+#include "../utils/prune.h"
+#include "../utils/telemetry.h"
+#include "batch_schedule.h"
+#include "checkpoint.h"
 
 namespace parlayANN {
 
@@ -50,9 +57,31 @@ struct knn_index {
   using GraphI = Graph<indexType>;
 
   BuildParams BP;
-  std::set<indexType> delete_set;
+  Tombstones<indexType> deleted;
   indexType start_point;
 
+  // per vertex count of reverse edges added by the current batch of
+  // batch_insert; all zero between batches
+  std::unique_ptr<std::atomic<uint32_t>[]> pending;
+  size_t pending_size = 0;
+
+  void reserve_pending(size_t n) {
+    if (n <= pending_size) return;
+    pending_size = std::max(n, 2 * pending_size);
+    pending = std::unique_ptr<std::atomic<uint32_t>[]>(new std::atomic<uint32_t>[pending_size]);
+    parlay::parallel_for(0, pending_size, [&] (size_t i) {pending[i] = 0;});
+  }
+
+  // used by build_index to checkpoint and resume batch_insert
+  build_checkpointer<indexType>* checkpoints = nullptr;
+  build_state<indexType>* resume_state = nullptr;
+  int pass = 0;
+
+  // the batch sizes used by batch_insert, and a schedule to replay
+  // instead of the geometric one (see batch_schedule.h)
+  batch_schedule schedule;
+  batch_schedule replay;
+
   knn_index(BuildParams &BP) : BP(BP) {}
 
   indexType get_start() { return start_point; }
@@ -76,47 +105,11 @@ struct knn_index {
       }
     }
 
-    // Sort the candidate set according to distance from p
-    auto less = [&](std::pair<indexType, distanceType> a, std::pair<indexType, distanceType> b) {
-      return a.second < b.second || (a.second == b.second && a.first < b.first);
-    };
-    std::sort(candidates.begin(), candidates.end(), less);
-
-    // remove any duplicates
-    auto new_end =std::unique(candidates.begin(), candidates.end(),
-			      [&] (auto x, auto y) {return x.first == y.first;});
-    candidates = std::vector(candidates.begin(), new_end);
-
-    std::vector<indexType> new_nbhs;
-    new_nbhs.reserve(BP.R);
-
-    size_t candidate_idx = 0;
-
-    while (new_nbhs.size() < BP.R && candidate_idx < candidates.size()) {
-      // Don't need to do modifications.
-      int p_star = candidates[candidate_idx].first;
-      candidate_idx++;
-      if (p_star == p || p_star == -1) {
-        continue;
-      }
-
-      new_nbhs.push_back(p_star);
-
-      for (size_t i = candidate_idx; i < candidates.size(); i++) {
-        int p_prime = candidates[i].first;
-        if (p_prime != -1) {
-          distance_comps++;
-          distanceType dist_starprime = Points[p_star].distance(Points[p_prime]);
-          distanceType dist_pprime = candidates[i].second;
-          if (alpha * dist_starprime <= dist_pprime) {
-            candidates[i].first = -1;
-          }
-        }
-      }
-    }
-
-    auto new_neighbors_seq = parlay::to_sequence(new_nbhs);
-    return std::pair(new_neighbors_seq, distance_comps);
+    // sort, deduplicate and prune, computing the pairwise distances
+    // between candidates in blocks
+    auto [new_nbhs, prune_comps] =
+      blocked_robust_prune(p, candidates, Points, alpha, BP.R);
+    return std::pair(new_nbhs, distance_comps + prune_comps);
   }
 
   //wrapper to allow calling robustPrune on a sequence of candidates
@@ -147,13 +140,100 @@ struct knn_index {
 
   void set_start(){start_point = 0;}
 
+  // Marks points as deleted.  They remain in the graph, and can still be
+  // searched through, but are not returned by searches that are given
+  // the tombstones and are not used as edge candidates by later inserts.
+  // The tombstones must already cover the ids: they are only grown where
+  // nothing else is using them (as dynamic_index does when it adds
+  // points).  Returns the number of points newly marked.
+  size_t lazy_delete(const parlay::sequence<indexType> &ids, GraphI &G) {
+    return parlay::count(parlay::map(ids, [&] (indexType i) {return deleted.mark(i);}), true);
+  }
+
+  // Removes the lazily deleted points from the graph: each remaining
+  // point with a deleted out-neighbor has it replaced by the deleted
+  // point's own (non-deleted) neighbors, pruned back to degree R with
+  // robustPrune if needed.  The deleted points' edges are then cleared.
+  // The start point is never removed, although if deleted it is not
+  // returned.  Returns the ids removed, which stay marked until they are
+  // reused.  Works on a snapshot of the tombstones taken at the start,
+  // so points deleted while it runs are left for the next call.
+  parlay::sequence<indexType> consolidate_deletes(GraphI &G, PR &Points, double alpha,
+                                                  stats<indexType> &BuildStats) {
+    if (deleted.count() == 0) return parlay::sequence<indexType>();
+    auto removed = parlay::filter(deleted.deleted_ids(), [&] (indexType u) {
+      return u != start_point;});
+    parlay::sequence<bool> is_removed(G.size(), false);
+    parlay::parallel_for(0, removed.size(), [&] (size_t i) {
+      is_removed[removed[i]] = true;});
+    auto removable = [&] (indexType u) {return is_removed[u];};
+
+    parlay::parallel_for(0, G.size(), [&] (size_t i) {
+      indexType v = i;
+      if (removable(v)) return;
+      bool affected = false;
+      std::vector<indexType> candidates;
+      auto nbhs = G[v];
+      for (size_t j = 0; j < nbhs.size(); j++) {
+        indexType u = nbhs[j];
+        if (!removable(u)) candidates.push_back(u);
+        else {
+          affected = true;
+          auto u_nbhs = G[u];
+          for (size_t l = 0; l < u_nbhs.size(); l++)
+            if (u_nbhs[l] != v && !removable(u_nbhs[l])) candidates.push_back(u_nbhs[l]);
+        }
+      }
+      if (!affected) return;
+      std::sort(candidates.begin(), candidates.end());
+      candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+      if (candidates.size() <= BP.R) G[v].update_neighbors(candidates);
+      else {
+        auto [new_out, distance_comps] =
+          robustPrune(v, parlay::to_sequence(candidates), G, Points, alpha, false);
+        G[v].update_neighbors(new_out);
+        BuildStats.increment_dist(v, distance_comps);
+      }
+    }, 1);
+
+    parlay::parallel_for(0, removed.size(), [&] (size_t i) {
+      G[removed[i]].clear_neighbors();});
+    return removed;
+  }
+
   void build_index(GraphI &G, PR &Points, QPR &QPoints,
                    stats<indexType> &BuildStats, bool sort_neighbors = true){
     std::cout << "Building graph..." << std::endl;
     set_start();
     parlay::sequence<indexType> inserts = parlay::tabulate(Points.size(), [&] (size_t i){
       return static_cast<indexType>(i);});
-    if (BP.single_batch != 0) {
+
+    // resume from a checkpoint, and/or write them periodically
+    build_state<indexType> state;
+    int first_pass = 0;
+    if (BP.resume) {
+      if (BP.checkpoint_path.empty()) {
+        std::cout << "Error: resuming requires a checkpoint path" << std::endl;
+        abort();
+      }
+      build_checkpointer<indexType>::load(BP.checkpoint_path, G, state);
+      start_point = state.start_point;
+      first_pass = state.pass;
+      resume_state = &state;
+      std::cout << "Resuming build from pass " << first_pass << " with "
+                << std::min(state.count, state.rperm.size()) << " of "
+                << state.rperm.size() << " points inserted" << std::endl;
+    }
+    std::unique_ptr<build_checkpointer<indexType>> checkpointer;
+    if (!BP.checkpoint_path.empty()) {
+      checkpointer = std::make_unique<build_checkpointer<indexType>>(BP.checkpoint_path,
+                                                                     BP.checkpoint_interval);
+      checkpoints = checkpointer.get();
+      // so the checkpoint writer can copy lists while they are updated
+      if (!G.versioned()) G.enable_versions();
+    }
+
+    if (BP.single_batch != 0 && !BP.resume) {
       int degree = BP.single_batch;
       std::cout << "Using single batch per round with " << degree << " random start edges" << std::endl;
       parlay::random_generator gen;
@@ -168,28 +248,101 @@ struct knn_index {
       });
     }
 
+    if (!BP.batch_schedule.empty() && !BP.adaptive_batch)
+      replay = batch_schedule::load(BP.batch_schedule);
+
     // last pass uses alpha
     std::cout << "number of passes = " << BP.num_passes << std::endl;
-    for (int i=0; i < BP.num_passes; i++) {
+    for (int i=first_pass; i < BP.num_passes; i++) {
+      pass = i;
       if (i == BP.num_passes - 1)
         batch_insert(inserts, G, Points, QPoints, BuildStats, BP.alpha, true, 2, .02);
       else
         batch_insert(inserts, G, Points, QPoints, BuildStats, 1.0, true, 2, .02);
     }
+    if (checkpointer) {
+      checkpointer->finish();
+      std::cout << "Wrote " << checkpointer->saved() << " checkpoints to "
+                << BP.checkpoint_path << std::endl;
+    }
+    checkpoints = nullptr;
+    resume_state = nullptr;
+    report_schedule(first_pass);
+
+    if (sort_neighbors) sort_by_distance(G, Points);
+  }
+
+  // The fraction of the edges that a sample of the batch of inserts
+  // [floor, ceiling) would get now that the batch has been linked in (by
+  // searching and pruning again) that go to points of the same batch.
+  // One point in 16 of the batch is sampled, up to 32, to keep the cost
+  // to a few percent of the build; -1 if the batch is too small.
+  double in_batch_edges(const parlay::sequence<indexType> &shuffled_inserts, size_t floor,
+                        size_t ceiling, GraphI &G, PR &Points, double alpha) {
+    size_t batch = ceiling - floor;
+    size_t num_samples = std::min<size_t>(batch / 16, 32);
+    if (num_samples == 0) return -1;
+    auto in_batch_ids = parlay::sort(shuffled_inserts.cut(floor, ceiling));
+    QueryParams QP((long) 0, BP.L, (double) 0.0, (long) Points.size(), (long) G.max_degree());
+    auto counts = parlay::tabulate(num_samples, [&] (size_t j) {
+      indexType index = shuffled_inserts[floor + j * batch / num_samples];
+      auto [pairElts, dc] = beam_search(Points[index], G, Points, start_point, QP);
+      auto visited = parlay::filter(pairElts.second, [&] (pid x) {
+        return x.first != index && !deleted.is_deleted(x.first);});
+      auto [nbhs, rc] = robustPrune(index, visited, G, Points, alpha, false);
+      size_t within = parlay::count_if(nbhs, [&] (indexType v) {
+        return std::binary_search(in_batch_ids.begin(), in_batch_ids.end(), v);});
+      return std::pair(within, nbhs.size());
+    });
+    size_t within = parlay::reduce(parlay::map(counts, [] (auto p) {return p.first;}));
+    size_t total = parlay::reduce(parlay::map(counts, [] (auto p) {return p.second;}));
+    return total == 0 ? 0.0 : within / (double) total;
+  }
+
+  // Refines an existing graph, e.g. one seeded from a pyNNDescent or
+  // HCNNG graph (see seed_graph.h), with a single pass of inserts using
+  // alpha.  Since the graph is already well connected, this replaces
+  // the early passes and batches that search a sparse graph: the
+  // batches start at the maximum size instead of growing from 1.
+  void refine_index(GraphI &G, PR &Points, QPR &QPoints,
+                    stats<indexType> &BuildStats, bool sort_neighbors = true) {
+    std::cout << "Refining graph..." << std::endl;
+    set_start();
+    parlay::sequence<indexType> inserts = parlay::tabulate(Points.size(), [&] (size_t i){
+      return static_cast<indexType>(i);});
+    pass = 0;
+    if (!BP.batch_schedule.empty() && !BP.adaptive_batch)
+      replay = batch_schedule::load(BP.batch_schedule);
+    batch_insert(inserts, G, Points, QPoints, BuildStats, BP.alpha, true, 2, .02,
+                 true, false);
+    report_schedule(0);
+    if (sort_neighbors) sort_by_distance(G, Points);
+  }
 
-    if (sort_neighbors) {
-      parlay::parallel_for (0, G.size(), [&] (long i) {
-        auto less = [&] (indexType j, indexType k) {
-          return Points[i].distance(Points[j]) < Points[i].distance(Points[k]);};
-        G[i].sort(less);});
+  // prints the batch sizes of each pass from first_pass, and writes them
+  // to BP.batch_schedule if they were chosen adaptively
+  void report_schedule(int first_pass) {
+    for (int i = first_pass; i < (int) schedule.passes.size(); i++)
+      std::cout << "Pass " << i << " schedule: " << schedule.summary(i) << std::endl;
+    if (BP.adaptive_batch && !BP.batch_schedule.empty()) {
+      schedule.save(BP.batch_schedule);
+      std::cout << "Wrote batch schedule to " << BP.batch_schedule << std::endl;
     }
   }
 
+  void sort_by_distance(GraphI &G, PR &Points) {
+    parlay::parallel_for (0, G.size(), [&] (long i) {
+      auto less = [&] (indexType j, indexType k) {
+        return Points[i].distance(Points[j]) < Points[i].distance(Points[k]);};
+      G[i].sort(less);});
+  }
+
   void batch_insert(parlay::sequence<indexType> &inserts,
                     GraphI &G, PR &Points, QPR &QPoints,
                     stats<indexType> &BuildStats, double alpha,
                     bool random_order = false, double base = 2,
-                    double max_fraction = .02, bool print=true) {
+                    double max_fraction = .02, bool print=true,
+                    bool grow_batches=true) {
     for(int p : inserts){
       if(p < 0 || p > (int) G.size()){
         std::cout << "ERROR: invalid point "
@@ -212,18 +365,67 @@ struct knn_index {
       rperm = parlay::random_permutation<int>(static_cast<int>(m));
     else
       rperm = parlay::tabulate(m, [&](int i) { return i; });
+    // continue a resumed pass from where its checkpoint left off
+    if (resume_state != nullptr) {
+      if (resume_state->rperm.size() != m) {
+        std::cout << "Error: checkpoint has " << resume_state->rperm.size()
+                  << " inserts but the build has " << m << std::endl;
+        abort();
+      }
+      rperm = std::move(resume_state->rperm);
+      inc = resume_state->inc;
+      count = resume_state->count;
+      frac = resume_state->frac;
+      resume_state = nullptr;
+    }
     auto shuffled_inserts =
       parlay::tabulate(m, [&](size_t i) { return inserts[rperm[i]]; });
+    // reverse edges are written into the spare slots up to R
+    if (BP.R > G.max_degree()) {
+      std::cout << "Error: R = " << BP.R << " exceeds the graph's max degree "
+                << G.max_degree() << std::endl;
+      abort();
+    }
+    reserve_pending(n);
+    // batch sizes chosen from measurements of the previous batch, or
+    // replayed from a recorded schedule, instead of the geometric ones
+    bool adaptive = BP.adaptive_batch && BP.single_batch == 0;
+    bool replaying = !adaptive && !replay.passes.empty() && BP.single_batch == 0;
+    adaptive_batch_scheduler scheduler(std::min<size_t>(m, 1000000), BP.batch_edge_target);
+    if (adaptive && count > 0) scheduler.restart(count);
+    constexpr size_t num_probes = 64, probe_every = 1024;
+    recall_probe<PR, indexType> probe(parlay::to_sequence(shuffled_inserts.cut(0, std::min(num_probes, m))));
+    size_t batch_start = count;
     parlay::internal::timer t_beam("beam search time");
     parlay::internal::timer t_bidirect("bidirect time");
     parlay::internal::timer t_prune("prune time");
     t_beam.stop();
     t_bidirect.stop();
     t_prune.stop();
+    build_telemetry &telemetry = build_telemetry::get();
+    // the sum of the degrees, kept up to date from the changes of the
+    // vertices each batch touches
+    long degree_sum = 0;
+    if (telemetry.enabled())
+      degree_sum = parlay::reduce(parlay::delayed_tabulate(n, [&] (size_t i) {
+        return (long) G[i].size();}));
     while (count < m) {
+      double beam_before = t_beam.total_time();
+      double bidirect_before = t_bidirect.total_time();
+      double prune_before = t_prune.total_time();
       size_t floor;
       size_t ceiling;
-      if (pow(base, inc) <= max_batch_size) {
+      if (adaptive || replaying) {
+        size_t size = adaptive ? scheduler.next() : replay.size(pass, inc);
+        if (size == 0) {
+          std::cout << "Error: batch schedule has no batch " << inc << " for pass "
+                    << pass << std::endl;
+          abort();
+        }
+        floor = batch_start;
+        ceiling = std::min(batch_start + size, m);
+        count = ceiling;
+      } else if (grow_batches && pow(base, inc) <= max_batch_size) {
         floor = static_cast<size_t>(pow(base, inc)) - 1;
         ceiling = std::min(static_cast<size_t>(pow(base, inc + 1)) - 1, m);
         count = std::min(static_cast<size_t>(pow(base, inc + 1)) - 1, m);
@@ -240,6 +442,9 @@ struct knn_index {
       }
 
       parlay::sequence<parlay::sequence<indexType>> new_out_(ceiling-floor);
+      // distance comparisons and degree changes of each insert
+      parlay::sequence<long> batch_dists(ceiling-floor);
+      parlay::sequence<long> batch_degrees(ceiling-floor);
       // search for each node starting from the start_point, then call
       // robustPrune with the visited list as its candidate set
       t_beam.start();
@@ -259,46 +464,106 @@ struct knn_index {
                                                                  QP);
         BuildStats.increment_dist(index, bs_distance_comps);
         BuildStats.increment_visited(index, visited.size());
+        if (deleted.count() > 0)
+          visited = parlay::filter(visited, [&] (pid x) {return !deleted.is_deleted(x.first);});
 
         long rp_distance_comps;
         std::tie(new_out_[i-floor], rp_distance_comps) = robustPrune(index, visited, G, Points, alpha);
         BuildStats.increment_dist(index, rp_distance_comps);
+        batch_dists[i-floor] = bs_distance_comps + rp_distance_comps;
       });
 
       parlay::parallel_for(floor, ceiling, [&](size_t i) {
-        G[shuffled_inserts[i]].update_neighbors(new_out_[i-floor]);
+        auto nbhs = G[shuffled_inserts[i]];
+        batch_degrees[i-floor] = (long) new_out_[i-floor].size() - (long) nbhs.size();
+        nbhs.update_neighbors(new_out_[i-floor]);
       });
 
       t_beam.stop();
 
-      // make each edge bidirectional by first adding each new edge
-      //(i,j) to a sequence, then semisorting the sequence by key values
+      // make each edge (index, ngh) bidirectional.  Degrees are frozen
+      // while each edge takes a ticket from pending[ngh]; if ngh has a
+      // spare slot for the ticket, index is written into it directly,
+      // and otherwise (ngh's spare slots overflow) the edge is kept
+      // aside.  This avoids materializing and semisorting all of the
+      // batch's edges: only the overflowing edges are grouped.
       t_bidirect.start();
-
-      auto flattened = parlay::delayed::flatten(parlay::tabulate(ceiling - floor, [&](size_t i) {
+      auto overflow = parlay::flatten(parlay::tabulate(ceiling - floor, [&](size_t i) {
         indexType index = shuffled_inserts[i + floor];
-        return parlay::delayed::map(new_out_[i], [=] (indexType ngh) {
-          return std::pair(ngh, index);});}));
-      auto grouped_by = parlay::group_by_key(parlay::delayed::to_sequence(flattened));
-
+        parlay::sequence<std::pair<indexType, indexType>> over;
+        for (indexType ngh : new_out_[i]) {
+          auto nbhs = G[ngh];
+          long d = nbhs.size();
+          if (std::find(nbhs.begin(), nbhs.begin() + d, index) != nbhs.begin() + d)
+            continue;  // already an edge
+          long ticket = pending[ngh].fetch_add(1);
+          if (d + ticket < BP.R) nbhs.begin()[d + ticket] = index;
+          else over.push_back(std::pair(ngh, index));
+        }
+        return over;
+      }));
+
+      // commit the new edges of every vertex whose spare slots sufficed
+      parlay::parallel_for(0, ceiling - floor, [&](size_t i) {
+        for (indexType ngh : new_out_[i]) {
+          long cnt = pending[ngh].exchange(0);
+          if (cnt > 0 && (long) G[ngh].size() + cnt <= BP.R) {
+            G[ngh].commit_appended(cnt);
+            batch_degrees[i] += cnt;
+          }
+        }
+      });
       t_bidirect.stop();
+
+      // finally, for the vertices that overflowed use robustPrune with
+      // user-specified alpha on the edges in their spare slots together
+      // with the overflow
       t_prune.start();
-      // finally, add the bidirectional edges; if they do not make
-      // the vertex exceed the degree bound, just add them to out_nbhs;
-      // otherwise, use robustPrune on the vertex with user-specified alpha
+      auto grouped_by = parlay::group_by_key(overflow);
+      parlay::sequence<long> prune_dists(grouped_by.size());
+      parlay::sequence<long> prune_degrees(grouped_by.size());
       parlay::parallel_for(0, grouped_by.size(), [&](size_t j) {
         auto &[index, candidates] = grouped_by[j];
-	size_t newsize = candidates.size() + G[index].size();
-        if (newsize <= BP.R) {
-	  add_neighbors_without_repeats(G[index], candidates);
-	  G[index].update_neighbors(candidates);
-        } else {
-          auto [new_out_2_, distance_comps] = robustPrune(index, std::move(candidates), G, Points, alpha);
-	  G[index].update_neighbors(new_out_2_);
-          BuildStats.increment_dist(index, distance_comps);
-        }
+        auto nbhs = G[index];
+        for (long l = nbhs.size(); l < BP.R; l++)
+          candidates.push_back(nbhs.begin()[l]);
+        auto [new_out_2_, distance_comps] = robustPrune(index, std::move(candidates), G, Points, alpha);
+        prune_degrees[j] = (long) new_out_2_.size() - (long) nbhs.size();
+        G[index].update_neighbors(new_out_2_);
+        BuildStats.increment_dist(index, distance_comps);
+        prune_dists[j] = distance_comps;
       });
       t_prune.stop();
+      schedule.add(pass, ceiling - floor);
+      batch_start = ceiling;
+
+      // the probe recall is measured once per probe_every inserts
+      double in_batch = -1, probe_recall = -1;
+      if (adaptive) {
+        double seconds = (t_beam.total_time() - beam_before) +
+          (t_bidirect.total_time() - bidirect_before) + (t_prune.total_time() - prune_before);
+        in_batch = in_batch_edges(shuffled_inserts, floor, ceiling, G, Points, alpha);
+        if (ceiling >= probe_every && floor / probe_every != ceiling / probe_every) {
+          probe.scan(Points, shuffled_inserts, ceiling);
+          probe_recall = probe.recall(G, Points, start_point, BP.L);
+        }
+        scheduler.observe(ceiling - floor, seconds, in_batch, probe_recall);
+      }
+
+      if (telemetry.enabled()) {
+        long distances = parlay::reduce(batch_dists) + parlay::reduce(prune_dists);
+        degree_sum += parlay::reduce(batch_degrees) + parlay::reduce(prune_degrees);
+        telemetry_record r("vamana", "batch");
+        r.add("pass", pass).add("batch", inc).add("size", ceiling - floor).add("inserted", ceiling)
+          .add("beam_s", t_beam.total_time() - beam_before)
+          .add("bidirect_s", t_bidirect.total_time() - bidirect_before)
+          .add("prune_s", t_prune.total_time() - prune_before)
+          .add("distance_comps", distances)
+          .add("prunes", grouped_by.size())
+          .add("avg_degree", degree_sum / (double) n);
+        if (adaptive) r.add("in_batch", in_batch).add("probe_recall", probe_recall);
+        telemetry.write(r, true);
+      }
 
       if (print && BP.single_batch == 0) {
         auto ind = frac * n;
@@ -309,6 +574,17 @@ struct knn_index {
         }
       }
       inc += 1;
+
+      if (checkpoints != nullptr && checkpoints->due()) {
+        build_state<indexType> state;
+        state.pass = pass;
+        state.inc = inc;
+        state.count = count;
+        state.frac = frac;
+        state.start_point = start_point;
+        state.rperm = rperm;
+        checkpoints->save(G, std::move(state));
+      }
     }
     t_beam.total();
     t_bidirect.total();
@@ -32,10 +32,16 @@
 #include "../utils/types.h"
 #include "../utils/graph.h"
 #include "index.h"
+#include "partitioned_build.h"
+#include "seed_graph.h"
 #include "parlay/parallel.h"
 #include "parlay/primitives.h"
 #include "parlay/random.h"
 
+// A -num_shards build is streamed from the base file by
+// partitioned_build, which neighborsTime.C calls before loading it.
+#define ANN_PARTITIONED_BUILD
+
 namespace parlayANN {
 
 template<typename PointRange, typename QPointRange, typename QQPointRange, typename indexType>
@@ -52,14 +58,22 @@ void ANN_Quantized(Graph<indexType> &G, long k, BuildParams &BP,
   indexType start_point;
   double idx_time;
   stats<unsigned int> BuildStats(G.size());
+  if (!graph_built)
+    set_telemetry_recall(G, Points, Query_Points, GT, (indexType) 0);
   if(graph_built){
     idx_time = 0;
     start_point = 0;
+  } else if (!BP.seed_graph.empty()) {
+    seed_graph(G, Q_Points, BP);
+    I.refine_index(G, Q_Points, QQ_Points, BuildStats);
+    start_point = I.get_start();
+    idx_time = t.next_time();
   } else{
     I.build_index(G, Q_Points, QQ_Points, BuildStats);
     start_point = I.get_start();
     idx_time = t.next_time();
   }
+  clear_telemetry_recall();
   std::cout << "start index = " << start_point << std::endl;
 
   std::string name = "Vamana";
@@ -82,7 +96,8 @@ void ANN_Quantized(Graph<indexType> &G, long k, BuildParams &BP,
                      QQ_Points, QQ_Query_Points,
                      GT,
                      res_file, k, false, start_point,
-                     verbose, BP.Q, BP.rerank_factor);
+                     verbose, BP.Q, BP.rerank_factor, BP.exact_visited,
+                     BP.time_limit, BP.dist_budget);
   } else if (BP.self) {
     if (BP.range) {
       parlay::internal::timer t_range("range search time");
@@ -90,19 +105,28 @@ void ANN_Quantized(Graph<indexType> &G, long k, BuildParams &BP,
       double radius_2 = BP.radius_2;
       std::cout << "radius = " << radius << " radius_2 = " << radius_2 << std::endl;
       QueryParams QP;
+      QP.time_limit = BP.time_limit;
+      QP.dist_budget = BP.dist_budget;
       long n = Points.size();
       parlay::sequence<long> counts(n);
       parlay::sequence<long> distance_comps(n);
+      parlay::sequence<long> truncated(n);
       parlay::parallel_for(0, G.size(), [&] (long i) {
         parlay::sequence<indexType> pts;
         pts.push_back(Points[i].id());
-        auto [r, dc] = range_search(Points[i], G, Points, pts, radius, radius_2, QP, true);
+        bool cut_short;
+        auto [r, dc] = range_search(Points[i], G, Points, pts, radius, radius_2, QP, true, &cut_short);
+        truncated[i] = cut_short;
         counts[i] = r.size();
         distance_comps[i] = dc;});
       t_range.total();
       long range_num_distances = parlay::reduce(distance_comps);
 
       std::cout << "edges within range: " << parlay::reduce(counts) << std::endl;
+      long num_truncated = parlay::reduce(truncated);
+      if (num_truncated > 0)
+        std::cout << num_truncated << " of " << n
+                  << " range searches ran out of time or distance budget" << std::endl;
       std::cout << "distance comparisons during build = " << build_num_distances << std::endl;
       std::cout << "distance comparisons during range = " << range_num_distances << std::endl;
     }
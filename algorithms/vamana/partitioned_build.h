@@ -0,0 +1,277 @@
+// This code is part of the Problem Based Benchmark Suite (PBBS)
+// Copyright (c) 2011 Guy Blelloch and the PBBS team
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights (to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#pragma once
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../utils/graph.h"
+#include "../utils/kmeans.h"
+#include "../utils/point_range.h"
+#include "../utils/stats.h"
+#include "../utils/types.h"
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "parlay/random.h"
+#include "index.h"
+
+namespace parlayANN {
+
+// Points of Point type stored back to back in a buffer, as in a .bin
+// file, viewed as a point range (without copying or aligning them).
+template<typename Point_>
+struct packed_points {
+  using Point = Point_;
+  const uint8_t* data;
+  long num_bytes;
+  typename Point::parameters params;
+  size_t n;
+  size_t size() const {return n;}
+  long dimension() const {return params.dims;}
+  Point operator [] (long i) const {
+    return Point((uint8_t*) (data + i * num_bytes), i, params);}
+};
+
+// The partitioned build of DiskANN, streamed from and to disk so that
+// only one shard is in memory at a time.  The base file (in .bin
+// format) is read in four passes:
+//
+//  1. k-means with BP.num_shards centroids is fit on a random sample of
+//     the points, read with one seek per sampled point.
+//  2. The points are read in blocks, and each is appended to the files
+//     of its BP.shard_overlap closest shards, <graph_file>.shard<s> (in
+//     .bin format) along with its id in <graph_file>.ids<s>.
+//  3. Each shard in turn is loaded, a Vamana graph is built on it, and
+//     its adjacency lists, translated to the original ids, are spilled
+//     to <graph_file>.graph<s>.  The shard's point and id files are then
+//     deleted.
+//  4. The spilled lists are merged in one pass over the ids, since each
+//     shard lists its points in increasing id order, and the graph is
+//     written to graph_file in the usual format.  A point in several
+//     shards takes edges from each of its lists in turn (each list is
+//     already pruned within its shard, so it starts with its closest
+//     diverse neighbors) up to a degree of R.
+//
+// So the memory used is that of the largest shard, its graph, a block
+// of points, and four bytes per point for the degrees of the graph
+// being written.  The shard graphs are connected through the points
+// that are in several shards, so shard_overlap must be at least 2.
+template<typename Point, typename indexType>
+void partitioned_build(const std::string &base_file, const std::string &graph_file,
+                       BuildParams &BP) {
+  using PR = PointRange<Point>;
+  using GraphI = Graph<indexType>;
+  parlay::internal::timer t("partitioned build");
+  long k = BP.num_shards;
+  if (!BP.checkpoint_path.empty()) {
+    std::cout << "Error: checkpoints are not supported by the partitioned build" << std::endl;
+    abort();
+  }
+  if (k < 2 || BP.shard_overlap < 2) {
+    std::cout << "Error: a partitioned build needs at least 2 shards and a shard overlap of at least 2"
+              << std::endl;
+    abort();
+  }
+
+  std::ifstream reader(base_file, std::ios::binary);
+  if (!reader.is_open()) {
+    std::cout << "Data file " << base_file << " not found" << std::endl;
+    abort();
+  }
+  unsigned int header[2];
+  reader.read((char*) header, 2 * sizeof(unsigned int));
+  size_t n = header[0];
+  unsigned int d = header[1];
+  typename Point::parameters params(d);
+  long num_bytes = params.num_bytes();
+  std::cout << "Partitioned build of " << n << " points with dimension " << d
+            << " into " << k << " shards" << std::endl;
+  auto shard_file = [&] (long s) {return graph_file + ".shard" + std::to_string(s);};
+  auto ids_file = [&] (long s) {return graph_file + ".ids" + std::to_string(s);};
+  auto spill_file = [&] (long s) {return graph_file + ".graph" + std::to_string(s);};
+  auto check = [&] (bool ok, const std::string &file) {
+    if (!ok) {
+      std::cout << "Error: could not write " << file << std::endl;
+      abort();
+    }
+  };
+
+  // 1. fit k-means on a sample
+  long m = std::min<long>(n, 256 * k);
+  auto sample_ids = parlay::random_permutation<indexType>(n);
+  sample_ids = parlay::sort(sample_ids.head(m));
+  std::vector<uint8_t> sample_data(m * num_bytes);
+  for (long i = 0; i < m; i++) {
+    reader.seekg(2 * sizeof(unsigned int) + (size_t) sample_ids[i] * num_bytes);
+    reader.read((char*) sample_data.data() + i * num_bytes, num_bytes);
+  }
+  sample_ids.clear();
+  packed_points<Point> Sample{sample_data.data(), num_bytes, params, (size_t) m};
+  kmeans<packed_points<Point>> KM(k, d);
+  KM.fit(Sample, m, 10);
+  sample_data = std::vector<uint8_t>();
+  t.next("k-means time");
+
+  // 2. write each point to its closest shards
+  std::vector<std::ofstream> shard_writers(k), ids_writers(k);
+  std::vector<unsigned int> shard_size(k, 0);
+  for (long s = 0; s < k; s++) {
+    shard_writers[s].open(shard_file(s), std::ios::binary | std::ios::out);
+    ids_writers[s].open(ids_file(s), std::ios::binary | std::ios::out);
+    unsigned int shard_header[2] = {0, d};
+    shard_writers[s].write((char*) shard_header, 2 * sizeof(unsigned int));
+  }
+  reader.seekg(2 * sizeof(unsigned int));
+  size_t BLOCK_SIZE = 100000;
+  std::vector<uint8_t> block(std::min(n, BLOCK_SIZE) * num_bytes);
+  for (size_t floor = 0; floor < n; floor += BLOCK_SIZE) {
+    size_t b = std::min(floor + BLOCK_SIZE, n) - floor;
+    reader.read((char*) block.data(), b * num_bytes);
+    packed_points<Point> Block{block.data(), num_bytes, params, b};
+    auto near = parlay::tabulate(b, [&] (size_t i) {
+      return KM.nearest(Block[i], BP.shard_overlap);});
+    // each shard's files are written by one worker, in id order
+    parlay::parallel_for(0, k, [&] (long s) {
+      for (size_t i = 0; i < b; i++)
+        for (auto [c, dist] : near[i])
+          if (c == s) {
+            indexType id = floor + i;
+            shard_writers[s].write((char*) Block.data + i * num_bytes, num_bytes);
+            ids_writers[s].write((char*) &id, sizeof(indexType));
+            shard_size[s]++;
+          }
+    }, 1);
+  }
+  reader.close();
+  block = std::vector<uint8_t>();
+  for (long s = 0; s < k; s++) {
+    shard_writers[s].seekp(0);
+    shard_writers[s].write((char*) &shard_size[s], sizeof(unsigned int));
+    shard_writers[s].close();
+    ids_writers[s].close();
+    check(!shard_writers[s].fail(), shard_file(s));
+    check(!ids_writers[s].fail(), ids_file(s));
+  }
+  t.next("partition time");
+
+  // 3. build each shard and spill its graph: a record per point of
+  // its id, its degree, and its neighbors' ids
+  for (long s = 0; s < k; s++) {
+    size_t ms = shard_size[s];
+    std::cout << "Shard " << s << " of " << k << ": " << ms << " points" << std::endl;
+    parlay::sequence<indexType> ids(ms);
+    std::ifstream ids_reader(ids_file(s), std::ios::binary);
+    ids_reader.read((char*) ids.begin(), ms * sizeof(indexType));
+    ids_reader.close();
+    std::ofstream spill(spill_file(s), std::ios::binary | std::ios::out);
+    if (ms > 0) {
+      PR SPoints((char*) shard_file(s).c_str());
+      GraphI SG(BP.R, ms);
+      // a single point gets no edges from its shard, but it is in
+      // another shard as well
+      if (ms > 1) {
+        stats<indexType> SStats(ms);
+        knn_index<PR, PR, indexType> SI(BP);
+        SI.build_index(SG, SPoints, SPoints, SStats);
+      }
+      std::vector<indexType> record;
+      for (size_t v = 0; v < ms; v++) {
+        auto nbhs = SG[v];
+        record.clear();
+        record.push_back(ids[v]);
+        record.push_back(nbhs.size());
+        for (size_t j = 0; j < nbhs.size(); j++) record.push_back(ids[nbhs[j]]);
+        spill.write((char*) record.data(), record.size() * sizeof(indexType));
+      }
+    }
+    spill.close();
+    check(!spill.fail(), spill_file(s));
+    remove(shard_file(s).c_str());
+    remove(ids_file(s).c_str());
+  }
+  t.next("shard build time");
+
+  // 4. merge the spilled lists, in id order
+  std::vector<std::ifstream> spills(k);
+  std::vector<long> next_id(k);
+  auto advance = [&] (long s) {
+    indexType id;
+    next_id[s] = spills[s].read((char*) &id, sizeof(indexType)) ? (long) id : -1;
+  };
+  for (long s = 0; s < k; s++) {
+    spills[s].open(spill_file(s), std::ios::binary);
+    advance(s);
+  }
+  std::ofstream writer(graph_file, std::ios::binary | std::ios::out);
+  indexType preamble[2] = {static_cast<indexType>(n), static_cast<indexType>(BP.R)};
+  writer.write((char*) preamble, 2 * sizeof(indexType));
+  std::vector<indexType> sizes(n, 0);
+  writer.write((char*) sizes.data(), n * sizeof(indexType));
+  std::vector<std::vector<indexType>> lists;
+  std::vector<indexType> merged;
+  for (size_t p = 0; p < n; p++) {
+    lists.clear();
+    for (long s = 0; s < k; s++) {
+      if (next_id[s] != (long) p) continue;
+      indexType deg;
+      spills[s].read((char*) &deg, sizeof(indexType));
+      lists.emplace_back(deg);
+      spills[s].read((char*) lists.back().data(), deg * sizeof(indexType));
+      advance(s);
+    }
+    // take the first edge of each list, then the second, and so on
+    merged.clear();
+    for (size_t j = 0; (long) merged.size() < BP.R; j++) {
+      bool any = false;
+      for (auto &l : lists) {
+        if (j >= l.size()) continue;
+        any = true;
+        if ((long) merged.size() < BP.R && l[j] != p &&
+            std::find(merged.begin(), merged.end(), l[j]) == merged.end())
+          merged.push_back(l[j]);
+      }
+      if (!any) break;
+    }
+    // only possible if every shard of p held p alone
+    if (merged.empty() && n > 1) merged.push_back(p == 0 ? 1 : 0);
+    sizes[p] = merged.size();
+    writer.write((char*) merged.data(), merged.size() * sizeof(indexType));
+  }
+  writer.seekp(2 * sizeof(indexType));
+  writer.write((char*) sizes.data(), n * sizeof(indexType));
+  writer.close();
+  check(!writer.fail(), graph_file);
+  for (long s = 0; s < k; s++) {
+    spills[s].close();
+    remove(spill_file(s).c_str());
+  }
+  t.next("merge time");
+  std::cout << "Wrote graph to " << graph_file << std::endl;
+}
+
+} // end namespace
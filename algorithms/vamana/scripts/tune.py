@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+# This code is part of the Problem Based Benchmark Suite (PBBS)
+# Copyright (c) 2011 Guy Blelloch and the PBBS team
+#
+# Permission is hereby granted, free of charge, to any person obtaining a
+# copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights (to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+# OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+"""Tunes the Vamana build and search parameters for a dataset.
+
+Builds small indexes on two random samples of the base set for each
+point of a grid of (R, L, alpha, num_passes), and searches them with
+the queries at fixed beam widths Q (the -Q mode of search_and_parse),
+binary searching for the smallest Q that meets the target recall.  For
+each configuration that Q, the QPS at it and the build time are
+extrapolated from the two sample sizes to the full size: the build time
+as a power of the size, with the exponent fit to the two samples (see
+build_time).  The
+cheapest configuration to build that meets the recall and QPS targets
+within the memory budget is written out as a script in the format of
+the per-dataset scripts in this folder.
+
+Example:
+  python3 tune.py -base_path data/sift/base.fbin -query_path data/sift/query.fbin \\
+      -data_type uint8 -dist_func Euclidian -k 10 -recall 0.95 -qps 5000 \\
+      -gt_path data/sift/groundtruth -memory_gb 64 -sample 200000 -out sift/tuned.sh
+
+If -gt_path is not given, the query command of the script is left
+commented out.
+"""
+
+import argparse
+import itertools
+import math
+import os
+import re
+import struct
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TYPE_BYTES = {"float": 4, "uint8": 1, "int8": 1}
+
+# printed by search_and_parse for each repetition of a fixed beam width search
+RESULT = re.compile(r"search: Q=\d+, k=\d+, limit=\d+, recall=([\d.e+-]+), .*QPS=([\d.e+-]+)")
+BUILD_TIME = re.compile(r"Graph built in ([\d.e+-]+) seconds")
+
+
+def run(cmd, log):
+  with open(log, "w") as f:
+    f.write(" ".join(cmd) + "\n")
+    f.flush()
+    p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    f.write(p.stdout)
+  if p.returncode != 0:
+    sys.exit("Error: command failed (see " + log + "): " + " ".join(cmd))
+  return p.stdout
+
+
+def header(path):
+  with open(path, "rb") as f:
+    return struct.unpack("II", f.read(8))
+
+
+def make_sample(args, m):
+  """A random sample of m base points with ground truth for the queries."""
+  base = os.path.join(args.work, "sample_%d.bin" % m)
+  gt = os.path.join(args.work, "sample_%d.gt" % m)
+  if not os.path.exists(base):
+    run([os.path.join(args.data_tools, "random_sample"), args.base_path, str(m),
+         args.data_type, base], base + ".log")
+  if not os.path.exists(gt):
+    run([os.path.join(args.data_tools, "compute_groundtruth"), "-base_path", base,
+         "-query_path", args.query_path, "-data_type", args.data_type,
+         "-dist_func", args.dist_func, "-k", str(max(args.k, 10)), "-gt_path", gt],
+        gt + ".log")
+  return base, gt
+
+
+QS = [10, 12, 14, 16, 20, 24, 28, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+      320, 384, 448, 512, 640, 768, 1024]
+
+
+def measure(args, config, m, base, gt):
+  """Builds config on a sample, returning the build time and a function
+  giving the (recall, QPS) of the searches with beam width Q."""
+  R, L, alpha, passes = config
+  tag = "%d_%d_%d_%g_%d" % (m, R, L, alpha, passes)
+  graph = os.path.join(args.work, "graph_" + tag)
+  type_args = ["-data_type", args.data_type, "-dist_func", args.dist_func, "-base_path", base]
+  out = run([args.neighbors, "-R", str(R), "-L", str(L), "-alpha", str(alpha),
+             "-num_passes", str(passes), "-graph_outfile", graph] + type_args,
+            os.path.join(args.work, "build_" + tag + ".log"))
+  build = float(BUILD_TIME.search(out).group(1))
+  results = {}
+
+  def search(Q):
+    if Q not in results:
+      out = run([args.neighbors, "-R", str(R), "-L", str(L), "-alpha", str(alpha), "-Q", str(Q),
+                 "-k", str(args.k), "-verbose", "-graph_path", graph, "-query_path", args.query_path,
+                 "-gt_path", gt] + type_args,
+                os.path.join(args.work, "search_%s_%d.log" % (tag, Q)))
+      # the search is repeated; keep the best QPS
+      runs = [(float(r.group(1)), float(r.group(2))) for r in RESULT.finditer(out)]
+      results[Q] = (runs[0][0], max(qps for _, qps in runs))
+    return results[Q]
+
+  return build, search
+
+
+def needed(search, recall):
+  """The smallest Q in QS reaching recall (found by binary search,
+  since recall grows with Q), and its QPS."""
+  lo, hi = 0, len(QS) - 1
+  if search(QS[hi])[0] < recall:
+    return None
+  while lo < hi:
+    mid = (lo + hi) // 2
+    if search(QS[mid])[0] >= recall:
+      hi = mid
+    else:
+      lo = mid + 1
+  return QS[lo], search(QS[lo])[1]
+
+
+def extrapolate(small, large, m_small, m_large, n):
+  """Extends a quantity measured at two sizes to n, linearly in log size."""
+  if m_small == m_large:
+    return large
+  slope = (large - small) / (math.log(m_large) - math.log(m_small))
+  return large + max(slope, 0) * (math.log(n) - math.log(m_large))
+
+
+def build_time(t_small, t_large, m_small, m_large, n):
+  """Extends build times measured at two sizes to n, as c * size^e with
+  e fit to the two (kept between 1 and 2, since the work is at least
+  linear, and the samples are small enough for noise to matter).  With
+  a single sample size, the work is taken to grow as n log n."""
+  if m_small == m_large or t_small <= 0 or t_large <= 0:
+    return t_large * (n / m_large) * math.log(n) / math.log(max(m_large, 2))
+  e = math.log(t_large / t_small) / math.log(m_large / m_small)
+  return t_large * (n / m_large) ** min(max(e, 1.0), 2.0)
+
+
+def main():
+  p = argparse.ArgumentParser(description=__doc__.split("\n\n")[0],
+                              formatter_class=argparse.RawDescriptionHelpFormatter)
+  p.add_argument("-base_path", required=True)
+  p.add_argument("-query_path", required=True)
+  p.add_argument("-gt_path", help="ground truth of the queries on the full base set, "
+                 "for the query command of the script")
+  p.add_argument("-data_type", required=True, choices=sorted(TYPE_BYTES))
+  p.add_argument("-dist_func", required=True, choices=["Euclidian", "mips"])
+  p.add_argument("-k", type=int, default=10)
+  p.add_argument("-recall", type=float, required=True, help="target recall@k")
+  p.add_argument("-qps", type=float, default=0, help="target QPS on this machine")
+  p.add_argument("-memory_gb", type=float, default=0, help="memory budget (0 = none)")
+  p.add_argument("-sample", type=int, default=100000,
+                 help="size of the larger sample (the smaller one is a quarter of it)")
+  p.add_argument("-R", default="32,64", help="comma separated degree bounds to try")
+  p.add_argument("-L", default="64,128", help="comma separated build beam widths to try")
+  p.add_argument("-alpha", default="1.0,1.2", help="comma separated alphas to try")
+  p.add_argument("-num_passes", default="1,2", help="comma separated numbers of passes")
+  p.add_argument("-neighbors", default=os.path.join(HERE, "..", "neighbors"))
+  p.add_argument("-data_tools", default=os.path.join(HERE, "..", "..", "..", "data_tools"))
+  p.add_argument("-work", default="tune_work", help="directory for samples and logs")
+  p.add_argument("-out", default="tuned.sh", help="script written for the chosen configuration")
+  args = p.parse_args()
+
+  n, dims = header(args.base_path)
+  m_large = min(args.sample, n)
+  m_small = max(m_large // 4, 1)
+  os.makedirs(args.work, exist_ok=True)
+  samples = {m: make_sample(args, m) for m in sorted({m_small, m_large})}
+
+  grid = list(itertools.product([int(x) for x in args.R.split(",") if int(x) > 0],
+                                [int(x) for x in args.L.split(",")],
+                                [float(x) for x in args.alpha.split(",")],
+                                [int(x) for x in args.num_passes.split(",")]))
+  grid = [c for c in grid if c[1] >= c[0]]
+
+  print("%d points of dimension %d, samples of %d and %d, %d configurations"
+        % (n, dims, m_small, m_large, len(grid)))
+  print("%-24s %10s %10s %10s %10s %10s" % ("R, L, alpha, passes", "build s", "mem GB",
+                                            "Q", "QPS", "feasible"))
+  candidates = []
+  for config in grid:
+    R = config[0]
+    measured = {m: measure(args, config, m, *samples[m]) for m in samples}
+    (t_small, sw_small), (t_large, sw_large) = measured[m_small], measured[m_large]
+    build = build_time(t_small, t_large, m_small, m_large, n)
+    memory = n * ((R + 1) * 4 + dims * TYPE_BYTES[args.data_type]) / 2**30
+    a, b = needed(sw_small, args.recall), needed(sw_large, args.recall)
+    if a is None or b is None:
+      Q = qps = None
+      feasible = False
+    else:
+      Q = int(math.ceil(extrapolate(a[0], b[0], m_small, m_large, n)))
+      # search cost grows with Q and about logarithmically in n
+      qps = b[1] * (b[0] / Q) * math.log(m_large) / math.log(n)
+      feasible = qps >= args.qps and (args.memory_gb == 0 or memory <= args.memory_gb)
+    print("%-24s %10.1f %10.2f %10s %10s %10s"
+          % ("%d, %d, %g, %d" % config, build, memory, Q if Q else "-",
+             "%.0f" % qps if qps else "-", "yes" if feasible else "no"))
+    if feasible:
+      candidates.append((build, -qps, config, Q, qps, memory))
+
+  if not candidates:
+    sys.exit("No configuration meets the targets; try a larger grid or lower targets")
+  build, _, (R, L, alpha, passes), Q, qps, memory = min(candidates)
+  print("Chosen: R = %d, L = %d, alpha = %g, num_passes = %d, Q = %d "
+        "(estimated build %.0f s, %.0f QPS, %.2f GB)" % (R, L, alpha, passes, Q, build, qps, memory))
+
+  name = os.path.splitext(os.path.basename(args.base_path))[0]
+  with open(args.out, "w") as f:
+    f.write("# bash\n")
+    f.write("# written by tune.py for recall@%d >= %g, QPS >= %g, memory <= %g GB\n"
+            % (args.k, args.recall, args.qps, args.memory_gb))
+    f.write("# estimates: build %.0f s, %.0f QPS, %.2f GB\n" % (build, qps, memory))
+    f.write("NAME=%s\n" % name)
+    f.write('BUILD_ARGS="-R %d -L %d -alpha %g -num_passes %d"\n' % (R, L, alpha, passes))
+    f.write('QUERY_ARGS="-Q %d -k %d"\n' % (Q, args.k))
+    f.write('TYPE_ARGS="-data_type %s -dist_func %s"\n\n' % (args.data_type, args.dist_func))
+    f.write("DATA_FILE=%s\n" % args.base_path)
+    f.write("QUERY_FILE=%s\n" % args.query_path)
+    if args.gt_path:
+      f.write("GROUNDTRUTH_FILE=%s\n" % args.gt_path)
+    f.write("GRAPH_FILE=%s_%d_%d_%g\n\n" % (os.path.splitext(args.base_path)[0], R, L, alpha))
+    f.write("# build\n")
+    f.write("./neighbors $BUILD_ARGS $TYPE_ARGS -base_path $DATA_FILE -graph_outfile $GRAPH_FILE\n\n")
+    f.write("# query\n")
+    query = ("./neighbors $QUERY_ARGS $TYPE_ARGS -base_path $DATA_FILE -query_path $QUERY_FILE "
+             "-gt_path $GROUNDTRUTH_FILE -graph_path $GRAPH_FILE\n")
+    if not args.gt_path:
+      f.write("# set GROUNDTRUTH_FILE to the ground truth of the queries to run the query\n")
+      f.write("# GROUNDTRUTH_FILE=\n# ")
+    f.write(query)
+  print("Wrote " + args.out)
+
+
+if __name__ == "__main__":
+  main()
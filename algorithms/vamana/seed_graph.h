@@ -0,0 +1,88 @@
+// This code is part of the Problem Based Benchmark Suite (PBBS)
+// Copyright (c) 2011 Guy Blelloch and the PBBS team
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights (to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../utils/graph.h"
+#include "../utils/prune.h"
+#include "../utils/types.h"
+#include "../HCNNG/hcnng_index.h"
+#include "../pyNNDescent/pynn_index.h"
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+
+namespace parlayANN {
+
+// Initializes the Vamana graph G (degree bound BP.R) with a pyNNDescent
+// or HCNNG graph on Points, chosen by BP.seed_graph ("pynn" or
+// "hcnng"), so that the build can start from a well connected graph and
+// only needs a refinement pass (knn_index::refine_index).  The seed
+// build uses BP.num_clusters, BP.cluster_size, BP.delta and BP.MST_deg,
+// with cheap defaults for those that are not set.  HCNNG lists longer
+// than R are pruned with alpha.
+template<typename PointRange, typename indexType>
+void seed_graph(Graph<indexType> &G, PointRange &Points, BuildParams &BP) {
+  using Point = typename PointRange::Point;
+  using distanceType = typename Point::distanceType;
+  parlay::internal::timer t("seed graph");
+  if (BP.seed_graph == "pynn") {
+    long num_clusters = BP.num_clusters > 0 ? BP.num_clusters : 10;
+    long cluster_size = BP.cluster_size > 0 ? BP.cluster_size : 100;
+    double delta = BP.delta > 0 ? BP.delta : .05;
+    std::cout << "Seeding with pyNNDescent graph: K = " << BP.R << ", "
+              << num_clusters << " clusters of size " << cluster_size << std::endl;
+    pyNN_index<Point, PointRange, indexType> I(BP.R, delta, BP.rho);
+    I.build_index(G, Points, cluster_size, num_clusters, BP.alpha);
+  } else if (BP.seed_graph == "hcnng") {
+    long num_clusters = BP.num_clusters > 0 ? BP.num_clusters : 10;
+    long cluster_size = BP.cluster_size > 0 ? BP.cluster_size : 1000;
+    long MST_deg = BP.MST_deg > 0 ? BP.MST_deg : 3;
+    std::cout << "Seeding with HCNNG graph: " << num_clusters << " trees, leaves of size "
+              << cluster_size << ", MST degree " << MST_deg << std::endl;
+    Graph<indexType> H(num_clusters * MST_deg, G.size());
+    hcnng_index<Point, PointRange, indexType> I;
+    I.build_index(H, Points, num_clusters, cluster_size, MST_deg);
+    parlay::parallel_for(0, G.size(), [&] (long i) {
+      auto nbhs = H[i];
+      if (nbhs.size() <= (size_t) BP.R) {
+        G[i].update_neighbors(parlay::tabulate(nbhs.size(), [&] (long j) {return nbhs[j];}));
+      } else {
+        std::vector<std::pair<indexType, distanceType>> candidates;
+        for (size_t j = 0; j < nbhs.size(); j++)
+          candidates.push_back(std::pair(nbhs[j], Points[i].distance(Points[nbhs[j]])));
+        auto [new_nbhs, dc] = blocked_robust_prune((indexType) i, candidates, Points,
+                                                   BP.alpha, BP.R);
+        G[i].update_neighbors(new_nbhs);
+      }
+    });
+  } else {
+    std::cout << "Error: unknown seed graph " << BP.seed_graph
+              << ", use pynn or hcnng" << std::endl;
+    abort();
+  }
+  t.next("seed graph time");
+}
+
+} // end namespace
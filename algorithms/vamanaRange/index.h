@@ -37,6 +37,7 @@
 #include "parlay/delayed.h"
 #include "parlay/random.h"
 #include "../utils/beamSearch.h"
+#include "../utils/prune.h"
 
 
 template<typename Point, typename PointRange, typename indexType>
@@ -74,45 +75,11 @@ struct knn_index {
       }
     }
 
-    // Sort the candidate set according to distance from p
-    auto less = [&](pid a, pid b) { return a.second < b.second; };
-    std::sort(candidates.begin(), candidates.end(), less);
-
-    // remove any duplicates
-    auto new_end =std::unique(candidates.begin(), candidates.end(),
-			      [&] (auto x, auto y) {return x.first == y.first;});
-    candidates = std::vector(candidates.begin(), new_end);
-    
-    std::vector<indexType> new_nbhs;
-    new_nbhs.reserve(BP.R);
-
-    size_t candidate_idx = 0;
-
-    while (new_nbhs.size() < BP.R && candidate_idx < candidates.size()) {
-      // Don't need to do modifications.
-      int p_star = candidates[candidate_idx].first;
-      candidate_idx++;
-      if (p_star == p || p_star == -1) {
-        continue;
-      }
-
-      new_nbhs.push_back(p_star);
-
-      for (size_t i = candidate_idx; i < candidates.size(); i++) {
-        int p_prime = candidates[i].first;
-        if (p_prime != -1) {
-          distance_comps++;
-          distanceType dist_starprime = Points[p_star].distance(Points[p_prime]);
-          distanceType dist_pprime = candidates[i].second;
-          if (alpha * dist_starprime <= dist_pprime) {
-            candidates[i].first = -1;
-          }
-        }
-      }
-    }
-
-    auto new_neighbors_seq = parlay::to_sequence(new_nbhs);
-    return std::pair(new_neighbors_seq, distance_comps);
+    // sort, deduplicate and prune, computing the pairwise distances
+    // between candidates in blocks
+    auto [new_nbhs, prune_comps] =
+      parlayANN::blocked_robust_prune(p, candidates, Points, alpha, BP.R);
+    return std::pair(new_nbhs, distance_comps + prune_comps);
   }
 
   //wrapper to allow calling robustPrune on a sequence of candidates 
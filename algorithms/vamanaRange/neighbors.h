@@ -95,6 +95,8 @@ void ANN(Graph<indexType> &G, long k, BuildParams &BP,
   double radius_2 = BP.radius_2;
   std::cout << "radius = " << radius << " radius_2 = " << radius_2 << std::endl;
   QueryParams QP;
+  QP.time_limit = BP.time_limit;
+  QP.dist_budget = BP.dist_budget;
   QP.limit = (long) G.size();
   QP.degree_limit = (long) G.max_degree();
   QP.cut = 1.535;
@@ -103,16 +105,23 @@ void ANN(Graph<indexType> &G, long k, BuildParams &BP,
   long n = Points.size();
   parlay::sequence<long> counts(n);
   parlay::sequence<long> distance_comps(n);
+  parlay::sequence<long> truncated(n);
   parlay::parallel_for(0, G.size(), [&] (long i) {
     parlay::sequence<indexType> pts;
     pts.push_back(Points[i].id()); //Points[i].id());
-    auto [r, dc] = range_search(Points[i], G, Points, pts, radius, radius_2, QP, true);
+    bool cut_short;
+    auto [r, dc] = range_search(Points[i], G, Points, pts, radius, radius_2, QP, true, &cut_short);
+    truncated[i] = cut_short;
     counts[i] = r.size();
     distance_comps[i] = dc;});
   t_range.total();
   long range_num_distances = parlay::reduce(distance_comps);
 
   std::cout << "edges within range: " << parlay::reduce(counts) << std::endl;
+  long num_truncated = parlay::reduce(truncated);
+  if (num_truncated > 0)
+    std::cout << num_truncated << " of " << n
+              << " range searches ran out of time or distance budget" << std::endl;
   std::cout << "distance comparisons during build = " << build_num_distances << std::endl;
   std::cout << "distance comparisons during range = " << range_num_distances << std::endl;
 
@@ -30,13 +30,18 @@
 #include "../algorithms/utils/jl_point.h"
 #include "../algorithms/utils/stats.h"
 #include "../algorithms/utils/beamSearch.h"
+#include "../algorithms/utils/query_cache.h"
 #include "../algorithms/HNSW/HNSW.hpp"
 #include "pybind11/numpy.h"
 
 #include "parlay/parallel.h"
 #include "parlay/primitives.h"
 
+#include <chrono>
 #include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
 #include <utility>
 #include <optional>
 
@@ -79,6 +84,20 @@ struct GraphIndex{
 
   std::optional<ANN::HNSW<Desc_HNSW<T, Point>>> HNSW_index;
 
+  // optional cache of query results, keyed on the exact query or on its
+  // one bit per coordinate signature
+  using SigPoint = std::conditional_t<std::is_same_v<Point, Mips_Point<T>>,
+                                      Mips_Bit_Point, Euclidean_Bit_Point>;
+  using result_cache = QueryCache<unsigned int, typename Point::distanceType>;
+  std::unique_ptr<result_cache> cache;
+  typename SigPoint::parameters sig_params;
+  bool cache_by_signature = false;
+  bool cache_refine = false;
+
+  // number of queries in the last search call that ran out of their
+  // time or distance budget
+  long last_num_truncated = 0;
+
   GraphIndex(std::string &data_path, std::string &index_path, bool is_hnsw=false)
     : use_quantization(false) {
     Points = PointRange<Point>(data_path.data());
@@ -117,7 +136,29 @@ struct GraphIndex{
     }
   }
 
-  auto search_dispatch(Point &q, QueryParams &QP, bool quant)
+  // the graph files do not record a medoid, so searches start at point 0
+  static parlay::sequence<unsigned int> default_starts() {
+    return parlay::sequence<unsigned int>(1, 0);
+  }
+
+  // queries held in a c_style numpy array, viewed as a point range so a
+  // batch can be searched without copying them
+  struct QueryArray {
+    const T* data;
+    long dims;
+    typename Point::parameters params;
+    size_t n;
+    size_t size() const {return n;}
+    Point operator[](long i) const {
+      return Point((uint8_t*) (data + i * dims), i, params);}
+  };
+
+  // parallel runs a single query with parallel_beam_search, used for
+  // large beams when only one query is in flight.  truncated (if not
+  // null) is set if the search ran out of time or distance budget.
+  auto search_dispatch(Point &q, QueryParams &QP, bool quant, bool parallel = false,
+                       parlay::sequence<unsigned int> starts = default_starts(),
+                       bool* truncated = nullptr)
   {
     // if(HNSW_index) {
     //   using indexType = unsigned int; // be consistent with the type of G
@@ -136,7 +177,6 @@ struct GraphIndex{
     // }
     //    else {
     using indexType = unsigned int;
-    parlay::sequence<indexType> starts(1, 0);
     stats<indexType> Qstats(1);
     if (quant && use_quantization) {
       int dim = Points.params.dims;
@@ -146,7 +186,9 @@ struct GraphIndex{
           for (int i=0; i < dim; i++)
             buffer[i] = q[i];
           EQuantPoint quant_q(buffer, 0, EQuant_Points.params);
-          return beam_search(quant_q, G, EQuant_Points, starts, QP).first.first;
+          if (parallel)
+            return parallel_beam_search(G, quant_q, EQuant_Points, starts, QP, 0, truncated).first.first;
+          return beam_search(quant_q, G, EQuant_Points, starts, QP, truncated).first.first;
         } else {
           // uint8_t buffer_1[dim*2];
           // EPoint::translate_point(buffer_1, q, E_Points.params);
@@ -159,11 +201,11 @@ struct GraphIndex{
             EQQuantPoint quant_qq(buffer_2, 0, EQQuant_Points.params);
             return beam_search_rerank(q, quant_q, quant_qq, G,
                                       Points, EQuant_Points, EQQuant_Points,
-                                      Qstats, starts, QP, false);
+                                      Qstats, starts, QP, false, truncated);
           } else // don't use second level quantization
             return beam_search_rerank(q, quant_q, quant_q, G,
                                       Points, EQuant_Points, EQuant_Points,
-                                      Qstats, starts, QP, false);
+                                      Qstats, starts, QP, false, truncated);
         }
       } else {
         //typename MQuantPoint::T buffer[dim];
@@ -177,16 +219,86 @@ struct GraphIndex{
           MQQuantPoint quant_qq(buffer_2, 0, MQQuant_Points.params);
           return beam_search_rerank(q, quant_q, quant_qq, G,
                                     Points, MQuant_Points, MQQuant_Points,
-                                    Qstats, starts, QP, false);
+                                    Qstats, starts, QP, false, truncated);
         } else {
           return beam_search_rerank(q, quant_q, quant_q, G,
                                     Points, MQuant_Points, MQuant_Points,
-                                    Qstats, starts, QP, false);
+                                    Qstats, starts, QP, false, truncated);
         }
       }
     } else {
-      return beam_search(q, G, Points, starts, QP).first.first;
+      if (parallel)
+        return parallel_beam_search(G, q, Points, starts, QP, 0, truncated).first.first;
+      return beam_search(q, G, Points, starts, QP, truncated).first.first;
+    }
+  }
+
+  // Turns on the result cache with the given number of entries.  With
+  // by_signature, near duplicate queries (with the same signature) also
+  // hit, and with refine a hit seeds a short search with the cached
+  // neighbors rather than being returned directly.  by_signature requires
+  // refine, since the cached results belong to a different query.
+  void enable_cache(size_t capacity, bool by_signature = false, bool refine = false) {
+    if (by_signature && !refine)
+      throw std::invalid_argument("a cache keyed by signature requires refine");
+    cache = std::make_unique<result_cache>(capacity);
+    cache_by_signature = by_signature;
+    cache_refine = refine;
+    if (by_signature) sig_params = SigPoint::generate_parameters(Points);
+  }
+
+  void disable_cache() {cache.reset();}
+
+  // drops all cached results, e.g. after the index is updated
+  void invalidate_cache() {if (cache) cache->invalidate();}
+
+  // (hits, misses, average hit latency, average miss latency), latencies in us
+  std::tuple<long, long, double, double> cache_stats() {
+    if (!cache) return std::make_tuple(0l, 0l, 0.0, 0.0);
+    return std::make_tuple(cache->num_hits(), cache->num_misses(),
+                           cache->avg_hit_latency(), cache->avg_miss_latency());
+  }
+
+  // results of searches cut short by their budget are not cached
+  // cached results are only reused by searches with the same
+  // quantization and visit and degree limits
+  uint64_t search_mode(const QueryParams &QP, bool quant) {
+    uint64_t h = parlay::hash64_2((uint64_t) (quant && use_quantization));
+    h = parlay::hash64_2(h ^ (uint64_t) QP.limit);
+    return parlay::hash64_2(h ^ (uint64_t) QP.degree_limit);
+  }
+
+  auto cached_search(Point &q, QueryParams &QP, bool quant, bool parallel = false,
+                     bool* truncated = nullptr) {
+    if (!cache) return search_dispatch(q, QP, quant, parallel, default_starts(), truncated);
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&] () {
+      return (long) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();};
+    uint64_t key = (cache_by_signature
+                    ? signature_query_key<SigPoint>(q, sig_params)
+                    : exact_query_key(q, Points.dimension()));
+    uint64_t mode = search_mode(QP, quant);
+    auto hit = cache->find(key, mode, QP.k, QP.beamSize);
+    if (hit && !cache_refine) {
+      cache->record_hit(elapsed());
+      if (truncated != nullptr) *truncated = false;
+      return std::move(*hit);
+    }
+    if (hit) {
+      QueryParams QPr = QP;
+      QPr.beamSize = std::max<long>(QP.k, QP.beamSize / 4);
+      auto starts = parlay::map(*hit, [] (auto x) {return x.first;});
+      auto frontier = search_dispatch(q, QPr, quant, false, starts, truncated);
+      cache->record_hit(elapsed());
+      return frontier;
     }
+    bool cut_short;
+    auto frontier = search_dispatch(q, QP, quant, parallel, default_starts(), &cut_short);
+    if (!cut_short) cache->insert(key, mode, QP.k, QP.beamSize, frontier);
+    cache->record_miss(elapsed());
+    if (truncated != nullptr) *truncated = cut_short;
+    return frontier;
   }
 
   NeighborsAndDistances batch_search(py::array_t<T, py::array::c_style | py::array::forcecast> &queries,
@@ -194,32 +306,52 @@ struct GraphIndex{
                                      uint64_t knn,
                                      uint64_t beam_width,
                                      bool quant = false,
-                                     int64_t visit_limit = -1) {
+                                     int64_t visit_limit = -1,
+                                     double time_limit = 0.0,
+                                     int64_t dist_budget = 0) {
     QueryParams QP(knn, beam_width, 1.35, visit_limit, std::min<int>(G.max_degree(), 3*visit_limit));
+    QP.time_limit = time_limit;
+    QP.dist_budget = dist_budget;
 
     uint64_t num_queries = queries.shape(0);
     py::array_t<unsigned int> ids({num_queries, knn});
     py::array_t<float> dists({num_queries, knn});
+    if (!cache && !(quant && use_quantization) && !HNSW_index) {
+      // search the numpy queries in place and write results straight
+      // into the numpy buffers
+      QueryArray QueryPoints{queries.data(), (long) Points.dimension(),
+                             Points.params, num_queries};
+      stats<unsigned int> QueryStats(num_queries);
+      searchAllInto(QueryPoints, G, Points, QueryStats, default_starts(), QP,
+                    ids.mutable_data(), dists.mutable_data());
+      last_num_truncated = QueryStats.num_truncated();
+      return std::make_pair(std::move(ids), std::move(dists));
+    }
 
+    parlay::sequence<long> truncated(num_queries);
     parlay::parallel_for(0, num_queries, [&] (size_t i){
       std::vector<T> v(Points.dimension());
       for (int j=0; j < v.size(); j++)
         v[j] = queries.data(i)[j];
       Point q = Point((uint8_t*) v.data(), 0, Points.params);
-      auto frontier = search_dispatch(q, QP, quant);
-      for(int j=0; j<knn; j++){
-        ids.mutable_data(i)[j] = frontier[j].first;
-        dists.mutable_data(i)[j] = frontier[j].second;
-      }
+      bool cut_short;
+      auto frontier = cached_search(q, QP, quant, false, &cut_short);
+      truncated[i] = cut_short;
+      write_neighbors(frontier, knn, ids.mutable_data(i), dists.mutable_data(i));
     });
+    last_num_truncated = parlay::reduce(truncated);
     return std::make_pair(std::move(ids), std::move(dists));
   }
 
   py::array_t<unsigned int>
   single_search(py::array_t<T>& q, uint64_t knn,
                 uint64_t beam_width, bool quant,
-                int64_t visit_limit) {
+                int64_t visit_limit,
+                double time_limit = 0.0,
+                int64_t dist_budget = 0) {
     QueryParams QP(knn, beam_width, 1.35, visit_limit, std::min<int>(G.max_degree(), 3*visit_limit));
+    QP.time_limit = time_limit;
+    QP.dist_budget = dist_budget;
     int dims = Points.dimension();
 
     py::array_t<unsigned int> ids({(long) knn});
@@ -228,9 +360,11 @@ struct GraphIndex{
     for (int j=0; j < dims; j++)
       v[j] = pp(j); //q.data()[j];
     Point p = Point((uint8_t*) v, 0, Points.params);
-    auto frontier = search_dispatch(p, QP, quant);
-    for(int j=0; j<knn; j++) 
-      ids.mutable_data()[j] = frontier[j].first;
+    bool parallel = beam_width >= parallel_beam_threshold;
+    bool cut_short;
+    auto frontier = cached_search(p, QP, quant, parallel, &cut_short);
+    last_num_truncated = cut_short;
+    write_neighbors(frontier, knn, ids.mutable_data(), (float*) nullptr);
     return std::move(ids);
   }
 
@@ -238,24 +372,42 @@ struct GraphIndex{
                                                  //uint64_t num_queries_,
                                                  uint64_t knn,
                                                  uint64_t beam_width, bool quant = false,
-                                                 int64_t visit_limit = -1) {
+                                                 int64_t visit_limit = -1,
+                                                 double time_limit = 0.0,
+                                                 int64_t dist_budget = 0) {
     QueryParams QP(knn, beam_width, 1.35, visit_limit, std::min<int>(G.max_degree(), 3*visit_limit));
+    QP.time_limit = time_limit;
+    QP.dist_budget = dist_budget;
     PointRange<Point> QueryPoints(queries.data());
     uint64_t num_queries = QueryPoints.size();
     py::array_t<unsigned int> ids({num_queries, knn});
     py::array_t<float> dists({num_queries, knn});
+    if (!(quant && use_quantization) && !HNSW_index) {
+      // write results straight into the numpy buffers
+      stats<unsigned int> QueryStats(num_queries);
+      searchAllInto(QueryPoints, G, Points, QueryStats, default_starts(), QP,
+                    ids.mutable_data(), dists.mutable_data());
+      last_num_truncated = QueryStats.num_truncated();
+      return std::make_pair(std::move(ids), std::move(dists));
+    }
+    parlay::sequence<long> truncated(num_queries);
     parlay::parallel_for(0, num_queries, [&] (size_t i){
       auto p = QueryPoints[i];
-      auto frontier = search_dispatch(p, QP, quant);
-      for(int j=0; j<knn; j++){
-        ids.mutable_data(i)[j] = frontier[j].first;
-        dists.mutable_data(i)[j] = frontier[j].second;
-      }
+      bool cut_short;
+      auto frontier = search_dispatch(p, QP, quant, false, default_starts(), &cut_short);
+      truncated[i] = cut_short;
+      write_neighbors(frontier, knn, ids.mutable_data(i), dists.mutable_data(i));
     });
+    last_num_truncated = parlay::reduce(truncated);
 
     return std::make_pair(std::move(ids), std::move(dists));
   }
 
+  // number of queries in the last batch_search, single_search or
+  // batch_search_from_string call that ran out of time or distance
+  // budget; their missing neighbors are reported as id 2^32-1
+  long num_truncated() {return last_num_truncated;}
+
   void check_recall(std::string &queries_file,
                     std::string &graph_file,
                     py::array_t<unsigned int, py::array::c_style | py::array::forcecast> &neighbors,
@@ -288,6 +440,7 @@ struct GraphIndex{
       std::set<int> reported_nbhs;
       for (unsigned int l = 0; l < k; l++) {
         long ngh = neighbors.mutable_data(i)[l];
+        if (ngh == std::numeric_limits<unsigned int>::max()) continue; // cut short
         if (ngh < 0 || ngh >= m) {
           std::cout << "neighbor reported by query out of range: " << ngh << std::endl;
           std::abort();
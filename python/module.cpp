@@ -67,12 +67,21 @@ template <typename T, typename Point> inline void add_variant(py::module_ &m, co
            "index_path"_a, "data_path"_a, "hnsw"_a=false)
       //do we want to add options like visited limit, or leave those as defaults?
       .def("batch_search", &GraphIndex<T, Point>::batch_search, "queries"_a, "knn"_a,
-           "beam_width"_a, "quant"_a, "visit_limit"_a)
+           "beam_width"_a, "quant"_a, "visit_limit"_a,
+           "time_limit"_a=0.0, "dist_budget"_a=0)
       .def("single_search", &GraphIndex<T, Point>::single_search, "q"_a, "knn"_a,
-           "beam_width"_a, "quant"_a, "visit_limit"_a)
+           "beam_width"_a, "quant"_a, "visit_limit"_a,
+           "time_limit"_a=0.0, "dist_budget"_a=0)
       .def("batch_search_from_string", &GraphIndex<T, Point>::batch_search_from_string, "queries"_a, "knn"_a,
-           "beam_width"_a, "quant"_a, "visit_limit"_a)
-      .def("check_recall", &GraphIndex<T, Point>::check_recall, "queries_file"_a, "graph_file"_a, "neighbors"_a, "k"_a);
+           "beam_width"_a, "quant"_a, "visit_limit"_a,
+           "time_limit"_a=0.0, "dist_budget"_a=0)
+      .def("num_truncated", &GraphIndex<T, Point>::num_truncated)
+      .def("check_recall", &GraphIndex<T, Point>::check_recall, "queries_file"_a, "graph_file"_a, "neighbors"_a, "k"_a)
+      .def("enable_cache", &GraphIndex<T, Point>::enable_cache, "capacity"_a,
+           "by_signature"_a=false, "refine"_a=false)
+      .def("disable_cache", &GraphIndex<T, Point>::disable_cache)
+      .def("invalidate_cache", &GraphIndex<T, Point>::invalidate_cache)
+      .def("cache_stats", &GraphIndex<T, Point>::cache_stats);
 }
 
 const Variant FloatEuclidianHCNNGVariant{"build_hcnng_float_euclidian_index", "FloatEuclidianIndex"};